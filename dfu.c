@@ -23,6 +23,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include <libusb.h>
 #include <unistd.h>
@@ -30,10 +32,31 @@
 #include "portable.h"
 #include "dfu.h"
 #include "quirks.h"
+#include "dfu_session.h"
+#include "dfu_lock.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+#include "dfu_trace.h"
+#include "dfu_record.h"
+#include "dfu_transport.h"
 #include "libdfu.h"
 
 static int dfu_timeout = 5000;  /* 5 seconds - default */
 
+DFU_TRACE_SEMAPHORES
+
+static const dfu_transport *transport = NULL;
+
+/* Stops whichever of the dfu_flash*() calls below is running */
+static dfu_cancel flash_cancel;
+static pthread_once_t flash_cancel_once = PTHREAD_ONCE_INIT;
+
+/* dfu_cancel_init() sets the clock of the token, no static initializer can */
+static void flash_cancel_init(void)
+{
+    dfu_cancel_init(&flash_cancel);
+}
+
 int verbose = 0;
 dfu_if *dfu_root = NULL;
 char *match_path = NULL;
@@ -49,6 +72,79 @@ const char *match_iface_alt_name = NULL;
 const char *match_serial = NULL;
 const char *match_serial_dfu = NULL;
 
+/* Device of a handle for the probes, as dfu_trace_dev() of a dfu_if;
+ * 0 under a transport, whose handles need not be libusb's */
+static int trace_dev(libusb_device_handle *device)
+{
+    libusb_device *dev;
+
+    if( transport )
+        return 0;
+    dev = libusb_get_device(device);
+
+    return libusb_get_bus_number(dev) << 8 | libusb_get_device_address(dev);
+}
+
+/*
+ *  All DFU requests go through here, so the recorder sees each of them
+ *  with its timing.
+ *
+ *  returns what libusb_control_transfer() returns
+ */
+int dfu_control_transfer( libusb_device_handle *device,
+                          uint8_t request_type,
+                          uint8_t request,
+                          uint16_t value,
+                          uint16_t index,
+                          unsigned char *data,
+                          uint16_t length,
+                          unsigned int timeout )
+{
+    uint64_t start = 0;
+    int result;
+
+    if( dfu_recording() )
+        start = dfu_stats_clock();
+    if( transport && transport->control )
+        result = transport->control( transport->user, device, request_type,
+                                     request, value, index, data, length,
+                                     timeout );
+    else
+        result = libusb_control_transfer( device, request_type, request,
+                                          value, index, data, length, timeout );
+    if( dfu_recording() )
+        dfu_record_control( transport ? NULL : device, request_type,
+                            request, value, index, length, data, result,
+                            start, dfu_stats_clock() );
+    return result;
+}
+
+void dfu_set_transport(const dfu_transport *t)
+{
+    transport = t;
+}
+
+const dfu_transport *dfu_get_transport(void)
+{
+    return transport;
+}
+
+int dfu_reset_device(libusb_device_handle *device)
+{
+    if( transport && transport->reset )
+        return transport->reset( transport->user, device );
+    return libusb_reset_device( device );
+}
+
+void dfu_sleep(unsigned int msec)
+{
+    if( transport && transport->sleep )
+        transport->sleep( transport->user, msec );
+    else
+        milli_sleep( msec );
+}
+
+
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
  *
@@ -63,7 +159,7 @@ int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout )
 {
-    return libusb_control_transfer( device,
+    return dfu_control_transfer( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_DETACH,
         /* wValue        */ timeout,
@@ -91,9 +187,10 @@ int dfu_download( libusb_device_handle *device,
                   const unsigned short transaction,
                   unsigned char* data )
 {
+    uint64_t start = dfu_trace_clock(dnload);
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DNLOAD,
           /* wValue        */ transaction,
@@ -101,6 +198,8 @@ int dfu_download( libusb_device_handle *device,
           /* Data          */ data,
           /* wLength       */ length,
                               dfu_timeout );
+    DFU_PROBE5(dnload, trace_dev(device), transaction, length, status,
+               dfu_trace_since(start));
     return status;
 }
 
@@ -122,9 +221,10 @@ int dfu_upload( libusb_device_handle *device,
                 const unsigned short transaction,
                 unsigned char* data )
 {
+    uint64_t start = dfu_trace_clock(upload);
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_UPLOAD,
           /* wValue        */ transaction,
@@ -132,6 +232,8 @@ int dfu_upload( libusb_device_handle *device,
           /* Data          */ data,
           /* wLength       */ length,
                               dfu_timeout );
+    DFU_PROBE5(upload, trace_dev(device), transaction, length, status,
+               dfu_trace_since(start));
     return status;
 }
 
@@ -148,6 +250,7 @@ int dfu_upload( libusb_device_handle *device,
 int dfu_get_status(dfu_if *dif, dfu_status *status )
 {
     unsigned char buffer[6];
+    uint64_t start = dfu_stats_clock();
     int result;
 
     /* Initialize the status data structure */
@@ -156,7 +259,7 @@ int dfu_get_status(dfu_if *dif, dfu_status *status )
     status->bState        = STATE_DFU_ERROR;
     status->iString       = 0;
 
-    result = libusb_control_transfer( dif->dev_handle,
+    result = dfu_control_transfer( dif->dev_handle,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATUS,
           /* wValue        */ 0,
@@ -164,6 +267,7 @@ int dfu_get_status(dfu_if *dif, dfu_status *status )
           /* Data          */ buffer,
           /* wLength       */ 6,
                               dfu_timeout );
+    dfu_stats_record(dif, DFU_STAT_GETSTATUS, start);
 
     if( 6 == result ) {
         status->bStatus = buffer[0];
@@ -177,6 +281,13 @@ int dfu_get_status(dfu_if *dif, dfu_status *status )
         status->iString = buffer[5];
     }
 
+    DFU_PROBE6(getstatus, dfu_trace_dev(dif), result, status->bState,
+               status->bStatus, status->bwPollTimeout, dfu_stats_clock() - start);
+    if( 6 == result && status->bState != dif->state ) {
+        DFU_PROBE3(state, dfu_trace_dev(dif), dif->state, status->bState);
+        dif->state = status->bState;
+    }
+
     return result;
 }
 
@@ -192,7 +303,10 @@ int dfu_get_status(dfu_if *dif, dfu_status *status )
 int dfu_clear_status( libusb_device_handle *device,
                       const unsigned short interface )
 {
-    return libusb_control_transfer( device,
+    uint64_t start = dfu_trace_clock(clrstatus);
+    int result;
+
+    result = dfu_control_transfer( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_CLRSTATUS,
         /* wValue        */ 0,
@@ -200,6 +314,8 @@ int dfu_clear_status( libusb_device_handle *device,
         /* Data          */ NULL,
         /* wLength       */ 0,
                             dfu_timeout );
+    DFU_PROBE3(clrstatus, trace_dev(device), result, dfu_trace_since(start));
+    return result;
 }
 
 
@@ -220,7 +336,7 @@ int dfu_get_state( libusb_device_handle *device,
     int result;
     unsigned char buffer[1];
 
-    result = libusb_control_transfer( device,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATE,
           /* wValue        */ 0,
@@ -249,7 +365,10 @@ int dfu_get_state( libusb_device_handle *device,
 int dfu_abort( libusb_device_handle *device,
                const unsigned short interface )
 {
-    return libusb_control_transfer( device,
+    uint64_t start = dfu_trace_clock(abort);
+    int result;
+
+    result = dfu_control_transfer( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_ABORT,
         /* wValue        */ 0,
@@ -257,6 +376,8 @@ int dfu_abort( libusb_device_handle *device,
         /* Data          */ NULL,
         /* wLength       */ 0,
                             dfu_timeout );
+    DFU_PROBE3(abort, trace_dev(device), result, dfu_trace_since(start));
+    return result;
 }
 
 
@@ -354,71 +475,142 @@ int dfu_abort_to_idle(dfu_if *dif)
 {
 	int ret;
     dfu_status dst;
+    uint64_t start = dfu_stats_clock();
 
     ret = dfu_abort(dif->dev_handle, dif->intf);
+    dfu_stats_record(dif, DFU_STAT_ABORT, start);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error sending dfu abort request");
-		exit(1);
+		warnx("Error sending dfu abort request");
+		return ret;
 	}
 	ret = dfu_get_status(dif, &dst);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error during abort get_status");
-		exit(1);
+		warnx("Error during abort get_status");
+		return ret;
 	}
 	if (dst.bState != DFU_STATE_dfuIDLE) {
-		errx(EX_IOERR, "Failed to enter idle state on abort");
-		exit(1);
+		warnx("Failed to enter idle state on abort");
+		return -EIO;
 	}
-	milli_sleep(dst.bwPollTimeout);
+	dfu_sleep(dst.bwPollTimeout);
 	return ret;
 }
 
-int dfu_flash_filename(const char *filename, int *progress, int *finished)
-{
-    int err = ENODEV;
-    int fd = open(filename, O_RDONLY);
-    if(fd > -1)
-        err = dfu_flash(fd, progress, finished);
-    close(fd);
-    return err;
-}
-
-int dfu_flash(int fd, int *progress, int *finished)
+/*
+ * Flash through a handle the application already opened. The handle
+ * stays open and owned by the caller; libusb is not initialized here.
+ * The interface must be in DFU mode already, detaching a runtime
+ * interface is up to the application. A device that waits for a reset
+ * after manifestation gets one through the handle, like any download.
+ */
+int dfu_flash_handle(libusb_device_handle *handle, int interface, int altsetting,
+                     int fd, int *progress, int *finished)
 {
-    dfu_status status;
-    libusb_context *ctx;
+    dfu_session session;
+    dfu_if *dif;
     dfu_file file;
+    int ret;
+
     memset(&file, 0, sizeof(file));
-    int ret = libusb_init(&ctx);
-    int transfer_size = 0;
-    int func_dfu_transfer_size;
-    if(dfu_root != NULL)
-        free(dfu_root);
-    dfu_root = NULL;
     *finished = 0;
-    if (ret)
+    pthread_once(&flash_cancel_once, flash_cancel_init);
+    dfu_cancel_reset(&flash_cancel);
+    if (handle == NULL)
     {
-        fprintf(stderr, "unable to initialize libusb: %s", libusb_error_name(ret));
-        return EIO;
+        *finished = 1;
+        return EINVAL;
     }
     strcpy(file.name, "");
     file.fd = fd;
-    dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
+    ret = dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
+    if (ret)
+        goto out;
 
-    if (match_vendor < 0 && file.idVendor != 0xffff)
+    dif = dfu_if_from_handle(handle, interface, altsetting);
+    if (dif == NULL)
     {
-        match_vendor = file.idVendor;
+        fprintf(stderr, "Found no DFU interface %d alt %d\n",
+                interface, altsetting);
+        ret = EINVAL;
+        goto out;
     }
-    if (match_product < 0 && file.idProduct != 0xffff)
+
+    if (!(dif->flags & DFU_IFF_DFU))
     {
-        match_product = file.idProduct;
+        fprintf(stderr, "Interface %d alt %d is in runtime mode, "
+                "detach the device first\n", interface, altsetting);
+        ret = EINVAL;
+        goto out_free;
     }
+
+    ret = dfu_check_file_id(dif, &file);
+    if (ret)
+        goto out_free;
+
+    ret = dfu_lock_device(dif);
+    if (ret)
+    {
+        if (ret == EBUSY)
+            fprintf(stderr, "DFU device is in use by another process\n");
+        else
+            fprintf(stderr, "Cannot lock DFU device: %s\n", strerror(ret));
+        goto out_free;
+    }
+
+    ret = dfu_session_attach(&session, dif);
+    if (!ret)
+    {
+        dfu_session_set_cancel(&session, &flash_cancel);
+        ret = dfu_session_download(&session, &file, progress);
+    }
+    dfu_session_close(&session);
+    dfu_unlock_device(dif);
+out_free:
+    dfu_if_free(dif);
+out:
+    free(file.firmware);
+    *finished = 1;
+    return ret;
+}
+
+void dfu_flash_cancel(void)
+{
+    pthread_once(&flash_cancel_once, flash_cancel_init);
+    dfu_cancel_request(&flash_cancel);
+}
+
+int dfu_flash_filename(const char *filename, int *progress, int *finished)
+{
+    int err = ENODEV;
+    int fd = open(filename, O_RDONLY);
+    if(fd > -1)
+        err = dfu_flash(fd, progress, finished);
+    close(fd);
+    return err;
+}
+
+/*
+ * Probe the bus and lock the one device to work on. The caller owns
+ * the libusb context and disconnects the devices afterwards.
+ */
+static int open_target(libusb_context *ctx, dfu_if **dif)
+{
+    int ret;
+
     probe_devices(ctx);
 
     if (dfu_root == NULL)
     {
-        ret = ENODEV;
-        goto out;
+        return ENODEV;
+    }
+    else if (dfu_root->next != NULL && dfu_lock_enabled())
+    {
+        /* Other processes may be flashing on the same rig,
+         * take whichever device nobody holds */
+        ret = dfu_lock_any(dif);
+        if (ret)
+            fprintf(stderr, "No free DFU capable USB device found\n");
+        return ret;
     }
     else if (dfu_root->next != NULL)
     {
@@ -429,111 +621,133 @@ int dfu_flash(int fd, int *progress, int *finished)
         fprintf(stderr, "More than one DFU capable USB device found! "
                 "Try `--list' and specify the serial number "
                 "or disconnect all but one device\n");
-        ret = ENODEV;
-        goto out;
+        return ENODEV;
     }
+    *dif = dfu_root;
+    ret = dfu_lock_device(*dif);
+    if (ret == EBUSY)
+        fprintf(stderr, "DFU device is in use by another process\n");
+    else if (ret)
+        fprintf(stderr, "Cannot lock DFU device: %s\n", strerror(ret));
+    return ret;
+}
 
-    if (((file.idVendor  != 0xffff && file.idVendor  != dfu_root->vendor) ||
-            (file.idProduct != 0xffff && file.idProduct != dfu_root->product)))
+static int flash_file(dfu_file *file, int *progress, int *finished)
+{
+    libusb_context *ctx;
+    dfu_session session;
+    dfu_if *dif;
+    int ret = libusb_init(&ctx);
+    /* drop whatever a previous call may have left behind */
+    disconnect_devices();
+    *finished = 0;
+    pthread_once(&flash_cancel_once, flash_cancel_init);
+    dfu_cancel_reset(&flash_cancel);
+    if (ret)
     {
-        fprintf(stderr, "Error: File ID %04x:%04x does "
-                "not match device (%04x:%04x)",
-                file.idVendor, file.idProduct,
-                dfu_root->vendor, dfu_root->product);
-        ret = EINVAL;
-        goto out;
+        fprintf(stderr, "unable to initialize libusb: %s", libusb_error_name(ret));
+        return EIO;
     }
 
-    ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-    if (ret || !dfu_root->dev_handle)
-        errx(EX_IOERR, "Cannot open device: %s", libusb_error_name(ret));
-
-    ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->intf);
-    if (ret < 0)
+    if (match_vendor < 0 && file->idVendor != 0xffff)
     {
-        errx(EX_IOERR, "Cannot claim interface - %s", libusb_error_name(ret));
+        match_vendor = file->idVendor;
     }
-
-    ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->intf, dfu_root->altsetting);
-    if (ret < 0)
+    if (match_product < 0 && file->idProduct != 0xffff)
     {
-        errx(EX_IOERR, "Cannot set alternate interface: %s", libusb_error_name(ret));
+        match_product = file->idProduct;
     }
 
-status_again:
-    ret = dfu_get_status(dfu_root, &status );
-    if (ret < 0)
-    {
-        fprintf(stderr, "error get_status: %s", libusb_error_name(ret));
-    }
+    ret = open_target(ctx, &dif);
+    if (ret)
+        goto out;
 
-    usleep(status.bwPollTimeout * 1000);
+    ret = dfu_check_file_id(dif, file);
+    if (ret)
+        goto out_unlock;
 
-    switch (status.bState)
-    {
-        case DFU_STATE_appIDLE:
-        case DFU_STATE_appDETACH:
-            fprintf(stderr, "Device still in Runtime Mode!");
-            break;
-        case DFU_STATE_dfuERROR:
-            if (dfu_clear_status(dfu_root->dev_handle, dfu_root->intf) < 0)
-            {
-                fprintf(stderr, "error clear_status");
-            }
-            goto status_again;
-            break;
-        case DFU_STATE_dfuDNLOAD_IDLE:
-        case DFU_STATE_dfuUPLOAD_IDLE:
-            if (dfu_abort(dfu_root->dev_handle, dfu_root->intf) < 0)
-            {
-                fprintf(stderr, "can't send DFU_ABORT");
-            }
-            goto status_again;
-            break;
-        case DFU_STATE_dfuIDLE:
-            break;
-        default:
-            break;
-    }
+    ret = dfu_session_open(&session, dif);
+    if (ret)
+        goto out_unlock;
 
-    if (DFU_STATUS_OK != status.bStatus )
-    {
-        /* Clear our status & try again. */
-        if (dfu_clear_status(dfu_root->dev_handle, dfu_root->intf) < 0)
-            fprintf(stderr, "USB communication error");
-        if (dfu_get_status(dfu_root, &status) < 0)
-            fprintf(stderr, "USB communication error");
-        if (DFU_STATUS_OK != status.bStatus)
-            fprintf(stderr, "Status is not OK: %d", status.bStatus);
-
-        usleep(status.bwPollTimeout * 1000);
-    }
+    dfu_session_set_cancel(&session, &flash_cancel);
+    ret = dfu_session_download(&session, file, progress);
 
-    func_dfu_transfer_size = libusb_le16_to_cpu(dfu_root->func_dfu.wTransferSize);
-    if (func_dfu_transfer_size)
-    {
-        if (!transfer_size)
-            transfer_size = func_dfu_transfer_size;
-    }
+    dfu_session_close(&session);
+out_unlock:
+    dfu_unlock_device(dif);
+out:
+    disconnect_devices();
+    libusb_exit(ctx);
+    *finished = 1;
+    return ret;
+}
+
+int dfu_flash(int fd, int *progress, int *finished)
+{
+    dfu_file file;
+    int ret;
+
+    memset(&file, 0, sizeof(file));
+    strcpy(file.name, "");
+    file.fd = fd;
+    ret = dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
+    if (ret)
+        *finished = 1;
     else
-    {
-        if (!transfer_size)
-            fprintf(stderr, "Transfer size must be specified");
-    }
+        ret = flash_file(&file, progress, finished);
+    free(file.firmware);
+    return ret;
+}
+
+int dfu_flash_buffer(const void *data, size_t size, int *progress, int *finished)
+{
+    dfu_file file;
+    int ret;
 
-    if (transfer_size < dfu_root->bMaxPacketSize0)
+    memset(&file, 0, sizeof(file));
+    file.fd = -1;
+    ret = dfu_load_buffer(&file, data, size, MAYBE_SUFFIX, MAYBE_PREFIX);
+    if (ret)
+        *finished = 1;
+    else
+        ret = flash_file(&file, progress, finished);
+    free(file.firmware);
+    return ret;
+}
+
+int dfu_upload_to_buffer(void *data, size_t size, size_t *received,
+                         int *progress, int *finished)
+{
+    libusb_context *ctx;
+    dfu_session session;
+    dfu_if *dif;
+    int ret = libusb_init(&ctx);
+    disconnect_devices();
+    *finished = 0;
+    pthread_once(&flash_cancel_once, flash_cancel_init);
+    dfu_cancel_reset(&flash_cancel);
+    *received = 0;
+    if (ret)
     {
-        transfer_size = dfu_root->bMaxPacketSize0;
+        fprintf(stderr, "unable to initialize libusb: %s", libusb_error_name(ret));
+        return EIO;
     }
 
-    if (dfuload_do_dnload(dfu_root, transfer_size, &file, progress) < 0)
+    ret = open_target(ctx, &dif);
+    if (ret)
+        goto out;
+
+    ret = dfu_session_open(&session, dif);
+    if (!ret)
     {
-        ret = EFAULT;
+        dfu_session_set_cancel(&session, &flash_cancel);
+        ret = dfu_session_upload_buffer(&session, data, size, received, progress, NULL);
     }
-
-    libusb_close(dfu_root->dev_handle);
-    dfu_root->dev_handle = NULL;
+    dfu_session_close(&session);
+    dfu_unlock_device(dif);
 out:
+    disconnect_devices();
     libusb_exit(ctx);
     *finished = 1;
     return ret;
@@ -97,6 +97,24 @@ typedef struct {
     unsigned char iString;
 } dfu_status;
 
+/* USB allows at most 7 tiers below the root hub */
+#define DFU_MAX_PORT_DEPTH      7
+/* "bus-port.port..." for the deepest possible chain, with NUL */
+#define DFU_MAX_PATH_LEN        32
+
+/*
+ * Where a device sits in the USB tree, recorded once by probe_devices()
+ * so that callers can group devices by hub or host controller without
+ * going back to libusb.
+ */
+typedef struct {
+    uint8_t bus;            /* bus (root hub) number */
+    uint8_t controller;     /* lowest bus number on the same host controller */
+    uint8_t depth;          /* valid entries in ports[], 0 if unknown */
+    uint8_t ports[DFU_MAX_PORT_DEPTH];
+    uint64_t hub;           /* identifies the parent hub, equal for siblings */
+} dfu_topology;
+
 typedef struct dfu_if_t {
     usb_dfu_func_descriptor func_dfu;
     uint16_t quirks;
@@ -110,10 +128,16 @@ typedef struct dfu_if_t {
     uint8_t altsetting;
     uint8_t flags;
     uint8_t bMaxPacketSize0;
+    uint8_t state;  /* bState of the last GETSTATUS, for the state probe */
     char *alt_name;
     char *serial_name;
+    char *path;     /* USB port path, NULL if unknown */
+    dfu_topology topo;
     void *dev;
     libusb_device_handle *dev_handle;
+    struct dfu_cancel *cancel;  /* set while a cancellable job runs */
+    struct dfu_stats *stats;    /* request latencies of the device */
+    struct dfu_stats *session_stats;
     struct dfu_if_t *next;
 } dfu_if;
 
@@ -136,11 +160,26 @@ extern const char *match_serial_dfu;
 #include "dfu_file.h"
 #include "dfu_load.h"
 #include "dfu_util.h"
+#include "dfu_index.h"
 #include "dfuse.h"
 #include "quirks.h"
 
 int dfu_flash(int fd, int *progress, int *finished);
-
+int dfu_flash_buffer(const void *data, size_t size, int *progress, int *finished);
+int dfu_upload_to_buffer(void *data, size_t size, size_t *received,
+                         int *progress, int *finished);
+int dfu_flash_handle(libusb_device_handle *handle, int interface, int altsetting,
+                     int fd, int *progress, int *finished);
+void dfu_flash_cancel(void);
+
+int dfu_control_transfer( libusb_device_handle *device,
+                          uint8_t request_type,
+                          uint8_t request,
+                          uint16_t value,
+                          uint16_t index,
+                          unsigned char *data,
+                          uint16_t length,
+                          unsigned int timeout );
 int dfu_detach( libusb_device_handle *device,
                 const unsigned short intf,
                 const unsigned short timeout );
@@ -0,0 +1,107 @@
+/*
+ * Simple region allocator for short-lived enumeration results
+ *
+ * Allocations are carved out of large chunks and are only ever
+ * released together, which keeps a long-running process from
+ * accumulating fragments across repeated bus scans.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfu_arena.h"
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN 16
+
+struct dfu_arena_chunk {
+	struct dfu_arena_chunk *next;
+	size_t size;
+	size_t used;
+	/* keep the payload aligned for any object type */
+	union {
+		long double ld;
+		void *p;
+		long long ll;
+	} data[];
+};
+
+static struct dfu_arena_chunk *arena_new_chunk(size_t size)
+{
+	struct dfu_arena_chunk *chunk;
+
+	if (size < ARENA_CHUNK_SIZE)
+		size = ARENA_CHUNK_SIZE;
+	chunk = dfu_malloc(sizeof(*chunk) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+void *dfu_arena_alloc(dfu_arena *arena, size_t size)
+{
+	struct dfu_arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = arena_new_chunk(size);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	ptr = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+char *dfu_arena_strdup(dfu_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = dfu_arena_alloc(arena, len);
+
+	memcpy(copy, str, len);
+	return copy;
+}
+
+/* Drop all allocations but keep the oldest chunk around for the next
+ * round, so that a steady probe/disconnect cycle does not touch malloc */
+void dfu_arena_reset(dfu_arena *arena)
+{
+	struct dfu_arena_chunk *chunk = arena->chunks;
+
+	if (chunk == NULL)
+		return;
+	while (chunk->next != NULL) {
+		struct dfu_arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	chunk->used = 0;
+	arena->chunks = chunk;
+}
+
+void dfu_arena_release(dfu_arena *arena)
+{
+	dfu_arena_reset(arena);
+	free(arena->chunks);
+	arena->chunks = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+ * Simple region allocator for short-lived enumeration results
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_ARENA_H
+#define DFU_ARENA_H
+
+#include <stddef.h>
+
+struct dfu_arena_chunk;
+
+/* Everything allocated from an arena is released at once by
+ * dfu_arena_reset() or dfu_arena_release(), never individually */
+typedef struct {
+	struct dfu_arena_chunk *chunks;	/* current chunk first */
+} dfu_arena;
+
+#define DFU_ARENA_INIT { NULL }
+
+void *dfu_arena_alloc(dfu_arena *arena, size_t size);
+char *dfu_arena_strdup(dfu_arena *arena, const char *str);
+void dfu_arena_reset(dfu_arena *arena);
+void dfu_arena_release(dfu_arena *arena);
+
+#endif /* DFU_ARENA_H */
@@ -0,0 +1,308 @@
+/*
+ * dfu-bench: time a download against a recorded device
+ *
+ *   dfu-bench [-l layout] [-s dfuse_options] [-t size] [-d device]
+ *             [-f faults|none] [-n runs] [-m seconds] [-r] [-q]
+ *             trace image
+ *
+ * Plays the trace (see dfu_record.h; dfu-flashd -r and "trace" make
+ * one) back while the library downloads the image, and prints how long
+ * the download took on the virtual clock of the replay, how much of it
+ * went into poll waits, and how many requests the trace did not have.
+ * The result depends only on the code, the trace and the image, so it
+ * can gate a CI job the way dfu-dryrun -m does.
+ *
+ * Without -l the download runs as dfu_session_download() does, with it
+ * as a DfuSe download into that layout, -s passing the options of
+ * dfuse_do_dnload() such as "0x08000000:leave". -r runs the plan of
+ * the download on a dfu_reactor instead, the way many devices are
+ * flashed at once.
+ *
+ * The timed runs are followed by as many runs with faults injected at
+ * DEFAULT_FAULTS, or at the rates given with -f as for
+ * dfu_fault_parse(), e.g. "stall=0.02,poll=0.05,seed=1", with seeds
+ * counting up from there; -f none leaves them out. Their summary adds
+ * how many runs went through, the faults injected and the mean time
+ * from a fault to the next request that succeeded. A stalled poll is
+ * retried with the last poll timeout, as the STM32L4 workaround does,
+ * so stalls are what a run should recover from; a failed run is
+ * counted and the next one starts. Only runs with faults given by -f
+ * fail the exit status, the default profile reports.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfu_session.h"
+#include "dfu_plan.h"
+#include "dfu_reactor.h"
+#include "dfu_replay.h"
+#include "dfu_fault.h"
+
+/* Misbehaviour seen in the field that a download should ride out */
+#define DEFAULT_FAULTS "stall=0.02,poll=0.05,seed=1"
+
+typedef struct {
+	const char *layout;
+	const char *options;
+	int reactor;
+} bench_config;
+
+typedef struct {
+	int good;
+	double seconds;		/* mean of the good runs */
+	double worst;
+	dfu_replay_result result;	/* of the last run */
+	unsigned int injected[DFU_FAULT_NUM_KINDS];
+	unsigned int recovered;
+	uint64_t recovery;
+} bench_result;
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-l layout] [-s dfuse_options] "
+		"[-t transfer_size] [-d device] [-f faults|none] [-n runs] "
+		"[-m max_seconds] [-r] [-q] trace image\n", name);
+	exit(EX_USAGE);
+}
+
+static int reactor_download(dfu_session *session, dfu_image *image)
+{
+	dfu_reactor *reactor;
+	dfu_plan plan;
+	int ret;
+
+	ret = dfu_plan_build(&plan, session->dif, &image->file,
+			     session->transfer_size, -1);
+	if (ret)
+		return ret;
+	/* created under the replay, so it runs on it */
+	reactor = dfu_reactor_create(NULL);
+	ret = dfu_reactor_add(reactor, session, &plan, NULL, NULL, NULL);
+	if (!ret)
+		ret = dfu_reactor_run(reactor);
+	dfu_reactor_destroy(reactor);
+	dfu_plan_free(&plan);
+	return ret;
+}
+
+static int download(dfu_session *session, dfu_image *image,
+		    const bench_config *config)
+{
+	int percent;
+	int ret;
+
+	if (config->reactor)
+		return reactor_download(session, image);
+	if (config->layout == NULL)
+		return dfu_session_download(session, &image->file, &percent);
+	ret = dfuse_do_dnload(session->dif, session->transfer_size,
+			      &image->file, config->options);
+	return ret < 0 ? EIO : 0;
+}
+
+/* runs downloads, with faults at rates unless NULL */
+static void bench(bench_result *res, dfu_replay *replay,
+		  dfu_session *session, dfu_image *image,
+		  const bench_config *config, const dfu_fault_rates *rates,
+		  int runs)
+{
+	dfu_fault_rates seeded;
+	dfu_fault fault;
+	int kind;
+	int ret;
+	int i;
+
+	memset(res, 0, sizeof(*res));
+	if (rates)
+		seeded = *rates;
+	for (i = 0; i < runs; i++) {
+		dfu_replay_start(replay);
+		if (rates) {
+			dfu_fault_start(&fault, &seeded);
+			seeded.seed++;
+		}
+		ret = download(session, image, config);
+		if (rates) {
+			dfu_fault_stop(&fault);
+			for (kind = 0; kind < DFU_FAULT_NUM_KINDS; kind++)
+				res->injected[kind] += fault.injected[kind];
+			res->recovered += fault.recovered;
+			res->recovery += fault.recovery;
+		}
+		dfu_replay_stop(replay, &res->result);
+		if (ret) {
+			if (verbose || (runs == 1 && !rates))
+				warnx("Download failed: %s", strerror(ret));
+			continue;
+		}
+		res->good++;
+		res->seconds += res->result.elapsed / 1e6;
+		if (res->result.elapsed / 1e6 > res->worst)
+			res->worst = res->result.elapsed / 1e6;
+	}
+	if (res->good)
+		res->seconds /= res->good;
+}
+
+static void print_summary(const bench_result *res, int runs, size_t payload)
+{
+	printf("%d of %d runs ok, %.3f s mean, %.3f s worst",
+	       res->good, runs, res->seconds, res->worst);
+	if (res->seconds > 0)
+		printf(", %.0f B/s", payload / res->seconds);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	dfu_fault_rates rates;
+	bench_config config;
+	bench_result timed;
+	bench_result faulty;
+	dfu_session session;
+	dfu_replay *replay;
+	dfu_image *image;
+	dfu_if dif;
+	const char *faults = DEFAULT_FAULTS;
+	int faults_given = 0;
+	double limit = 0;
+	size_t payload;
+	int xfer_size = 2048;
+	int device = -1;
+	int runs = 1;
+	int quiet = 0;
+	int opt;
+	int ret;
+
+	memset(&config, 0, sizeof(config));
+	while ((opt = getopt(argc, argv, "l:s:t:d:f:n:m:rqvh")) != -1) {
+		switch (opt) {
+		case 'l':
+			config.layout = optarg;
+			break;
+		case 's':
+			config.options = optarg;
+			break;
+		case 't':
+			xfer_size = atoi(optarg);
+			break;
+		case 'd':
+			device = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			faults = strcmp(optarg, "none") ? optarg : NULL;
+			faults_given = 1;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			if (runs < 1)
+				usage(argv[0]);
+			break;
+		case 'm':
+			limit = atof(optarg);
+			break;
+		case 'r':
+			config.reactor = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+	/* a reactor plan starts at the layout, options are dfuse_do_dnload()'s */
+	if (config.reactor && config.options)
+		errx(EX_USAGE, "-s does not go with -r");
+	memset(&rates, 0, sizeof(rates));
+	if (faults && dfu_fault_parse(&rates, faults))
+		errx(EX_USAGE, "Bad fault rates \"%s\"", faults);
+
+	replay = dfu_replay_load(argv[optind], device, &ret);
+	if (replay == NULL)
+		errx(EX_IOERR, "Cannot read trace %s: %s", argv[optind],
+		     strerror(ret));
+	image = dfu_image_load(argv[optind + 1]);
+	if (image == NULL)
+		err(EX_IOERR, "Cannot read %s", argv[optind + 1]);
+	payload = image->file.size.total - image->file.size.prefix -
+		  image->file.size.suffix;
+
+	/* the handle only has to be there, the replay answers for it */
+	memset(&dif, 0, sizeof(dif));
+	dif.dev_handle = (libusb_device_handle *) &dif;
+	if (config.layout) {
+		dif.func_dfu.bcdDFUVersion = libusb_cpu_to_le16(0x11a);
+		dif.alt_name = dfu_malloc(strlen(config.layout) + 1);
+		strcpy(dif.alt_name, config.layout);
+	}
+	memset(&session, 0, sizeof(session));
+	session.dif = &dif;
+	session.transfer_size = xfer_size;
+
+	bench(&timed, replay, &session, image, &config, NULL, runs);
+	if (faults)
+		bench(&faulty, replay, &session, image, &config, &rates, runs);
+
+	if (quiet) {
+		printf("%.3f\n", timed.seconds);
+	} else {
+		if (runs == 1) {
+			printf("%.3f s, %.3f s waiting, %u requests, %u polls, "
+			       "%u mismatches", timed.seconds,
+			       timed.result.waited / 1e6, timed.result.requests,
+			       timed.result.polls, timed.result.mismatches);
+			if (timed.seconds > 0)
+				printf(", %.0f B/s", payload / timed.seconds);
+			printf("\n");
+		} else {
+			print_summary(&timed, runs, payload);
+		}
+		if (faults) {
+			printf("with faults %s: ", faults);
+			print_summary(&faulty, runs, payload);
+			printf("injected");
+			for (opt = 0; opt < DFU_FAULT_NUM_KINDS; opt++)
+				printf(" %s=%u", dfu_fault_kind_name(opt),
+				       faulty.injected[opt]);
+			printf(", recovered from %u in %.1f ms mean\n",
+			       faulty.recovered, faulty.recovered ?
+			       faulty.recovery / 1e3 / faulty.recovered : 0.0);
+		}
+	}
+
+	free(dif.alt_name);
+	dfu_image_unref(image);
+	dfu_replay_free(replay);
+	if (timed.good < runs ||
+	    (faults && faults_given && faulty.good < runs))
+		return EX_SOFTWARE;
+	return limit > 0 && timed.seconds > limit ? 1 : 0;
+}
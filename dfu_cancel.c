@@ -0,0 +1,125 @@
+/*
+ * Cancelling a transfer from another thread
+ *
+ * A scheduler that wants a device back for an urgent job sets the
+ * token of the job running on it. The loops notice between requests,
+ * and a poll wait, which can be seconds during an erase, is a timed
+ * wait on the token's condition variable rather than a plain sleep.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+#include "dfu_transport.h"
+
+void dfu_cancel_init(dfu_cancel *cancel)
+{
+	pthread_condattr_t attr;
+
+	cancel->cancelled = 0;
+	pthread_mutex_init(&cancel->lock, NULL);
+	/* poll waits must not stretch or shrink when the wall clock steps */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cancel->wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void dfu_cancel_destroy(dfu_cancel *cancel)
+{
+	pthread_cond_destroy(&cancel->wake);
+	pthread_mutex_destroy(&cancel->lock);
+}
+
+void dfu_cancel_request(dfu_cancel *cancel)
+{
+	pthread_mutex_lock(&cancel->lock);
+	__atomic_store_n(&cancel->cancelled, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&cancel->wake);
+	pthread_mutex_unlock(&cancel->lock);
+}
+
+void dfu_cancel_reset(dfu_cancel *cancel)
+{
+	__atomic_store_n(&cancel->cancelled, 0, __ATOMIC_SEQ_CST);
+}
+
+int dfu_cancelled(dfu_cancel *cancel)
+{
+	return cancel != NULL && __atomic_load_n(&cancel->cancelled, __ATOMIC_SEQ_CST);
+}
+
+int dfu_cancel_sleep(dfu_cancel *cancel, unsigned int msec)
+{
+	struct timespec until;
+	int ret = 0;
+
+	if (cancel == NULL) {
+		dfu_sleep(msec);
+		return 0;
+	}
+	/* a transport's clock is its own, poll the token around its sleep */
+	if (dfu_get_transport() && dfu_get_transport()->sleep) {
+		dfu_sleep(msec);
+		return dfu_cancelled(cancel) ? ECANCELED : 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += msec / 1000;
+	until.tv_nsec += (msec % 1000) * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&cancel->lock);
+	while (!cancel->cancelled && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&cancel->wake, &cancel->lock, &until);
+	ret = cancel->cancelled ? ECANCELED : 0;
+	pthread_mutex_unlock(&cancel->lock);
+	return ret;
+}
+
+int dfu_cancel_abort(dfu_if *dif)
+{
+	uint64_t start = dfu_stats_clock();
+	dfu_status dst;
+	int ret;
+
+	ret = dfu_abort(dif->dev_handle, dif->intf);
+	dfu_stats_record(dif, DFU_STAT_ABORT, start);
+	if (ret >= 0)
+		return -ECANCELED;
+	/* stalled, most likely in dfuERROR or still busy */
+	if (dfu_get_status(dif, &dst) >= 0 &&
+	    dst.bState == DFU_STATE_dfuERROR) {
+		start = dfu_stats_clock();
+		ret = dfu_clear_status(dif->dev_handle, dif->intf);
+		dfu_stats_record(dif, DFU_STAT_CLRSTATUS, start);
+		if (ret >= 0)
+			return -ECANCELED;
+	}
+	if (verbose)
+		fprintf(stderr, "Device did not take the abort, "
+			"leaving it to finish\n");
+	return -ECANCELED;
+}
@@ -0,0 +1,60 @@
+/*
+ * Cancelling a transfer from another thread
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_CANCEL_H
+#define DFU_CANCEL_H
+
+#include <pthread.h>
+
+typedef struct dfu_if_t dfu_if;
+
+/*
+ * A token is attached to an interface (dfu_if.cancel) for as long as
+ * something runs on it. Transfer, erase and poll loops check it between
+ * requests and poll waits return as soon as it is set.
+ */
+typedef struct dfu_cancel {
+	int cancelled;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} dfu_cancel;
+
+/* Waits run on CLOCK_MONOTONIC, so there is no static initializer */
+void dfu_cancel_init(dfu_cancel *cancel);
+void dfu_cancel_destroy(dfu_cancel *cancel);
+
+/* From any thread; stays set until dfu_cancel_reset() */
+void dfu_cancel_request(dfu_cancel *cancel);
+void dfu_cancel_reset(dfu_cancel *cancel);
+
+/* 0 for a NULL token */
+int dfu_cancelled(dfu_cancel *cancel);
+
+/* milli_sleep() that returns ECANCELED early once the token is set */
+int dfu_cancel_sleep(dfu_cancel *cancel, unsigned int msec);
+
+/*
+ * Stop what the device is doing and send it back to dfuIDLE the quick
+ * way: ABORT, and on a stall one GETSTATUS and CLRSTATUS out of
+ * dfuERROR, without waiting out poll timeouts. A device still busy
+ * erasing is left to finish; the next session open brings it to
+ * dfuIDLE. Returns -ECANCELED, for the loops to pass up.
+ */
+int dfu_cancel_abort(dfu_if *dif);
+
+#endif /* DFU_CANCEL_H */
@@ -0,0 +1,115 @@
+/*
+ * dfu-dryrun: print the requests a download would make, and how long
+ * it should take, without a device
+ *
+ *   dfu-dryrun [-l layout] [-a alt] [-t size] [-s address]
+ *              [-p profile] [-m seconds] [-q] image
+ *
+ * Without -l the plan is a plain DFU download, with it a DfuSe one for
+ * the given layout string, e.g. "@Internal Flash /0x08000000/04*016Kg".
+ * -p overrides the timing profile, see dfu_timing_parse(). With -m the
+ * exit status is 1 when the estimate is over the limit, for CI.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfu_plan.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-l layout] [-a alt] [-t transfer_size] "
+		"[-s address] [-p profile] [-m max_seconds] [-q] image\n", name);
+	exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+	dfu_timing timing = dfu_timing_default;
+	dfu_plan_estimate estimate;
+	const char *layout = NULL;
+	int64_t address = -1;
+	double limit = 0;
+	int xfer_size = 2048;
+	int altsetting = 0;
+	int quiet = 0;
+	dfu_image *image;
+	dfu_plan plan;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "l:a:t:s:p:m:qvh")) != -1) {
+		switch (opt) {
+		case 'l':
+			layout = optarg;
+			break;
+		case 'a':
+			altsetting = atoi(optarg);
+			break;
+		case 't':
+			xfer_size = atoi(optarg);
+			break;
+		case 's':
+			address = strtoll(optarg, NULL, 0);
+			break;
+		case 'p':
+			if (dfu_timing_parse(&timing, optarg))
+				errx(EX_USAGE, "Bad timing profile \"%s\"", optarg);
+			break;
+		case 'm':
+			limit = atof(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	image = dfu_image_load(argv[optind]);
+	if (image == NULL)
+		err(EX_IOERR, "Cannot read %s", argv[optind]);
+
+	ret = dfu_plan_layout(&plan, layout, altsetting, &image->file,
+			      xfer_size, address);
+	if (ret)
+		errx(EX_SOFTWARE, "Cannot plan the download: %s", strerror(ret));
+
+	if (quiet) {
+		dfu_plan_estimate_time(&plan, &timing, &estimate);
+		printf("%.3f\n", estimate.total);
+	} else {
+		dfu_plan_print(stdout, &plan, &timing);
+		dfu_plan_estimate_time(&plan, &timing, &estimate);
+	}
+
+	dfu_plan_free(&plan);
+	dfu_image_unref(image);
+	return limit > 0 && estimate.total > limit ? 1 : 0;
+}
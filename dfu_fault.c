@@ -0,0 +1,214 @@
+/*
+ * Fault injection between the library and its transport
+ *
+ * The workarounds for devices that stall the pipe while polled, report
+ * a zero poll timeout or drop off the bus used to run only on the
+ * hardware that needed them. Stacked on a replay, this layer makes
+ * those faults happen at set rates from a seeded generator, so a
+ * benchmark can show how long recovering takes and whether a retry
+ * turned into a stall.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_stats.h"
+#include "dfu_fault.h"
+
+static const char *kind_names[DFU_FAULT_NUM_KINDS] = {
+	"stall", "timeout", "drop", "poll", "reset"
+};
+
+const char *dfu_fault_kind_name(enum dfu_fault_kind kind)
+{
+	if ((unsigned int) kind >= DFU_FAULT_NUM_KINDS)
+		return "unknown";
+	return kind_names[kind];
+}
+
+int dfu_fault_parse(dfu_fault_rates *rates, const char *spec)
+{
+	while (*spec) {
+		size_t len = strcspn(spec, "=");
+		char *end;
+		double value;
+		int i;
+
+		if (spec[len] != '=')
+			return EINVAL;
+		value = strtod(spec + len + 1, &end);
+		if (end == spec + len + 1 || (*end && *end != ',') || value < 0)
+			return EINVAL;
+		if (len == 4 && !strncmp(spec, "seed", 4)) {
+			rates->seed = (unsigned int) value;
+		} else {
+			for (i = 0; i < DFU_FAULT_NUM_KINDS; i++)
+				if (strlen(kind_names[i]) == len &&
+				    !strncmp(spec, kind_names[i], len))
+					break;
+			if (i == DFU_FAULT_NUM_KINDS || value > 1)
+				return EINVAL;
+			rates->rate[i] = value;
+		}
+		spec = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* xorshift64*, plenty for picking faults and the same on every host */
+static double next_random(dfu_fault *fault)
+{
+	uint64_t x = fault->state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	fault->state = x;
+	return ((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int roll(dfu_fault *fault, enum dfu_fault_kind kind)
+{
+	return fault->rates.rate[kind] > 0 &&
+	       next_random(fault) < fault->rates.rate[kind];
+}
+
+static uint64_t now(const dfu_fault *fault)
+{
+	if (fault->below && fault->below->clock)
+		return fault->below->clock(fault->below->user);
+	return dfu_stats_clock();
+}
+
+static void below_sleep(const dfu_fault *fault, unsigned int msec)
+{
+	if (fault->below && fault->below->sleep)
+		fault->below->sleep(fault->below->user, msec);
+	else
+		milli_sleep(msec);
+}
+
+static int inject(dfu_fault *fault, enum dfu_fault_kind kind, int result)
+{
+	fault->injected[kind]++;
+	if (!fault->pending) {
+		fault->pending = 1;
+		fault->fault_time = now(fault);
+	}
+	return result;
+}
+
+static int fault_control(void *user, libusb_device_handle *device,
+			 uint8_t request_type, uint8_t request, uint16_t value,
+			 uint16_t index, unsigned char *data, uint16_t length,
+			 unsigned int timeout)
+{
+	dfu_fault *fault = user;
+	int status = request == DFU_GETSTATUS &&
+		     (request_type & LIBUSB_ENDPOINT_IN);
+	unsigned int poll;
+	int ret;
+
+	if (fault->gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if (roll(fault, DFU_FAULT_RESET)) {
+		fault->gone = 1;
+		return inject(fault, DFU_FAULT_RESET, LIBUSB_ERROR_NO_DEVICE);
+	}
+	if (roll(fault, DFU_FAULT_TIMEOUT)) {
+		below_sleep(fault, timeout);
+		return inject(fault, DFU_FAULT_TIMEOUT, LIBUSB_ERROR_TIMEOUT);
+	}
+	if (status && roll(fault, DFU_FAULT_STALL))
+		return inject(fault, DFU_FAULT_STALL, LIBUSB_ERROR_PIPE);
+
+	if (fault->below && fault->below->control)
+		ret = fault->below->control(fault->below->user, device,
+					    request_type, request, value,
+					    index, data, length, timeout);
+	else
+		ret = libusb_control_transfer(device, request_type, request,
+					      value, index, data, length,
+					      timeout);
+	if (status && ret >= 6 && roll(fault, DFU_FAULT_DROP_STATUS)) {
+		below_sleep(fault, timeout);
+		return inject(fault, DFU_FAULT_DROP_STATUS, LIBUSB_ERROR_TIMEOUT);
+	}
+
+	if (ret >= 0 && fault->pending) {
+		fault->pending = 0;
+		fault->recovered++;
+		fault->recovery += now(fault) - fault->fault_time;
+	}
+
+	if (status && ret >= 6 && roll(fault, DFU_FAULT_BOGUS_POLL)) {
+		poll = data[1] | (data[2] << 8) | (data[3] << 16);
+		poll = next_random(fault) < 0.5 ? 0 : poll * 10;
+		if (poll > 0xffffff)
+			poll = 0xffffff;
+		data[1] = poll & 0xff;
+		data[2] = (poll >> 8) & 0xff;
+		data[3] = (poll >> 16) & 0xff;
+		inject(fault, DFU_FAULT_BOGUS_POLL, ret);
+	}
+	return ret;
+}
+
+static int fault_reset(void *user, libusb_device_handle *device)
+{
+	dfu_fault *fault = user;
+
+	fault->gone = 0;
+	if (fault->below && fault->below->reset)
+		return fault->below->reset(fault->below->user, device);
+	return libusb_reset_device(device);
+}
+
+static void fault_sleep(void *user, unsigned int msec)
+{
+	below_sleep(user, msec);
+}
+
+static uint64_t fault_clock(void *user)
+{
+	return now(user);
+}
+
+void dfu_fault_start(dfu_fault *fault, const dfu_fault_rates *rates)
+{
+	memset(fault, 0, sizeof(*fault));
+	fault->rates = *rates;
+	/* xorshift must not start from 0 */
+	fault->state = 0x9e3779b97f4a7c15ULL ^ rates->seed;
+	fault->below = dfu_get_transport();
+	fault->transport.control = fault_control;
+	fault->transport.reset = fault_reset;
+	fault->transport.sleep = fault_sleep;
+	fault->transport.clock = fault_clock;
+	fault->transport.user = fault;
+	dfu_set_transport(&fault->transport);
+}
+
+void dfu_fault_stop(dfu_fault *fault)
+{
+	dfu_set_transport(fault->below);
+}
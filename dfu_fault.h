@@ -0,0 +1,71 @@
+/*
+ * Fault injection between the library and its transport
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_FAULT_H
+#define DFU_FAULT_H
+
+#include <stdint.h>
+
+#include "dfu_transport.h"
+
+enum dfu_fault_kind {
+	DFU_FAULT_STALL,	/* LIBUSB_ERROR_PIPE, the device never sees it */
+	DFU_FAULT_TIMEOUT,	/* the same after the request's timeout */
+	DFU_FAULT_DROP_STATUS,	/* GETSTATUS done by the device, reply lost */
+	DFU_FAULT_BOGUS_POLL,	/* bwPollTimeout of a reply 0 or ten times it */
+	DFU_FAULT_RESET,	/* LIBUSB_ERROR_NO_DEVICE until a reset */
+	DFU_FAULT_NUM_KINDS
+};
+
+/*
+ * Probability of each fault per request. Stalls, dropped replies and
+ * bogus poll timeouts hit GETSTATUS only, the way devices misbehave;
+ * timeouts and resets any request.
+ */
+typedef struct {
+	double rate[DFU_FAULT_NUM_KINDS];
+	unsigned int seed;
+} dfu_fault_rates;
+
+/* "stall=0.01,timeout=0.001,drop=0.01,poll=0.05,reset=0.0001,seed=N" */
+int dfu_fault_parse(dfu_fault_rates *rates, const char *spec);
+
+typedef struct {
+	dfu_fault_rates rates;
+	dfu_transport transport;
+	const dfu_transport *below;
+	uint64_t state;		/* of the random numbers */
+	int gone;		/* reset, until dfu_reset_device() */
+	/* report */
+	unsigned int injected[DFU_FAULT_NUM_KINDS];
+	unsigned int recovered;	/* runs of faults a request succeeded after */
+	uint64_t recovery;	/* us from the first fault of each to that */
+	int pending;		/* a run of faults not recovered from yet */
+	uint64_t fault_time;	/* of its first fault */
+} dfu_fault;
+
+/*
+ * Stack on top of the current transport, which may be a replay, with
+ * the same seed giving the same faults. Stop in the reverse order.
+ */
+void dfu_fault_start(dfu_fault *fault, const dfu_fault_rates *rates);
+void dfu_fault_stop(dfu_fault *fault);
+
+const char *dfu_fault_kind_name(enum dfu_fault_kind kind);
+
+#endif /* DFU_FAULT_H */
@@ -35,6 +35,8 @@
 
 #include "portable.h"
 #include "dfu_file.h"
+#include "dfu_writer.h"
+#include "dfu_hash.h"
 
 #define DFU_SUFFIX_LENGTH 16
 #define LMDFU_PREFIX_LENGTH 8
@@ -42,56 +44,6 @@
 #define PROGRESS_BAR_WIDTH 25
 #define STDIN_CHUNK_SIZE 65536
 
-static const unsigned long crc32_table[] = {
-    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
-
-static uint32_t crc32_byte(uint32_t accum, uint8_t delta)
-{
-        return crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
-}
-
 static int probe_prefix(dfu_file *file)
 {
 	uint8_t *prefix = file->firmware;
@@ -170,11 +122,8 @@ void *dfu_malloc(size_t size)
 
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
 {
-	int x;
-
 	/* compute CRC */
-	for (x = 0; x != size; x++)
-		crc = crc32_byte(crc, ((uint8_t *)buf)[x]);
+	crc = dfu_crc32(crc, buf, size);
 
 	/* write data */
 	if (write(f, buf, size) != size)
@@ -183,13 +132,87 @@ uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
 	return (crc);
 }
 
-void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix)
+void dfu_sink_fd(dfu_sink *sink, int fd)
 {
-	off_t offset;
-	int f;
-	int i;
-	int res;
+	memset(sink, 0, sizeof(*sink));
+	sink->fd = fd;
+}
+
+void dfu_sink_buffer(dfu_sink *sink, void *buf, size_t capacity)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->fd = -1;
+	sink->buf = buf;
+	sink->capacity = capacity;
+}
+
+/*
+ * Where the next block of up to size bytes goes: straight into the
+ * buffer or the writer's ring where possible, else a scratch block.
+ */
+void *dfu_sink_next(dfu_sink *sink, int size)
+{
+	if (sink->writer != NULL) {
+		sink->block = dfu_writer_next(sink->writer);
+		return sink->block;
+	}
+	if (sink->fd < 0 && (size_t) size <= sink->capacity - sink->size) {
+		sink->block = sink->buf + sink->size;
+		return sink->block;
+	}
+	if (size > sink->scratch_size) {
+		free(sink->scratch);
+		sink->scratch = dfu_malloc(size);
+		sink->scratch_size = size;
+	}
+	sink->block = sink->scratch;
+	return sink->block;
+}
 
+/* Whatever does not fit in a buffer sink is dropped */
+void dfu_sink_commit(dfu_sink *sink, int size)
+{
+	if (sink->writer != NULL) {
+		dfu_writer_commit(sink->writer, size);
+	} else if (sink->fd > -1) {
+		if (!sink->error && write(sink->fd, sink->block, size) != size)
+			sink->error = errno ? errno : EIO;
+	} else {
+		if ((size_t) size > sink->capacity - sink->size)
+			size = sink->capacity - sink->size;
+		if (sink->block != sink->buf + sink->size)
+			memcpy(sink->buf + sink->size, sink->block, size);
+	}
+	if (sink->hash != NULL)
+		dfu_hash_update(sink->hash, sink->block, size);
+	sink->size += size;
+	if (sink->percent != NULL && sink->capacity)
+		*sink->percent = (int) (sink->size * 100 / sink->capacity);
+}
+
+int dfu_sink_full(const dfu_sink *sink)
+{
+	return sink->fd < 0 && sink->size == sink->capacity;
+}
+
+/* Returns 0, or the errno of the first failed write */
+int dfu_sink_close(dfu_sink *sink)
+{
+	int ret = 0;
+
+	if (sink->writer != NULL)
+		ret = dfu_writer_close(sink->writer);
+	else
+		ret = sink->error;
+	sink->writer = NULL;
+	free(sink->scratch);
+	sink->scratch = NULL;
+	sink->scratch_size = 0;
+	return ret;
+}
+
+static void reset_file_info(dfu_file *file)
+{
 	file->size.prefix = 0;
 	file->size.suffix = 0;
 
@@ -201,8 +224,69 @@ void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req
 
 	/* default values, if no valid prefix is found */
 	file->lmdfu_address = 0;
+}
+
+static int parse_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+
+/* Read all of f into file->firmware */
+static int load_fd(dfu_file *file, int f)
+{
+	ssize_t read_count;
+	off_t read_total = 0;
+	off_t offset;
+
+	offset = lseek(f, 0, SEEK_END);
+
+	if (offset < 0) {
+		warn("File size is too big");
+		return EIO;
+	}
+
+	if (lseek(f, 0, SEEK_SET) != 0) {
+		warn("Could not seek to beginning");
+		return EIO;
+	}
+
+	file->size.total = offset;
+
+	if (file->size.total > SSIZE_MAX) {
+		warnx("File too large for memory allocation on this platform");
+		return EFBIG;
+	}
+	file->firmware = dfu_malloc(file->size.total);
+
+	while (read_total < file->size.total) {
+		off_t to_read = file->size.total - read_total;
+		/* read() limit on Linux, slightly below MAX_INT on Windows */
+		if (to_read > 0x7ffff000)
+			to_read = 0x7ffff000;
+		read_count = read(f, file->firmware + read_total, to_read);
+		if (read_count == 0)
+			break;
+		if (read_count == -1 && errno != EINTR)
+			break;
+		read_total += read_count;
+	}
+	if (read_total != file->size.total) {
+		warn("Could only read %lld of %lld bytes from %s",
+		    (long long) read_total, (long long) file->size.total, file->name);
+		return EIO;
+	}
+	return 0;
+}
 
+/*
+ * Returns 0 or an errno value, having said why. file->firmware may be
+ * set either way and is the caller's to free.
+ */
+int dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix)
+{
+	int ret;
+	int f;
+
+	reset_file_info(file);
 	free(file->firmware);
+	file->firmware = NULL;
 
 	if (!strcmp(file->name, "-")) {
 		size_t read_bytes;
@@ -214,9 +298,12 @@ void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req
 		read_bytes = fread(file->firmware, 1, STDIN_CHUNK_SIZE, stdin);
 		file->size.total = read_bytes;
 		while (read_bytes == STDIN_CHUNK_SIZE) {
-			file->firmware = (uint8_t*) realloc(file->firmware, file->size.total + STDIN_CHUNK_SIZE);
-			if (!file->firmware)
-				err(EX_IOERR, "Could not allocate firmware buffer");
+			uint8_t *grown = realloc(file->firmware, file->size.total + STDIN_CHUNK_SIZE);
+			if (!grown) {
+				warn("Could not allocate firmware buffer");
+				return ENOMEM;
+			}
+			file->firmware = grown;
 			read_bytes = fread(file->firmware + file->size.total, 1, STDIN_CHUNK_SIZE, stdin);
 			file->size.total += read_bytes;
 		}
@@ -224,86 +311,50 @@ void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req
 			printf("Read %lli bytes from stdin\n", (long long) file->size.total);
 		/* Never require suffix when reading from stdin */
 		check_suffix = MAYBE_SUFFIX;
-    } else if (file->fd > -1) {
-        ssize_t read_count;
-        off_t read_total = 0;
-
-        f = file->fd;
-        if (f < 0)
-            err(EX_IOERR, "Could not open file %s for reading", file->name);
-
-        offset = lseek(f, 0, SEEK_END);
-
-        if (offset < 0)
-            err(EX_IOERR, "File size is too big");
-
-        if (lseek(f, 0, SEEK_SET) != 0)
-            err(EX_IOERR, "Could not seek to beginning");
-
-        file->size.total = offset;
-
-        if (file->size.total > SSIZE_MAX) {
-            err(EX_IOERR, "File too large for memory allocation on this platform");
-        }
-        file->firmware = dfu_malloc(file->size.total);
-
-        while (read_total < file->size.total) {
-            off_t to_read = file->size.total - read_total;
-            /* read() limit on Linux, slightly below MAX_INT on Windows */
-            if (to_read > 0x7ffff000)
-                to_read = 0x7ffff000;
-            read_count = read(f, file->firmware + read_total, to_read);
-            if (read_count == 0)
-                break;
-            if (read_count == -1 && errno != EINTR)
-                break;
-            read_total += read_count;
-        }
-        if (read_total != file->size.total) {
-            err(EX_IOERR, "Could only read %lld of %lld bytes from %s",
-                (long long) read_total, (long long) file->size.total, file->name);
-        }
-    } else if (!strcmp(file->name, "")) {
-		ssize_t read_count;
-		off_t read_total = 0;
-
+	} else if (file->fd > -1) {
+		ret = load_fd(file, file->fd);
+		if (ret)
+			return ret;
+	} else if (!strcmp(file->name, "")) {
 		f = open(file->name, O_RDONLY | O_BINARY);
-		if (f < 0)
-			err(EX_IOERR, "Could not open file %s for reading", file->name);
+		if (f < 0) {
+			warn("Could not open file %s for reading", file->name);
+			return EIO;
+		}
+		ret = load_fd(file, f);
+		close(f);
+		if (ret)
+			return ret;
+	} else return 0;
 
-		offset = lseek(f, 0, SEEK_END);
+	return parse_file(file, check_suffix, check_prefix);
+}
 
-		if (offset < 0)
-			err(EX_IOERR, "File size is too big");
+/*
+ * Same as dfu_load_file() for an image the caller already holds in
+ * memory. The data is copied, file->firmware is owned by file.
+ */
+int dfu_load_buffer(dfu_file *file, const void *data, size_t size,
+    enum suffix_req check_suffix, enum prefix_req check_prefix)
+{
+	reset_file_info(file);
+	free(file->firmware);
+	file->firmware = NULL;
 
-		if (lseek(f, 0, SEEK_SET) != 0)
-			err(EX_IOERR, "Could not seek to beginning");
+	if ((off_t) size < 0) {
+		warnx("Image too large");
+		return EFBIG;
+	}
+	file->firmware = dfu_malloc(size ? size : 1);
+	memcpy(file->firmware, data, size);
+	file->size.total = size;
 
-		file->size.total = offset;
+	return parse_file(file, check_suffix, check_prefix);
+}
 
-		if (file->size.total > SSIZE_MAX) {
-			err(EX_IOERR, "File too large for memory allocation on this platform");
-		}
-		file->firmware = dfu_malloc(file->size.total);
-
-		while (read_total < file->size.total) {
-			off_t to_read = file->size.total - read_total;
-			/* read() limit on Linux, slightly below MAX_INT on Windows */
-			if (to_read > 0x7ffff000)
-				to_read = 0x7ffff000;
-			read_count = read(f, file->firmware + read_total, to_read);
-			if (read_count == 0)
-				break;
-			if (read_count == -1 && errno != EINTR)
-				break;
-			read_total += read_count;
-		}
-		if (read_total != file->size.total) {
-			err(EX_IOERR, "Could only read %lld of %lld bytes from %s",
-			    (long long) read_total, (long long) file->size.total, file->name);
-		}
-		close(f);
-    } else return;
+static int parse_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix)
+{
+	int res;
 
 	/* Check for possible DFU file suffix by trying to parse one */
 	{
@@ -321,8 +372,7 @@ void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req
 		dfusuffix = file->firmware + file->size.total -
 		    DFU_SUFFIX_LENGTH;
 
-		for (i = 0; i < file->size.total - 4; i++)
-			crc = crc32_byte(crc, file->firmware[i]);
+		crc = dfu_crc32(crc, file->firmware, file->size.total - 4);
 
 		if (dfusuffix[10] != 'D' ||
 		    dfusuffix[9]  != 'F' ||
@@ -354,13 +404,15 @@ void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req
 		file->size.suffix = dfusuffix[11];
 
 		if (file->size.suffix < DFU_SUFFIX_LENGTH) {
-			errx(EX_IOERR, "Unsupported DFU suffix length %d",
+			warnx("Unsupported DFU suffix length %d",
 			    file->size.suffix);
+			return EINVAL;
 		}
 
 		if (file->size.suffix > file->size.total) {
-			errx(EX_IOERR, "Invalid DFU suffix length %d",
+			warnx("Invalid DFU suffix length %d",
 			    file->size.suffix);
+			return EINVAL;
 		}
 
 		file->idVendor	= (dfusuffix[5] << 8) + dfusuffix[4];
@@ -371,7 +423,8 @@ checked:
 		if (missing_suffix) {
 			if (check_suffix == NEEDS_SUFFIX) {
 				warnx("%s", reason);
-				errx(EX_IOERR, "Valid DFU suffix needed");
+				warnx("Valid DFU suffix needed");
+				return EINVAL;
 			} else if (check_suffix == MAYBE_SUFFIX) {
 				warnx("Warning: %s", reason);
 				warnx("A valid DFU suffix will be required in "
@@ -379,15 +432,20 @@ checked:
 			}
 		} else {
 			if (check_suffix == NO_SUFFIX) {
-				errx(EX_SOFTWARE, "Please remove existing DFU suffix before adding a new one.\n");
+				warnx("Please remove existing DFU suffix before adding a new one.");
+				return EINVAL;
 			}
 		}
 	}
 	res = probe_prefix(file);
-	if ((res || file->size.prefix == 0) && check_prefix == NEEDS_PREFIX)
-		errx(EX_IOERR, "Valid DFU prefix needed");
-	if (file->size.prefix && check_prefix == NO_PREFIX)
-		errx(EX_IOERR, "A prefix already exists, please delete it first");
+	if ((res || file->size.prefix == 0) && check_prefix == NEEDS_PREFIX) {
+		warnx("Valid DFU prefix needed");
+		return EINVAL;
+	}
+	if (file->size.prefix && check_prefix == NO_PREFIX) {
+		warnx("A prefix already exists, please delete it first");
+		return EINVAL;
+	}
 	if (file->size.prefix && verbose) {
 		uint8_t *data = file->firmware;
 		if (file->prefix_type == LMDFU_PREFIX)
@@ -403,9 +461,12 @@ checked:
 				   "the following properties\n"
 				   "Payload length: %d kiByte\n",
 				   data[2] >>1 | (data[3] << 7) );
-		else
-			errx(EX_IOERR, "Unknown DFU prefix type");
+		else {
+			warnx("Unknown DFU prefix type");
+			return EINVAL;
+		}
 	}
+	return 0;
 }
 
 void dfu_store_file(dfu_file *file, int write_suffix, int write_prefix)
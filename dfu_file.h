@@ -4,6 +4,7 @@
 
 #include "portable.h"
 #include <stdint.h>
+#include "dfu_hash.h"
 
 typedef struct {
     /* File descriptor */
@@ -51,13 +52,47 @@ enum prefix_type {
 
 extern int verbose;
 
-void dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+typedef struct dfu_writer dfu_writer;
+
+/*
+ * Destination of an upload: a file descriptor, or with fd -1 a buffer
+ * of fixed capacity. Uploads stop once a buffer sink is full.
+ */
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t capacity;
+    /* Bytes written so far */
+    size_t size;
+    /* Optional, follows a buffer sink filling up */
+    int *percent;
+    /* Optional, takes the fd writes off the upload loop */
+    dfu_writer *writer;
+    /* Optional, hashes what is kept, see dfu_hash.h */
+    dfu_hash *hash;
+    /* Block handed out by dfu_sink_next() */
+    uint8_t *block;
+    uint8_t *scratch;
+    int scratch_size;
+    /* First failed write of an fd sink without a writer */
+    int error;
+} dfu_sink;
+
+int dfu_load_file(dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+int dfu_load_buffer(dfu_file *file, const void *data, size_t size,
+    enum suffix_req check_suffix, enum prefix_req check_prefix);
 void dfu_store_file(dfu_file *file, int write_suffix, int write_prefix);
 
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max);
 void *dfu_malloc(size_t size);
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size);
+void dfu_sink_fd(dfu_sink *sink, int fd);
+void dfu_sink_buffer(dfu_sink *sink, void *buf, size_t capacity);
+void *dfu_sink_next(dfu_sink *sink, int size);
+void dfu_sink_commit(dfu_sink *sink, int size);
+int dfu_sink_full(const dfu_sink *sink);
+int dfu_sink_close(dfu_sink *sink);
 void show_suffix_and_prefix(dfu_file *file);
 
 #endif /* DFU_FILE_H */
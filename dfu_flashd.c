@@ -0,0 +1,824 @@
+/*
+ * dfu-flashd: local flashing daemon
+ *
+ * Keeps one libusb context, the probed device table and recently used
+ * images around, and takes jobs from clients on a Unix domain socket,
+ * so that a CI job or line station pays neither for libusb start-up
+ * nor for loading and checking the image on every flash.
+ *
+ * The protocol is line based. A client sends one of
+ *
+ *   list
+ *   rescan
+ *   flash  <image>   [serial=S] [path=P] [alt=N]
+ *   upload <outfile> [size=N] [serial=S] [path=P] [alt=N]
+ *   verify <image>   [serial=S] [path=P] [alt=N]
+ *   stats            [serial=S] [path=P] [alt=N]
+ *   trace  <outfile>
+ *   metrics
+ *
+ * and receives any number of "device ..." or "progress <percent> eta=S
+ * rate=B" lines followed by a final "ok ..." or "error <errno> <message>".
+ * The percentage counts bytes; eta is the estimated seconds left,
+ * including the manifestation, and rate the recent bytes per second.
+ * An upload ends with "ok size=N crc32=X sha256=X" for the data read.
+ * stats answers one "latency <request> count=N mean=us p50=us p90=us
+ * p99=us p999=us max=us" line per request type the device has seen.
+ * trace saves the control transfers recorded since the daemon was
+ * started with -r (see dfu_record.h), as far back as the ring reaches,
+ * into an output file like upload.
+ * metrics answers the counters and histograms of dfu_metrics.h in the
+ * Prometheus text format, which -m also keeps written to a file after
+ * every job and rescan, for a textfile collector to pick up. After a
+ * flash the daemon watches for the device to come back on its USB path
+ * to time the re-enumeration. The device table is only rescanned
+ * while no job runs, until then rescan answers EBUSY.
+ * Images are opened by the daemon, so their paths must be absolute or
+ * relative to its working directory. Output files are plain names in
+ * the directory given with -o, created 0600 and never through a
+ * symlink; without -o uploads are refused.
+ *
+ * The socket is created 0600, by default as dfu-flashd.sock in
+ * $XDG_RUNTIME_DIR or else in a 0700 directory /tmp/dfu-flashd-<uid>,
+ * so only the daemon's user can send jobs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfu_hash.h"
+#include "dfu_stats.h"
+#include "dfu_record.h"
+#include "dfu_metrics.h"
+#include "dfu_session.h"
+#include "dfu_lock.h"
+
+#define SOCKET_NAME "dfu-flashd.sock"
+#define IMAGE_CACHE_SIZE 16
+#define MAX_LINE 1024
+#define PROGRESS_INTERVAL_MS 100
+#define REENUM_POLL_MS 10
+#define REENUM_TIMEOUT_MS 10000
+
+enum job_op { OP_FLASH, OP_UPLOAD, OP_VERIFY };
+
+typedef struct {
+	char path[PATH_MAX];
+	dev_t st_dev;
+	ino_t st_ino;
+	time_t mtime;
+	off_t size;
+	dfu_image *image;	/* the cache holds one reference */
+	unsigned long stamp;
+} cached_image;
+
+typedef struct {
+	enum job_op op;
+	dfu_if *dif;
+	dfu_image *image;
+	int out_fd;
+	int upload_size;
+	dfu_hash hash;		/* of the uploaded data */
+	int progress;
+	dfu_progress estimate;
+	volatile int finished;
+	int result;
+} flash_job;
+
+static libusb_context *ctx;
+static const char *metrics_path;
+static const char *out_dir;
+
+/*
+ * Lookups hold the table for reading, a rescan replaces it. A job only
+ * holds it to pick its device and mark it busy; the busy count keeps
+ * the table, and with it the job's dfu_if, until every job is done.
+ */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t busy_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *busy;
+static int busy_count;
+/* Set by jobs without the table lock, so only ever accessed atomically */
+static int table_stale = 1;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_image image_cache[IMAGE_CACHE_SIZE];
+static unsigned long cache_clock;
+
+static void reply(int fd, const char *fmt, ...)
+{
+	char buf[MAX_LINE];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n > (int) sizeof(buf) - 2)
+		n = sizeof(buf) - 2;
+	buf[n++] = '\n';
+	if (write(fd, buf, n) != n && verbose)
+		warnx("Lost reply to client %d", fd);
+}
+
+static void reply_error(int fd, int err, const char *what)
+{
+	reply(fd, "error %d %s: %s", err, what, strerror(err));
+}
+
+/*
+ * Where a client's output file goes: name must be a plain file name,
+ * the file lands in out_dir. Returns 0 or an errno value.
+ */
+static int output_path(const char *name, char *path, size_t size)
+{
+	if (out_dir == NULL)
+		return EACCES;
+	if (!name[0] || strchr(name, '/') || !strcmp(name, ".") ||
+	    !strcmp(name, ".."))
+		return EINVAL;
+	if (snprintf(path, size, "%s/%s", out_dir, name) >= (int) size)
+		return ENAMETOOLONG;
+	return 0;
+}
+
+static void save_metrics(void)
+{
+	int err;
+
+	if (metrics_path == NULL)
+		return;
+	err = dfu_metrics_save(metrics_path);
+	if (err)
+		warnx("Cannot write %s: %s", metrics_path, strerror(err));
+}
+
+/*
+ * Called without table_lock held. Never while a job holds a device of
+ * the table: a stale table waits for the next call after the last job,
+ * a forced rescan returns EBUSY.
+ */
+static int rescan_devices(int force)
+{
+	int rescanned = 0;
+	int ret = 0;
+	int jobs;
+	int i;
+
+	pthread_rwlock_wrlock(&table_lock);
+	/* no job can start while the write lock is held */
+	pthread_mutex_lock(&busy_lock);
+	jobs = busy_count;
+	pthread_mutex_unlock(&busy_lock);
+	if (jobs && force)
+		ret = EBUSY;
+	if (!jobs && (force || __atomic_load_n(&table_stale, __ATOMIC_RELAXED))) {
+		disconnect_devices();
+		probe_devices(ctx);
+		free(busy);
+		busy = calloc(dfu_num_devices ? dfu_num_devices : 1, 1);
+		if (busy == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+		__atomic_store_n(&table_stale, 0, __ATOMIC_RELAXED);
+		for (i = 0; i < dfu_num_devices; i++)
+			dfu_metrics_device_seen(dfu_devices[i]);
+		if (verbose)
+			printf("Device table has %d interfaces\n", dfu_num_devices);
+		rescanned = 1;
+	}
+	pthread_rwlock_unlock(&table_lock);
+	if (rescanned)
+		save_metrics();
+	return ret;
+}
+
+/*
+ * Image cache. Entries are keyed on path and identified by inode and
+ * mtime, so replacing a file on disk is picked up on the next job.
+ * Jobs take their own reference, so an entry can be evicted while
+ * devices are still being flashed from it.
+ */
+static dfu_image *image_get(const char *path, int *err)
+{
+	cached_image *img = NULL;
+	dfu_image *image;
+	struct stat st;
+	int fd;
+	int i;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		*err = errno;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < IMAGE_CACHE_SIZE; i++) {
+		cached_image *c = &image_cache[i];
+
+		if (c->image && !strcmp(c->path, path) &&
+		    c->st_dev == st.st_dev && c->st_ino == st.st_ino &&
+		    c->mtime == st.st_mtime && c->size == st.st_size) {
+			img = c;
+			goto found;
+		}
+	}
+	/* replace the least recently used entry */
+	for (i = 0; i < IMAGE_CACHE_SIZE; i++) {
+		cached_image *c = &image_cache[i];
+
+		if (img == NULL || !c->image || (img->image && c->stamp < img->stamp))
+			img = c;
+	}
+	dfu_image_unref(img->image);
+	memset(img, 0, sizeof(*img));
+	snprintf(img->path, sizeof(img->path), "%s", path);
+	img->st_dev = st.st_dev;
+	img->st_ino = st.st_ino;
+	img->mtime = st.st_mtime;
+	img->size = st.st_size;
+	img->image = dfu_image_load_fd(fd);
+	if (img->image == NULL) {
+		*err = errno;
+		memset(img, 0, sizeof(*img));
+		pthread_mutex_unlock(&cache_lock);
+		close(fd);
+		return NULL;
+	}
+	if (verbose)
+		printf("Cached image %s (%lld bytes)\n", path,
+		       (long long) img->image->file.size.total);
+found:
+	image = dfu_image_ref(img->image);
+	img->stamp = ++cache_clock;
+	pthread_mutex_unlock(&cache_lock);
+	close(fd);
+	return image;
+}
+
+typedef struct {
+	char path[DFU_MAX_PATH_LEN];
+	uint8_t devnum;		/* before the flash */
+	uint64_t end;		/* of the flash */
+} reenum_watch;
+
+/*
+ * The device resets at the end of a flash and comes back at another
+ * address on the same port, in DFU or runtime mode. Time that without
+ * touching the device table, and give up on devices that stay.
+ */
+static void *reenum_thread(void *arg)
+{
+	reenum_watch *watch = arg;
+	libusb_device **list;
+	char path[DFU_MAX_PATH_LEN];
+	int back = 0;
+	int waited;
+	ssize_t n;
+	ssize_t i;
+
+	for (waited = 0; !back && waited < REENUM_TIMEOUT_MS;
+	     waited += REENUM_POLL_MS) {
+		milli_sleep(REENUM_POLL_MS);
+		n = libusb_get_device_list(ctx, &list);
+		for (i = 0; i < n && !back; i++)
+			back = get_path(list[i], path, sizeof(path)) > 0 &&
+			       !strcmp(path, watch->path) &&
+			       libusb_get_device_address(list[i]) != watch->devnum;
+		if (n >= 0)
+			libusb_free_device_list(list, 1);
+	}
+	if (back) {
+		dfu_metrics_reenumerated(dfu_stats_clock() - watch->end);
+		save_metrics();
+	} else if (verbose) {
+		warnx("Device on %s did not come back", watch->path);
+	}
+	free(watch);
+	return NULL;
+}
+
+static void watch_reenumeration(const dfu_if *dif)
+{
+	reenum_watch *watch;
+	pthread_t thread;
+
+	if (dif->path == NULL)
+		return;
+	watch = dfu_malloc(sizeof(*watch));
+	snprintf(watch->path, sizeof(watch->path), "%s", dif->path);
+	watch->devnum = dif->devnum;
+	watch->end = dfu_stats_clock();
+	if (pthread_create(&thread, NULL, reenum_thread, watch)) {
+		free(watch);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+static void *job_thread(void *arg)
+{
+	flash_job *job = arg;
+	dfu_session session;
+	uint64_t start = dfu_stats_clock();
+	int ret;
+
+	ret = dfu_lock_device(job->dif);
+	if (ret)
+		goto out;
+	ret = dfu_session_open(&session, job->dif);
+	if (ret)
+		goto out_unlock;
+
+	switch (job->op) {
+	case OP_FLASH:
+		ret = dfu_check_file_id(job->dif, &job->image->file);
+		if (!ret)
+			ret = dfu_session_download_progress(&session,
+							    &job->image->file,
+							    &job->progress,
+							    &job->estimate);
+		break;
+	case OP_UPLOAD:
+		ret = dfu_session_upload(&session, job->out_fd, job->upload_size,
+					 &job->hash);
+		break;
+	case OP_VERIFY:
+		ret = dfu_session_verify(&session, job->image);
+		break;
+	}
+	dfu_session_close(&session);
+out_unlock:
+	dfu_unlock_device(job->dif);
+out:
+	if (job->op == OP_FLASH) {
+		dfu_metrics_flash(job->dif, ret, job->estimate.bytes,
+				  dfu_stats_clock() - start);
+		if (ret == 0)
+			watch_reenumeration(job->dif);
+	}
+	job->result = ret;
+	__sync_synchronize();
+	job->finished = 1;
+	return NULL;
+}
+
+static void run_job(int fd, flash_job *job, const dfu_selector *sel)
+{
+	pthread_t thread;
+	int last = -1;
+	int index;
+
+	pthread_rwlock_rdlock(&table_lock);
+	index = dfu_select(sel);
+	if (index < 0) {
+		pthread_rwlock_unlock(&table_lock);
+		reply_error(fd, -index, index == -EINVAL ?
+			    "more than one device matches" : "no device matches");
+		return;
+	}
+	pthread_mutex_lock(&busy_lock);
+	if (busy[index]) {
+		pthread_mutex_unlock(&busy_lock);
+		pthread_rwlock_unlock(&table_lock);
+		reply_error(fd, EBUSY, "device has a job running");
+		return;
+	}
+	busy[index] = 1;
+	busy_count++;
+	pthread_mutex_unlock(&busy_lock);
+	job->dif = dfu_devices[index];
+	pthread_rwlock_unlock(&table_lock);
+
+	job->finished = 0;
+	if (pthread_create(&thread, NULL, job_thread, job)) {
+		job->result = EAGAIN;
+		job->finished = 1;
+	} else {
+		while (!job->finished) {
+			milli_sleep(PROGRESS_INTERVAL_MS);
+			if (job->op == OP_FLASH && job->progress != last) {
+				last = job->progress;
+				reply(fd, "progress %d eta=%.1f rate=%.0f", last,
+				      job->estimate.eta, job->estimate.throughput);
+			}
+		}
+		pthread_join(thread, NULL);
+	}
+
+	/* a flashed device resets and comes back with a new address */
+	if (job->op == OP_FLASH)
+		__atomic_store_n(&table_stale, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&busy_lock);
+	busy[index] = 0;
+	busy_count--;
+	pthread_mutex_unlock(&busy_lock);
+
+	if (job->op == OP_FLASH)
+		save_metrics();
+
+	if (job->result) {
+		reply_error(fd, job->result, "job failed");
+	} else if (job->op == OP_UPLOAD) {
+		char sha[2 * 32 + 1];
+		uint8_t digest[32];
+		uint32_t crc;
+		unsigned long long bytes = job->hash.length;
+		int i;
+
+		dfu_hash_final(&job->hash, &crc, digest);
+		for (i = 0; i < 32; i++)
+			sprintf(sha + 2 * i, "%02x", digest[i]);
+		reply(fd, "ok size=%llu crc32=%08x sha256=%s", bytes, crc, sha);
+	} else {
+		reply(fd, "ok");
+	}
+}
+
+static int parse_selector(char **args, int nargs, dfu_selector *sel,
+			  int *size)
+{
+	int i;
+
+	sel->serial = NULL;
+	sel->path = NULL;
+	sel->alt = -1;
+	*size = 0;
+	for (i = 0; i < nargs; i++) {
+		if (!strncmp(args[i], "serial=", 7))
+			sel->serial = args[i] + 7;
+		else if (!strncmp(args[i], "path=", 5))
+			sel->path = args[i] + 5;
+		else if (!strncmp(args[i], "alt=", 4))
+			sel->alt = atoi(args[i] + 4);
+		else if (!strncmp(args[i], "size=", 5))
+			*size = strtol(args[i] + 5, NULL, 0);
+		else
+			return -1;
+	}
+	return 0;
+}
+
+static void list_devices(int fd)
+{
+	int i;
+
+	pthread_rwlock_rdlock(&table_lock);
+	for (i = 0; i < dfu_num_devices; i++) {
+		dfu_if *dif = dfu_devices[i];
+
+		reply(fd, "device %d %04x:%04x %s alt=%u path=%s serial=%s name=\"%s\"",
+		      i, dif->vendor, dif->product,
+		      dif->flags & DFU_IFF_DFU ? "dfu" : "runtime",
+		      dif->altsetting, dif->path ? dif->path : "-",
+		      dif->serial_name, dif->alt_name);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	reply(fd, "ok %d", i);
+}
+
+static void device_stats(int fd, const dfu_selector *sel)
+{
+	dfu_stats *stats;
+	int index;
+	int kind;
+
+	pthread_rwlock_rdlock(&table_lock);
+	index = dfu_select(sel);
+	if (index < 0) {
+		pthread_rwlock_unlock(&table_lock);
+		reply_error(fd, -index, index == -EINVAL ?
+			    "more than one device matches" : "no device matches");
+		return;
+	}
+	stats = dfu_stats_device(dfu_devices[index]);
+	pthread_rwlock_unlock(&table_lock);
+
+	for (kind = 0; kind < DFU_STAT_NUM_KINDS; kind++) {
+		const dfu_histogram *hist = &stats->hist[kind];
+
+		if (hist->count == 0)
+			continue;
+		reply(fd, "latency %s count=%llu mean=%.0f p50=%llu p90=%llu "
+		      "p99=%llu p999=%llu max=%llu", dfu_stat_kind_name(kind),
+		      (unsigned long long) hist->count,
+		      (double) hist->sum / hist->count,
+		      (unsigned long long) dfu_histogram_percentile(hist, 50),
+		      (unsigned long long) dfu_histogram_percentile(hist, 90),
+		      (unsigned long long) dfu_histogram_percentile(hist, 99),
+		      (unsigned long long) dfu_histogram_percentile(hist, 99.9),
+		      (unsigned long long) hist->max);
+	}
+	reply(fd, "ok");
+}
+
+static void handle_command(int fd, char *line)
+{
+	char *args[16];
+	int nargs = 0;
+	char *save;
+	char *tok;
+	flash_job job;
+	dfu_selector sel;
+	int err;
+
+	for (tok = strtok_r(line, " \t\r\n", &save); tok && nargs < 16;
+	     tok = strtok_r(NULL, " \t\r\n", &save))
+		args[nargs++] = tok;
+	if (nargs == 0)
+		return;
+
+	if (!strcmp(args[0], "list")) {
+		rescan_devices(0);
+		list_devices(fd);
+		return;
+	}
+	if (!strcmp(args[0], "rescan")) {
+		err = rescan_devices(1);
+		if (err)
+			reply_error(fd, err, "jobs running");
+		else
+			list_devices(fd);
+		return;
+	}
+	if (!strcmp(args[0], "stats")) {
+		int size;
+
+		if (parse_selector(args + 1, nargs - 1, &sel, &size)) {
+			reply_error(fd, EINVAL, "bad arguments");
+			return;
+		}
+		rescan_devices(0);
+		device_stats(fd, &sel);
+		return;
+	}
+	if (!strcmp(args[0], "trace")) {
+		char path[PATH_MAX];
+
+		if (nargs != 2) {
+			reply_error(fd, EINVAL, "bad arguments");
+			return;
+		}
+		err = output_path(args[1], path, sizeof(path));
+		if (!err)
+			err = dfu_record_save(path);
+		if (err)
+			reply_error(fd, err, args[1]);
+		else
+			reply(fd, "ok");
+		return;
+	}
+	if (!strcmp(args[0], "metrics")) {
+		FILE *out;
+		int out_fd = dup(fd);
+
+		out = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+		if (out == NULL) {
+			if (out_fd >= 0)
+				close(out_fd);
+			reply_error(fd, errno, "metrics");
+			return;
+		}
+		err = dfu_metrics_write(out);
+		if (fclose(out) && !err)
+			err = errno;
+		if (err)
+			reply_error(fd, err, "metrics");
+		else
+			reply(fd, "ok");
+		return;
+	}
+
+	memset(&job, 0, sizeof(job));
+	dfu_progress_init(&job.estimate, NULL);
+	job.out_fd = -1;
+	if (!strcmp(args[0], "flash"))
+		job.op = OP_FLASH;
+	else if (!strcmp(args[0], "upload"))
+		job.op = OP_UPLOAD;
+	else if (!strcmp(args[0], "verify"))
+		job.op = OP_VERIFY;
+	else {
+		reply_error(fd, EINVAL, "unknown command");
+		return;
+	}
+	if (nargs < 2 || parse_selector(args + 2, nargs - 2, &sel,
+					   &job.upload_size)) {
+		reply_error(fd, EINVAL, "bad arguments");
+		return;
+	}
+
+	if (job.op == OP_UPLOAD) {
+		char path[PATH_MAX];
+
+		err = output_path(args[1], path, sizeof(path));
+		if (err) {
+			reply_error(fd, err, args[1]);
+			return;
+		}
+		job.out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC |
+				  O_BINARY | O_NOFOLLOW, 0600);
+		if (job.out_fd < 0) {
+			reply_error(fd, errno, args[1]);
+			return;
+		}
+	} else {
+		job.image = image_get(args[1], &err);
+		if (job.image == NULL) {
+			reply_error(fd, err, args[1]);
+			return;
+		}
+	}
+
+	rescan_devices(0);
+	run_job(fd, &job, &sel);
+
+	if (job.image)
+		dfu_image_unref(job.image);
+	if (job.out_fd >= 0)
+		close(job.out_fd);
+}
+
+static void *client_thread(void *arg)
+{
+	int fd = (int) (intptr_t) arg;
+	char line[MAX_LINE];
+	FILE *in;
+
+	in = fdopen(fd, "r");
+	if (in == NULL) {
+		close(fd);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), in) != NULL)
+		handle_command(fd, line);
+	fclose(in);
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-v] [-s socket] [-o outdir] [-l lockdir] "
+		"[-r trace_kib] [-m metrics_file]\n", name);
+	exit(EX_USAGE);
+}
+
+/*
+ * $XDG_RUNTIME_DIR is private to the user already. The fallback in
+ * /tmp is created 0700, or must be ours and closed to everyone else,
+ * so that nobody can swap the socket or read the jobs' replies.
+ */
+static void default_socket(char *path, size_t size)
+{
+	const char *runtime = getenv("XDG_RUNTIME_DIR");
+	char dir[64];
+	struct stat st;
+
+	if (runtime != NULL && runtime[0] == '/') {
+		if (snprintf(path, size, "%s/" SOCKET_NAME, runtime) >= (int) size)
+			errx(EX_USAGE, "Socket path too long");
+		return;
+	}
+	snprintf(dir, sizeof(dir), "/tmp/dfu-flashd-%lu",
+		 (unsigned long) getuid());
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		err(EX_IOERR, "Cannot create %s", dir);
+	if (lstat(dir, &st) < 0)
+		err(EX_IOERR, "%s", dir);
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+	    (st.st_mode & 077))
+		errx(EX_IOERR, "%s is not a private directory", dir);
+	snprintf(path, size, "%s/" SOCKET_NAME, dir);
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path = NULL;
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int listen_fd;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "vs:o:l:r:m:h")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose++;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'o':
+			if (stat(optarg, &st) < 0 || !S_ISDIR(st.st_mode))
+				errx(EX_USAGE, "%s is not a directory", optarg);
+			out_dir = optarg;
+			break;
+		case 'l':
+			dfu_set_lock_dir(optarg);
+			break;
+		case 'r':
+			if (atoi(optarg) <= 0)
+				usage(argv[0]);
+			dfu_record_start((size_t) atoi(optarg) * 1024, 0);
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = libusb_init(&ctx);
+	if (ret)
+		errx(EX_IOERR, "unable to initialize libusb: %s", libusb_error_name(ret));
+	rescan_devices(1);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socket_path == NULL) {
+		default_socket(addr.sun_path, sizeof(addr.sun_path));
+		socket_path = addr.sun_path;
+	} else if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errx(EX_USAGE, "Socket path too long");
+	} else {
+		strcpy(addr.sun_path, socket_path);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		err(EX_IOERR, "socket");
+	/* a stale socket of an earlier run, never anything else */
+	if (lstat(socket_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			errx(EX_IOERR, "%s exists and is not a socket", socket_path);
+		unlink(socket_path);
+	}
+	mask = umask(0177);
+	ret = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0)
+		err(EX_IOERR, "Cannot bind %s", socket_path);
+	if (chmod(socket_path, 0600) < 0)
+		err(EX_IOERR, "Cannot restrict %s", socket_path);
+	if (listen(listen_fd, 16) < 0)
+		err(EX_IOERR, "listen");
+	if (verbose)
+		printf("Listening on %s\n", socket_path);
+
+	while (1) {
+		pthread_t thread;
+		int fd = accept(listen_fd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EX_IOERR, "accept");
+		}
+		if (pthread_create(&thread, NULL, client_thread,
+				   (void *) (intptr_t) fd)) {
+			warnx("Cannot start client thread");
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return 0;
+}
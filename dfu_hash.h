@@ -0,0 +1,45 @@
+/*
+ * CRC32 and SHA-256 of firmware data in a single pass
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_HASH_H
+#define DFU_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+	uint32_t crc;		/* running CRC, as in the DFU suffix */
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t block[64];
+	unsigned int fill;
+} dfu_hash;
+
+/*
+ * CRC32 the way the DFU suffix stores it: start from 0xffffffff and
+ * leave out the final inversion. The usual CRC-32 is ~crc.
+ */
+uint32_t dfu_crc32(uint32_t crc, const void *data, size_t size);
+
+void dfu_hash_init(dfu_hash *hash);
+void dfu_hash_update(dfu_hash *hash, const void *data, size_t size);
+
+/* crc32 is the usual CRC-32, as zlib and most tools print it */
+void dfu_hash_final(dfu_hash *hash, uint32_t *crc32, uint8_t sha256[32]);
+
+#endif /* DFU_HASH_H */
@@ -0,0 +1,96 @@
+/*
+ * Immutable, reference counted firmware images
+ *
+ * Flashing the same image to a rack of boards used to mean one
+ * dfu_file, one buffer and one CRC pass per board. An image is loaded
+ * and checked once instead, and every job holds a reference to the
+ * same read-only buffer.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfu_image.h"
+
+static dfu_image *image_load(int fd, const char *name)
+{
+	dfu_image *image;
+	int ret;
+
+	image = dfu_malloc(sizeof(*image));
+	memset(image, 0, sizeof(*image));
+	snprintf(image->file.name, sizeof(image->file.name), "%s", name);
+	image->file.fd = fd;
+	ret = dfu_load_file(&image->file, MAYBE_SUFFIX, MAYBE_PREFIX);
+	if (ret) {
+		free(image->file.firmware);
+		free(image);
+		errno = ret;
+		return NULL;
+	}
+	image->file.fd = -1;
+
+	image->payload = image->file.firmware + image->file.size.prefix;
+	image->payload_size = image->file.size.total -
+	    image->file.size.prefix - image->file.size.suffix;
+	image->refcount = 1;
+	return image;
+}
+
+dfu_image *dfu_image_load_fd(int fd)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+	return image_load(fd, "");
+}
+
+dfu_image *dfu_image_load(const char *filename)
+{
+	dfu_image *image;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return NULL;
+	image = image_load(fd, filename);
+	close(fd);
+	return image;
+}
+
+dfu_image *dfu_image_ref(dfu_image *image)
+{
+	__sync_add_and_fetch(&image->refcount, 1);
+	return image;
+}
+
+void dfu_image_unref(dfu_image *image)
+{
+	if (image == NULL)
+		return;
+	if (__sync_sub_and_fetch(&image->refcount, 1) == 0) {
+		free(image->file.firmware);
+		free(image);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * Immutable, reference counted firmware images
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_IMAGE_H
+#define DFU_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfu_file.h"
+
+/*
+ * A loaded and checked image that any number of jobs may flash at the
+ * same time. Nothing in it changes after loading; the last
+ * dfu_image_unref() frees it.
+ */
+typedef struct dfu_image {
+	dfu_file file;		/* parsed suffix/prefix, owns the buffer */
+	const uint8_t *payload;	/* firmware without prefix and suffix */
+	size_t payload_size;
+	int refcount;
+} dfu_image;
+
+/* Both return NULL and set errno if the file cannot be read */
+dfu_image *dfu_image_load(const char *filename);
+dfu_image *dfu_image_load_fd(int fd);
+
+dfu_image *dfu_image_ref(dfu_image *image);
+void dfu_image_unref(dfu_image *image);
+
+#endif /* DFU_IMAGE_H */
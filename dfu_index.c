@@ -0,0 +1,259 @@
+/*
+ * Lookup tables over the probed DFU interfaces
+ *
+ * After probe_devices() the interfaces are also laid out in a flat
+ * array with open-addressing hash tables on serial number, port path
+ * and vendor:product:alt, so that callers juggling many devices do
+ * not need to walk dfu_root and compare strings for every selection.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_index.h"
+
+dfu_if **dfu_devices = NULL;
+int dfu_num_devices = 0;
+
+/* Storage is grown but never shrunk, so that a process probing the
+ * same rig over and over settles on a single allocation */
+static int index_capacity;
+static unsigned int table_size;			/* power of two */
+static int *chain[DFU_NUM_KEYS];		/* next index with same key */
+static int *table[DFU_NUM_KEYS];		/* index + 1, 0 if empty */
+static void *index_storage;
+
+static uint32_t hash_string(const char *str)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+
+	while (*str) {
+		h ^= (uint8_t) *str++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t hash_id(uint16_t vendor, uint16_t product, uint8_t alt)
+{
+	uint64_t key = ((uint64_t) vendor << 24) | ((uint32_t) product << 8) | alt;
+
+	key *= 0x9e3779b97f4a7c15ull;
+	return (uint32_t) (key >> 32);
+}
+
+static int key_hash(enum dfu_key key, const dfu_if *dif, uint32_t *hash)
+{
+	switch (key) {
+	case DFU_KEY_SERIAL:
+		*hash = hash_string(dif->serial_name);
+		return 0;
+	case DFU_KEY_PATH:
+		if (dif->path == NULL)
+			return -1;
+		*hash = hash_string(dif->path);
+		return 0;
+	case DFU_KEY_ID:
+		*hash = hash_id(dif->vendor, dif->product, dif->altsetting);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int key_equal(enum dfu_key key, const dfu_if *a, const dfu_if *b)
+{
+	switch (key) {
+	case DFU_KEY_SERIAL:
+		return !strcmp(a->serial_name, b->serial_name);
+	case DFU_KEY_PATH:
+		return !strcmp(a->path, b->path);
+	case DFU_KEY_ID:
+		return a->vendor == b->vendor && a->product == b->product &&
+		    a->altsetting == b->altsetting;
+	default:
+		return 0;
+	}
+}
+
+static void index_reserve(int count)
+{
+	size_t bytes;
+	char *p;
+	int k;
+
+	if (count <= index_capacity)
+		return;
+
+	free(index_storage);
+	index_capacity = count < 16 ? 16 : count;
+	table_size = 1;
+	while (table_size < 2u * (unsigned int) index_capacity)
+		table_size <<= 1;
+
+	bytes = sizeof(dfu_if *) * index_capacity +
+	    DFU_NUM_KEYS * sizeof(int) * (index_capacity + table_size);
+	index_storage = dfu_malloc(bytes);
+
+	p = index_storage;
+	dfu_devices = (dfu_if **) p;
+	p += sizeof(dfu_if *) * index_capacity;
+	for (k = 0; k < DFU_NUM_KEYS; k++) {
+		chain[k] = (int *) p;
+		p += sizeof(int) * index_capacity;
+		table[k] = (int *) p;
+		p += sizeof(int) * table_size;
+	}
+}
+
+static void index_insert(enum dfu_key key, int index)
+{
+	const dfu_if *dif = dfu_devices[index];
+	uint32_t hash;
+	unsigned int slot;
+
+	chain[key][index] = -1;
+	if (key_hash(key, dif, &hash))
+		return;
+
+	for (slot = hash & (table_size - 1); table[key][slot] != 0;
+	     slot = (slot + 1) & (table_size - 1)) {
+		int head = table[key][slot] - 1;
+
+		if (key_equal(key, dfu_devices[head], dif)) {
+			/* inserting back to front keeps the chain in list order */
+			chain[key][index] = head;
+			table[key][slot] = index + 1;
+			return;
+		}
+	}
+	table[key][slot] = index + 1;
+}
+
+/* Rebuild the tables from the current dfu_root list */
+void dfu_index_build(void)
+{
+	dfu_if *pdfu;
+	int count = 0;
+	int i;
+	int k;
+
+	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next)
+		count++;
+	index_reserve(count);
+
+	dfu_num_devices = 0;
+	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next)
+		dfu_devices[dfu_num_devices++] = pdfu;
+
+	if (index_capacity == 0)
+		return;
+	for (k = 0; k < DFU_NUM_KEYS; k++) {
+		memset(table[k], 0, sizeof(int) * table_size);
+		for (i = dfu_num_devices - 1; i >= 0; i--)
+			index_insert(k, i);
+	}
+}
+
+void dfu_index_clear(void)
+{
+	dfu_num_devices = 0;
+}
+
+static int index_lookup(enum dfu_key key, const dfu_if *probe)
+{
+	uint32_t hash;
+	unsigned int slot;
+
+	if (dfu_num_devices == 0 || key_hash(key, probe, &hash))
+		return -1;
+
+	for (slot = hash & (table_size - 1); table[key][slot] != 0;
+	     slot = (slot + 1) & (table_size - 1)) {
+		int head = table[key][slot] - 1;
+
+		if (key_equal(key, dfu_devices[head], probe))
+			return head;
+	}
+	return -1;
+}
+
+int dfu_lookup_serial(const char *serial)
+{
+	dfu_if probe;
+
+	probe.serial_name = (char *) serial;
+	return index_lookup(DFU_KEY_SERIAL, &probe);
+}
+
+int dfu_lookup_path(const char *path)
+{
+	dfu_if probe;
+
+	probe.path = (char *) path;
+	return index_lookup(DFU_KEY_PATH, &probe);
+}
+
+int dfu_lookup_id(uint16_t vendor, uint16_t product, uint8_t altsetting)
+{
+	dfu_if probe;
+
+	probe.vendor = vendor;
+	probe.product = product;
+	probe.altsetting = altsetting;
+	return index_lookup(DFU_KEY_ID, &probe);
+}
+
+int dfu_lookup_next(enum dfu_key key, int index)
+{
+	if (key >= DFU_NUM_KEYS || index < 0 || index >= dfu_num_devices)
+		return -1;
+	return chain[key][index];
+}
+
+int dfu_select(const dfu_selector *sel)
+{
+	int found = -1;
+	int i;
+
+	if (sel->path)
+		i = dfu_lookup_path(sel->path);
+	else if (sel->serial)
+		i = dfu_lookup_serial(sel->serial);
+	else
+		i = dfu_num_devices > 0 ? 0 : -1;
+
+	for (; i >= 0 && i < dfu_num_devices;
+	     i = sel->path ? dfu_lookup_next(DFU_KEY_PATH, i) :
+		 sel->serial ? dfu_lookup_next(DFU_KEY_SERIAL, i) : i + 1) {
+		dfu_if *dif = dfu_devices[i];
+
+		if (!(dif->flags & DFU_IFF_DFU))
+			continue;
+		if (sel->alt >= 0 && dif->altsetting != sel->alt)
+			continue;
+		if (sel->serial && strcmp(dif->serial_name, sel->serial))
+			continue;
+		if (found >= 0)
+			return -EINVAL;
+		found = i;
+	}
+	return found >= 0 ? found : -ENODEV;
+}
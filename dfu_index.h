@@ -0,0 +1,63 @@
+/*
+ * Lookup tables over the probed DFU interfaces
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_INDEX_H
+#define DFU_INDEX_H
+
+#include <stdint.h>
+
+typedef struct dfu_if_t dfu_if;
+
+enum dfu_key {
+	DFU_KEY_SERIAL,		/* serial_name */
+	DFU_KEY_PATH,		/* USB port path, e.g. "1-2.3" */
+	DFU_KEY_ID,		/* vendor:product:altsetting */
+	DFU_NUM_KEYS
+};
+
+/* Probed interfaces in dfu_root order, valid until disconnect_devices() */
+extern dfu_if **dfu_devices;
+extern int dfu_num_devices;
+
+void dfu_index_build(void);
+void dfu_index_clear(void);
+
+/*
+ * The lookups return an index into dfu_devices[] or -1 if nothing
+ * matches. Several interfaces can share a key (all alternate settings
+ * of one device have the same serial and path); the others are reached
+ * with dfu_lookup_next() using the same key type.
+ */
+int dfu_lookup_serial(const char *serial);
+int dfu_lookup_path(const char *path);
+int dfu_lookup_id(uint16_t vendor, uint16_t product, uint8_t altsetting);
+int dfu_lookup_next(enum dfu_key key, int index);
+
+typedef struct {
+	const char *serial;	/* NULL matches any */
+	const char *path;	/* NULL matches any */
+	int alt;		/* -1 matches any */
+} dfu_selector;
+
+/*
+ * Index of the one DFU mode interface matching sel, -ENODEV if there
+ * is none and -EINVAL if the selector is ambiguous.
+ */
+int dfu_select(const dfu_selector *sel);
+
+#endif /* DFU_INDEX_H */
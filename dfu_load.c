@@ -38,26 +38,37 @@
 #include "dfu.h"
 #include "usb_dfu.h"
 #include "dfu_file.h"
+#include "dfu_progress.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+#include "dfu_metrics.h"
+#include "dfu_transport.h"
 #include "dfu_load.h"
 #include "quirks.h"
 
 int dfuload_do_upload(dfu_if *dif, int xfer_size,
-    int expected_size, int fd)
+    int expected_size, dfu_sink *sink)
 {
 	off_t total_bytes = 0;
 	unsigned short transaction = 0;
 	unsigned char *buf;
 	int ret;
 
-	buf = dfu_malloc(xfer_size);
-
 	printf("Copying data from DFU device to PC\n");
 
 	while (1) {
+		uint64_t start;
 		int rc;
+		if (dfu_cancelled(dif->cancel)) {
+			ret = dfu_cancel_abort(dif);
+			break;
+		}
 		dfu_progress_bar("Upload", total_bytes, expected_size);
+		buf = dfu_sink_next(sink, xfer_size);
+		start = dfu_stats_clock();
         rc = dfu_upload(dif->dev_handle, dif->intf,
 		    xfer_size, transaction++, buf);
+		dfu_stats_record(dif, DFU_STAT_UPLOAD, start);
 		if (rc < 0) {
 			warnx("\nError during upload (%s)",
 			      libusb_error_name(rc));
@@ -65,19 +76,29 @@ int dfuload_do_upload(dfu_if *dif, int xfer_size,
 			break;
 		}
 
-		dfu_file_write_crc(fd, 0, buf, rc);
+		dfu_sink_commit(sink, rc);
 		total_bytes += rc;
 
-		if (total_bytes < 0)
-			errx(EX_SOFTWARE, "\nReceived too many bytes (wraparound)");
+		if (total_bytes < 0) {
+			warnx("\nReceived too many bytes (wraparound)");
+			ret = -EOVERFLOW;
+			break;
+		}
 
 		if (rc < xfer_size) {
 			/* last block, return */
 			ret = 0;
 			break;
 		}
+		if (dfu_sink_full(sink)) {
+			/* the device has more, stop the upload */
+			ret = dfu_abort_to_idle(dif);
+			total_bytes = sink->size;
+			if (ret > 0)
+				ret = 0;
+			break;
+		}
 	}
-	free(buf);
 	if (ret == 0) {
 		dfu_progress_bar("Upload", total_bytes, total_bytes);
 	} else {
@@ -93,13 +114,22 @@ int dfuload_do_upload(dfu_if *dif, int xfer_size,
 	return ret;
 }
 
-off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file, int *percent)
+/*
+ * progress, if not NULL, is updated against a plan made with
+ * dfu_plan_dnload() for the same file and transfer size: one op per
+ * block, then the manifestation. A cancel is honoured up to the last
+ * block; once the device manifests the download runs to its end.
+ */
+off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, const dfu_file *file, int *percent,
+			struct dfu_progress *progress)
 {
 	off_t bytes_sent;
 	off_t expected_size;
 	unsigned char *buf;
 	unsigned short transaction = 0;
     dfu_status dst;
+	unsigned int polltimeout = 0;
+	int stalls;
 	int ret;
 
 	buf = file->firmware;
@@ -109,16 +139,23 @@ off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file, int *percent
     *percent = 0;
 	while (bytes_sent < expected_size) {
 		off_t bytes_left;
+		uint64_t start;
 		int chunk_size;
 
+		if (dfu_cancelled(dif->cancel)) {
+			ret = dfu_cancel_abort(dif);
+			goto out;
+		}
 		bytes_left = expected_size - bytes_sent;
 		if (bytes_left < xfer_size)
 			chunk_size = (int) bytes_left;
 		else
 			chunk_size = xfer_size;
 
+		start = dfu_stats_clock();
         ret = dfu_download(dif->dev_handle, dif->intf,
 		    chunk_size, transaction++, chunk_size ? buf : NULL);
+		dfu_stats_record(dif, DFU_STAT_DNLOAD, start);
 		if (ret < 0) {
 			warnx("Error during download (%s)",
 			      libusb_error_name(ret));
@@ -127,12 +164,26 @@ off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file, int *percent
 		bytes_sent += chunk_size;
 		buf += chunk_size;
 
+		start = dfu_stats_clock();
+		stalls = 0;
 		do {
 			ret = dfu_get_status(dif, &dst);
-			if (ret < 0) {
-				errx(EX_IOERR, "Error during download get_status (%s)",
+			/* Same workaround as dfuse_special_command(): a device
+			 * that stalls a poll gets the last poll timeout again,
+			 * from the previous block if need be */
+			if (ret == LIBUSB_ERROR_PIPE && polltimeout != 0 && stalls < 3) {
+				dst.bState = DFU_STATE_dfuDNBUSY;
+				dst.bwPollTimeout = polltimeout;
+				stalls++;
+				dfu_metrics_retry(DFU_RETRY_STALL);
+				if (verbose)
+					fprintf(stderr, "* Device stalled USB pipe, reusing last poll timeout\n");
+			} else if (ret < 0) {
+				warnx("Error during download get_status (%s)",
 				     libusb_error_name(ret));
 				goto out;
+			} else {
+				polltimeout = dst.bwPollTimeout;
 			}
 
 			if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
@@ -140,38 +191,55 @@ off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file, int *percent
 				break;
 
 			/* Wait while device executes flashing */
-			milli_sleep(dst.bwPollTimeout);
+			if (dfu_cancel_sleep(dif->cancel, dst.bwPollTimeout)) {
+				ret = dfu_cancel_abort(dif);
+				goto out;
+			}
 			if (verbose > 1)
 				fprintf(stderr, "Poll timeout %i ms\n", dst.bwPollTimeout);
 
 		} while (1);
+		if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE)
+			dfu_stats_record(dif, DFU_STAT_DNLOAD_BUSY, start);
         if (dst.bStatus != DFU_STATUS_OK) {
 			ret = -1;
 			goto out;
 		}
         *percent = bytes_sent * 100 / (bytes_sent + bytes_left);
+		if (progress)
+			dfu_progress_update(progress, transaction);
 	}
 
 	/* send one zero sized download request to signalize end */
     ret = dfu_download(dif->dev_handle, dif->intf,
 	    0, transaction, NULL);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error sending completion packet (%s)",
+		warnx("Error sending completion packet (%s)",
 		     libusb_error_name(ret));
 		goto out;
 	}
 
     *percent = 100;
+	stalls = 0;
 
 get_status:
 	/* Transition to MANIFEST_SYNC state */
 	ret = dfu_get_status(dif, &dst);
+	if (ret == LIBUSB_ERROR_PIPE && polltimeout != 0 && stalls < 3) {
+		stalls++;
+		dfu_metrics_retry(DFU_RETRY_STALL);
+		if (verbose)
+			fprintf(stderr, "* Device stalled USB pipe, reusing last poll timeout\n");
+		dfu_sleep(polltimeout);
+		goto get_status;
+	}
 	if (ret < 0) {
 		warnx("unable to read DFU status after completion (%s)",
 		      libusb_error_name(ret));
 		goto out;
     }
-	milli_sleep(dst.bwPollTimeout);
+	polltimeout = dst.bwPollTimeout;
+	dfu_sleep(dst.bwPollTimeout);
 
 	/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
 	switch (dst.bState) {
@@ -179,20 +247,30 @@ get_status:
 	case DFU_STATE_dfuMANIFEST:
 		/* some devices (e.g. TAS1020b) need some time before we
 		 * can obtain the status */
-		milli_sleep(1000);
+		dfu_sleep(1000);
+		if (progress)
+			dfu_progress_update(progress, transaction);
 		goto get_status;
 		break;
     case DFU_STATE_dfuMANIFEST_WAIT_RST:
-		ret = libusb_reset_device(dif->dev_handle);
+		ret = dfu_reset_device(dif->dev_handle);
 		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
 			fprintf(stderr, "error resetting after download (%s)\n",
 				libusb_error_name(ret));
 		}
+		/* the image is in, a failed reset is not a failed download */
+		ret = 0;
 		break;
 	case DFU_STATE_dfuIDLE:
 		break;
     }
+	if (progress)
+		dfu_progress_update(progress, transaction + 1);
 
 out:
+	/* negative libusb or DFU error, so that callers can tell a
+	 * failed download from a short image */
+	if (ret < 0)
+		return ret;
 	return bytes_sent;
 }
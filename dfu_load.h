@@ -2,7 +2,10 @@
 #define DFU_LOAD_H
 #include "dfu.h"
 
-int dfuload_do_upload(dfu_if *dif, int xfer_size, int expected_size, int fd);
-off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file, int *percent);
+struct dfu_progress;
+
+int dfuload_do_upload(dfu_if *dif, int xfer_size, int expected_size, dfu_sink *sink);
+off_t dfuload_do_dnload(dfu_if *dif, int xfer_size, const dfu_file *file, int *percent,
+			struct dfu_progress *progress);
 
 #endif /* DFU_LOAD_H */
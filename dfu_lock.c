@@ -0,0 +1,224 @@
+/*
+ * Advisory cross-process device locks
+ *
+ * Each device is represented by a lock file for its port path and one
+ * for its serial number inside a shared directory, held with flock().
+ * Separate flashing processes pointed at the same directory therefore
+ * divide the devices on a rig between them instead of fighting over
+ * the first match, and a crashed process drops its locks with its file
+ * descriptors. The files are left in place; removing them would race
+ * with a concurrent locker.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_lock.h"
+
+#define MAX_HELD_LOCKS 256
+
+typedef struct {
+	const dfu_if *dif;
+	int fd[2];		/* path, serial; -1 if not used */
+} held_lock;
+
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *lock_dir;
+static int lock_dir_set;
+static held_lock held[MAX_HELD_LOCKS];
+static int num_held;
+
+void dfu_set_lock_dir(const char *dir)
+{
+	pthread_mutex_lock(&lock_mutex);
+	free(lock_dir);
+	lock_dir = dir ? strdup(dir) : NULL;
+	lock_dir_set = 1;
+	pthread_mutex_unlock(&lock_mutex);
+}
+
+/* caller holds lock_mutex */
+static const char *get_lock_dir(void)
+{
+	if (!lock_dir_set) {
+		const char *env = getenv("DFU_LOCK_DIR");
+
+		if (env && *env)
+			lock_dir = strdup(env);
+		lock_dir_set = 1;
+	}
+	return lock_dir;
+}
+
+int dfu_lock_enabled(void)
+{
+	int enabled;
+
+	pthread_mutex_lock(&lock_mutex);
+	enabled = get_lock_dir() != NULL;
+	pthread_mutex_unlock(&lock_mutex);
+	return enabled;
+}
+
+#ifndef _WIN32
+/*
+ * Returns an fd holding the lock, -1 with errno EBUSY if taken or
+ * ENAMETOOLONG if the lock directory leaves no room for the name
+ */
+static int lock_file(const char *dir, const char *kind, const char *key)
+{
+	char name[PATH_MAX];
+	size_t n;
+	int fd;
+
+	n = snprintf(name, sizeof(name), "%s/dfu-%s-", dir, kind);
+	if (n >= sizeof(name) - sizeof(".lock")) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	/* keep the key from escaping the directory */
+	for (; *key && n + 6 < sizeof(name); key++)
+		name[n++] = (*key == '/' || *key < 0x21 || *key > 0x7e) ? '_' : *key;
+	strcpy(name + n, ".lock");
+
+	fd = open(name, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		warn("Cannot open lock file %s", name);
+		return -1;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		int saved = errno;
+
+		close(fd);
+		errno = (saved == EWOULDBLOCK) ? EBUSY : saved;
+		return -1;
+	}
+	return fd;
+}
+
+static void unlock_file(int fd)
+{
+	if (fd < 0)
+		return;
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+#endif
+
+int dfu_lock_device(const dfu_if *dif)
+{
+#ifdef _WIN32
+	(void)dif;
+	return 0;
+#else
+	const char *dir;
+	held_lock entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&lock_mutex);
+	dir = get_lock_dir();
+	if (dir == NULL)
+		goto out;
+	if (num_held == MAX_HELD_LOCKS) {
+		ret = ENOMEM;
+		goto out;
+	}
+
+	entry.dif = dif;
+	entry.fd[0] = -1;
+	entry.fd[1] = -1;
+	if (dif->path != NULL) {
+		entry.fd[0] = lock_file(dir, "path", dif->path);
+		if (entry.fd[0] < 0) {
+			ret = errno;
+			goto out;
+		}
+	}
+	if (dif->serial_name != NULL && strcmp(dif->serial_name, "UNKNOWN")) {
+		entry.fd[1] = lock_file(dir, "serial", dif->serial_name);
+		if (entry.fd[1] < 0) {
+			ret = errno;
+			unlock_file(entry.fd[0]);
+			goto out;
+		}
+	}
+	held[num_held++] = entry;
+out:
+	pthread_mutex_unlock(&lock_mutex);
+	return ret;
+#endif
+}
+
+void dfu_unlock_device(const dfu_if *dif)
+{
+#ifdef _WIN32
+	(void)dif;
+#else
+	int i;
+
+	pthread_mutex_lock(&lock_mutex);
+	for (i = 0; i < num_held; i++) {
+		if (held[i].dif == dif) {
+			unlock_file(held[i].fd[0]);
+			unlock_file(held[i].fd[1]);
+			held[i] = held[--num_held];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock_mutex);
+#endif
+}
+
+int dfu_lock_any(dfu_if **out)
+{
+	dfu_if *pdfu;
+	int ret = EBUSY;
+
+	*out = NULL;
+	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
+		int i = pdfu->path ? dfu_lookup_path(pdfu->path) : -1;
+
+		/* another interface on the same device also matched */
+		if (i >= 0 && dfu_lookup_next(DFU_KEY_PATH, i) >= 0) {
+			fprintf(stderr, "Device %s has more than one matching "
+				"DFU interface, specify the alternate setting\n",
+				pdfu->path);
+			return EINVAL;
+		}
+	}
+	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
+		ret = dfu_lock_device(pdfu);
+		if (ret == 0) {
+			*out = pdfu;
+			return 0;
+		}
+		if (ret != EBUSY)
+			return ret;
+	}
+	return ret;
+}
@@ -0,0 +1,43 @@
+/*
+ * Advisory cross-process device locks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_LOCK_H
+#define DFU_LOCK_H
+
+typedef struct dfu_if_t dfu_if;
+
+/*
+ * Locking is off unless a directory is set here or through the
+ * DFU_LOCK_DIR environment variable. When it is on, every process
+ * sharing the directory skips devices claimed by another one.
+ */
+void dfu_set_lock_dir(const char *dir);
+int dfu_lock_enabled(void);
+
+/* 0 if locked (or locking is off), EBUSY if another holder has it */
+int dfu_lock_device(const dfu_if *dif);
+void dfu_unlock_device(const dfu_if *dif);
+
+/*
+ * Lock the first free device in dfu_root. Returns 0 and the interface,
+ * EBUSY if all are taken, or EINVAL if a device offers more than one
+ * matching interface and the choice would be a guess.
+ */
+int dfu_lock_any(dfu_if **dif);
+
+#endif /* DFU_LOCK_H */
@@ -0,0 +1,307 @@
+/*
+ * Process wide flashing metrics in the Prometheus text format
+ *
+ * Line monitoring already scrapes Prometheus text files. Counting the
+ * flashes by result, the payload written, the retries and the devices
+ * seen, next to the request latencies dfu_stats keeps anyway, lets it
+ * catch a station whose throughput went down without parsing anybody's
+ * output. Writers only take a mutex or an atomic add, so the counters
+ * stay on in production.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_stats.h"
+#include "dfu_metrics.h"
+
+enum flash_result {
+	RESULT_OK,
+	RESULT_REJECTED,	/* image not for this device */
+	RESULT_BUSY,		/* device locked by another process */
+	RESULT_CANCELLED,
+	RESULT_ERROR,
+	NUM_RESULTS
+};
+
+static const char *result_names[NUM_RESULTS] = {
+	"ok", "rejected", "busy", "cancelled", "error"
+};
+
+static const char *retry_names[DFU_RETRY_NUM_REASONS] = {
+	"stall", "idle"
+};
+
+/* Histogram bounds in us, a subset of the dfu_stats bucket range */
+static const uint64_t bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000,
+	60000000
+};
+
+typedef struct product_metrics {
+	uint16_t vendor;
+	uint16_t product;
+	uint64_t flashes[NUM_RESULTS];
+	uint64_t bytes;
+	uint64_t seen;
+	struct product_metrics *next;
+} product_metrics;
+
+typedef struct seen_device {
+	char *key;
+	struct seen_device *next;
+} seen_device;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static product_metrics *products;
+static seen_device *seen;
+static dfu_histogram flash_time;
+static dfu_histogram reenumeration_time;
+static uint64_t retries[DFU_RETRY_NUM_REASONS];
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum flash_result classify(int result)
+{
+	switch (result) {
+	case 0:
+		return RESULT_OK;
+	case EINVAL:
+		return RESULT_REJECTED;
+	case EBUSY:
+		return RESULT_BUSY;
+	case ECANCELED:
+		return RESULT_CANCELLED;
+	default:
+		return RESULT_ERROR;
+	}
+}
+
+/* Called with metrics_lock held */
+static product_metrics *product_get(const dfu_if *dif)
+{
+	product_metrics *p;
+
+	for (p = products; p != NULL; p = p->next)
+		if (p->vendor == dif->vendor && p->product == dif->product)
+			return p;
+	p = dfu_malloc(sizeof(*p));
+	memset(p, 0, sizeof(*p));
+	p->vendor = dif->vendor;
+	p->product = dif->product;
+	p->next = products;
+	products = p;
+	return p;
+}
+
+void dfu_metrics_flash(const dfu_if *dif, int result, uint64_t bytes,
+		       uint64_t usec)
+{
+	product_metrics *p;
+
+	pthread_mutex_lock(&metrics_lock);
+	p = product_get(dif);
+	p->flashes[classify(result)]++;
+	p->bytes += bytes;
+	pthread_mutex_unlock(&metrics_lock);
+	dfu_histogram_add(&flash_time, usec);
+}
+
+void dfu_metrics_retry(enum dfu_retry_reason reason)
+{
+	__atomic_fetch_add(&retries[reason], 1, __ATOMIC_RELAXED);
+}
+
+void dfu_metrics_reenumerated(uint64_t usec)
+{
+	dfu_histogram_add(&reenumeration_time, usec);
+}
+
+void dfu_metrics_device_seen(const dfu_if *dif)
+{
+	seen_device *dev;
+	char key[320];
+
+	if (dif->serial_name && dif->serial_name[0])
+		snprintf(key, sizeof(key), "%04x:%04x/%s", dif->vendor,
+			 dif->product, dif->serial_name);
+	else if (dif->path)
+		snprintf(key, sizeof(key), "%04x:%04x@%s", dif->vendor,
+			 dif->product, dif->path);
+	else
+		snprintf(key, sizeof(key), "%04x:%04x@%u-%u", dif->vendor,
+			 dif->product, dif->busnum, dif->devnum);
+
+	pthread_mutex_lock(&metrics_lock);
+	for (dev = seen; dev != NULL; dev = dev->next)
+		if (!strcmp(dev->key, key))
+			break;
+	if (dev == NULL) {
+		dev = dfu_malloc(sizeof(*dev));
+		dev->key = dfu_malloc(strlen(key) + 1);
+		strcpy(dev->key, key);
+		dev->next = seen;
+		seen = dev;
+		product_get(dif)->seen++;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static void write_header(FILE *out, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Cumulative buckets at the fixed bounds. A dfu_stats bucket counts
+ * towards the first bound it lies wholly below, so a value may show up
+ * one bound late, never early.
+ */
+static void write_histogram(FILE *out, const char *name, const char *labels,
+			    const dfu_histogram *hist)
+{
+	const char *sep = labels[0] ? "," : "";
+	uint64_t count = 0;
+	int bucket = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+		while (bucket < DFU_HIST_BUCKETS - 1 &&
+		       dfu_histogram_bucket_low(bucket + 1) - 1 <= bounds[i])
+			count += hist->bucket[bucket++];
+		fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+			bounds[i] / 1e6, (unsigned long long) count);
+	}
+	/* the total of the buckets, count may be ahead of them */
+	while (bucket < DFU_HIST_BUCKETS)
+		count += hist->bucket[bucket++];
+	fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+		(unsigned long long) count);
+	if (labels[0]) {
+		fprintf(out, "%s_sum{%s} %.6f\n", name, labels, hist->sum / 1e6);
+		fprintf(out, "%s_count{%s} %llu\n", name, labels,
+			(unsigned long long) count);
+	} else {
+		fprintf(out, "%s_sum %.6f\n", name, hist->sum / 1e6);
+		fprintf(out, "%s_count %llu\n", name, (unsigned long long) count);
+	}
+}
+
+int dfu_metrics_write(FILE *out)
+{
+	product_metrics *p;
+	dfu_stats *total;
+	char labels[32];
+	int kind;
+	int i;
+
+	pthread_mutex_lock(&metrics_lock);
+	write_header(out, "dfu_flashes_total", "counter",
+		     "Flashes by device and result.");
+	for (p = products; p != NULL; p = p->next)
+		for (i = 0; i < NUM_RESULTS; i++)
+			fprintf(out, "dfu_flashes_total{vid_pid=\"%04x:%04x\","
+				"result=\"%s\"} %llu\n", p->vendor, p->product,
+				result_names[i],
+				(unsigned long long) p->flashes[i]);
+	write_header(out, "dfu_bytes_written_total", "counter",
+		     "Payload bytes sent to devices by flashes.");
+	for (p = products; p != NULL; p = p->next)
+		fprintf(out, "dfu_bytes_written_total{vid_pid=\"%04x:%04x\"} "
+			"%llu\n", p->vendor, p->product,
+			(unsigned long long) p->bytes);
+	write_header(out, "dfu_devices_seen_total", "counter",
+		     "Different devices probed, by serial number or USB path.");
+	for (p = products; p != NULL; p = p->next)
+		fprintf(out, "dfu_devices_seen_total{vid_pid=\"%04x:%04x\"} "
+			"%llu\n", p->vendor, p->product,
+			(unsigned long long) p->seen);
+	pthread_mutex_unlock(&metrics_lock);
+
+	write_header(out, "dfu_retries_total", "counter",
+		     "Requests the library retried, by reason.");
+	for (i = 0; i < DFU_RETRY_NUM_REASONS; i++)
+		fprintf(out, "dfu_retries_total{reason=\"%s\"} %llu\n",
+			retry_names[i], (unsigned long long)
+			__atomic_load_n(&retries[i], __ATOMIC_RELAXED));
+
+	write_header(out, "dfu_flash_duration_seconds", "histogram",
+		     "Time from the start of a flash to its result.");
+	write_histogram(out, "dfu_flash_duration_seconds", "", &flash_time);
+	write_header(out, "dfu_reenumeration_seconds", "histogram",
+		     "Time from the end of a flash until the device is back.");
+	write_histogram(out, "dfu_reenumeration_seconds", "",
+			&reenumeration_time);
+
+	total = dfu_malloc(sizeof(*total));
+	dfu_stats_total(total);
+	write_header(out, "dfu_request_duration_seconds", "histogram",
+		     "DFU request latency by request; erase, dnload_busy "
+		     "and getstatus are erase, program and poll time.");
+	for (kind = 0; kind < DFU_STAT_NUM_KINDS; kind++) {
+		snprintf(labels, sizeof(labels), "request=\"%s\"",
+			 dfu_stat_kind_name(kind));
+		write_histogram(out, "dfu_request_duration_seconds", labels,
+				&total->hist[kind]);
+	}
+	free(total);
+
+	return ferror(out) ? EIO : 0;
+}
+
+int dfu_metrics_save(const char *path)
+{
+	char *tmp;
+	FILE *f;
+	int ret;
+
+	tmp = dfu_malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	/* one writer at a time, they share the temporary file */
+	pthread_mutex_lock(&save_lock);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		ret = errno;
+		goto out;
+	}
+	ret = dfu_metrics_write(f);
+	if (fclose(f) && !ret)
+		ret = errno;
+	if (ret) {
+		unlink(tmp);
+		goto out;
+	}
+#ifdef _WIN32
+	unlink(path);
+#endif
+	if (rename(tmp, path)) {
+		ret = errno;
+		unlink(tmp);
+	}
+out:
+	pthread_mutex_unlock(&save_lock);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,64 @@
+/*
+ * Process wide flashing metrics in the Prometheus text format
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_METRICS_H
+#define DFU_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct dfu_if_t dfu_if;
+
+enum dfu_retry_reason {
+	DFU_RETRY_STALL,	/* a poll stalled, last poll timeout reused */
+	DFU_RETRY_IDLE,		/* another round of getting to dfuIDLE */
+	DFU_RETRY_NUM_REASONS
+};
+
+/*
+ * A flash ended with result (0 or an errno value) after usec, with
+ * bytes of payload sent to the device. Counted by result and by the
+ * device's VID:PID.
+ */
+void dfu_metrics_flash(const dfu_if *dif, int result, uint64_t bytes,
+		       uint64_t usec);
+
+/* The library counts its own retries */
+void dfu_metrics_retry(enum dfu_retry_reason reason);
+
+/* A flashed device came back on the bus usec after the flash ended */
+void dfu_metrics_reenumerated(uint64_t usec);
+
+/*
+ * Count a device as seen, once per serial number (else USB path) and
+ * VID:PID for as long as the process runs.
+ */
+void dfu_metrics_device_seen(const dfu_if *dif);
+
+/*
+ * All of the above, and the request latencies of every device from
+ * dfu_stats_device() as dfu_request_duration_seconds, whose erase,
+ * dnload_busy and getstatus series are the erase, program and poll
+ * time. Returns 0 or an errno value.
+ */
+int dfu_metrics_write(FILE *out);
+
+/* The same into a file that scrapers never see half written */
+int dfu_metrics_save(const char *path);
+
+#endif /* DFU_METRICS_H */
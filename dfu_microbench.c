@@ -0,0 +1,374 @@
+/*
+ * dfu-microbench: time the host side parsers and checksums
+ *
+ *   dfu-microbench [-s image_size] [-t seconds] [-b name] [-v]
+ *
+ * Runs each benchmark on inputs made up in memory for at least the
+ * given seconds (0.5 by default) and prints the results as JSON, one
+ * object per benchmark with its name, the ops run, ns per op and, for
+ * those that go through a buffer, bytes per op and per second. -b runs
+ * only the benchmarks whose name contains the string.
+ *
+ *   crc32          dfu_crc32() over the whole image
+ *   crc32_small    dfu_crc32() over 32 bytes, below the vector path
+ *   hash           CRC32 and SHA-256 in 2 KiB updates, as uploads hash
+ *   load_suffix    dfu_load_buffer() of an image with a DFU suffix
+ *   load_prefix    the same with a TI Stellaris prefix to probe as well
+ *   layout_parse   parse_memory_layout() of 2048 groups of one 2 KiB page
+ *   find_segment   a lookup at a random address in that layout
+ *   dfuse_file     walking a DfuSe file of 64 KiB elements into a plan
+ *                  for that layout, as dfuse_do_dnload() walks it
+ *
+ * The image is 1 MiB unless -s says otherwise, up to the 4 MiB the
+ * layout covers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_hash.h"
+#include "dfu_stats.h"
+#include "dfu_plan.h"
+#include "dfuse_mem.h"
+
+#define SUFFIX_LENGTH 16
+#define LMDFU_PREFIX_LENGTH 8
+#define FLASH_BASE 0x08000000
+#define LAYOUT_PAGES 2048
+#define PAGE_SIZE 2048
+#define ELEMENT_SIZE 65536
+#define LOOKUPS 4096
+
+typedef struct {
+	const char *name;
+	void (*run)(long ops);
+	const size_t *bytes;	/* per op, NULL if a byte rate makes no sense */
+} benchmark;
+
+static size_t image_size = 1024 * 1024;
+static uint8_t *image;
+static uint8_t *suffixed;
+static size_t suffixed_size;
+static uint8_t *prefixed;
+static size_t prefixed_size;
+static char *layout;
+static size_t layout_size;
+static struct memsegment *segments;
+static unsigned int lookups[LOOKUPS];
+static dfu_file dfuse_file;
+static size_t dfuse_size;
+static const size_t small_size = 32;
+
+/* keeps the compiler from dropping the work */
+static volatile uint32_t sink;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+/* Append a DFU suffix to len bytes at buf, which has room for it */
+static size_t add_suffix(uint8_t *buf, size_t len, uint16_t bcdDFU)
+{
+	uint8_t *s = buf + len;
+
+	s[0] = s[1] = s[2] = s[3] = s[4] = s[5] = 0xff;
+	s[6] = bcdDFU & 0xff;
+	s[7] = bcdDFU >> 8;
+	s[8] = 'U';
+	s[9] = 'F';
+	s[10] = 'D';
+	s[11] = SUFFIX_LENGTH;
+	put32(s + 12, dfu_crc32(0xffffffff, buf, len + SUFFIX_LENGTH - 4));
+	return len + SUFFIX_LENGTH;
+}
+
+static void make_inputs(void)
+{
+	dfu_file file;
+	uint32_t x = 1;
+	uint8_t *p;
+	size_t off;
+	size_t i;
+	int n;
+
+	image = dfu_malloc(image_size);
+	for (i = 0; i < image_size; i++) {
+		x = x * 1103515245 + 12345;
+		image[i] = x >> 16;
+	}
+
+	suffixed = dfu_malloc(image_size + SUFFIX_LENGTH);
+	memcpy(suffixed, image, image_size);
+	suffixed_size = add_suffix(suffixed, image_size, 0x0100);
+
+	prefixed = dfu_malloc(LMDFU_PREFIX_LENGTH + image_size + SUFFIX_LENGTH);
+	memset(prefixed, 0, LMDFU_PREFIX_LENGTH);
+	prefixed[0] = 0x01;
+	prefixed[2] = (FLASH_BASE / 1024) & 0xff;
+	prefixed[3] = ((FLASH_BASE / 1024) >> 8) & 0xff;
+	put32(prefixed + 4, image_size);
+	memcpy(prefixed + LMDFU_PREFIX_LENGTH, image, image_size);
+	prefixed_size = add_suffix(prefixed, LMDFU_PREFIX_LENGTH + image_size,
+				   0x0100);
+
+	layout = dfu_malloc(32 + LAYOUT_PAGES * 8);
+	n = sprintf(layout, "@Internal Flash  /0x%08x/", FLASH_BASE);
+	for (i = 0; i < LAYOUT_PAGES; i++)
+		n += sprintf(layout + n, "%s1*002Kg", i ? "," : "");
+	layout_size = n;
+	segments = parse_memory_layout(layout);
+	if (segments == NULL)
+		errx(EX_SOFTWARE, "Cannot parse the layout");
+	for (i = 0; i < LOOKUPS; i++) {
+		x = x * 1103515245 + 12345;
+		lookups[i] = FLASH_BASE + (x >> 8) % (LAYOUT_PAGES * PAGE_SIZE);
+	}
+
+	/* one target, alternate setting 0, as many elements as it takes */
+	n = (image_size + ELEMENT_SIZE - 1) / ELEMENT_SIZE;
+	p = dfu_malloc(11 + 274 + n * 8 + image_size + SUFFIX_LENGTH);
+	memset(p, 0, 11 + 274);
+	memcpy(p, "DfuSe\x01", 6);
+	p[10] = 1;
+	memcpy(p + 11, "Target", 6);
+	put32(p + 11 + 266, n * 8 + image_size);
+	put32(p + 11 + 270, n);
+	off = 11 + 274;
+	for (i = 0; i < image_size; i += ELEMENT_SIZE) {
+		size_t size = image_size - i < ELEMENT_SIZE ?
+			      image_size - i : ELEMENT_SIZE;
+
+		put32(p + off, FLASH_BASE + i);
+		put32(p + off + 4, size);
+		memcpy(p + off + 8, image + i, size);
+		off += 8 + size;
+	}
+	put32(p + 6, off);
+	off = add_suffix(p, off, 0x011a);
+	dfuse_size = off;
+
+	memset(&file, 0, sizeof(file));
+	if (dfu_load_buffer(&file, p, off, NEEDS_SUFFIX, NO_PREFIX))
+		errx(EX_SOFTWARE, "Cannot load the DfuSe image");
+	dfuse_file = file;
+	free(p);
+}
+
+static void run_crc32(long ops)
+{
+	long i;
+
+	for (i = 0; i < ops; i++)
+		sink += dfu_crc32(0xffffffff, image, image_size);
+}
+
+static void run_crc32_small(long ops)
+{
+	long i;
+
+	for (i = 0; i < ops; i++)
+		sink += dfu_crc32(0xffffffff, image + (i & 1023) * small_size,
+				  small_size);
+}
+
+static void run_hash(long ops)
+{
+	uint8_t digest[32];
+	dfu_hash hash;
+	uint32_t crc;
+	size_t p;
+	long i;
+
+	for (i = 0; i < ops; i++) {
+		dfu_hash_init(&hash);
+		for (p = 0; p < image_size; p += 2048)
+			dfu_hash_update(&hash, image + p, image_size - p < 2048 ?
+					image_size - p : 2048);
+		dfu_hash_final(&hash, &crc, digest);
+		sink += crc + digest[0];
+	}
+}
+
+static void run_load(long ops, const uint8_t *data, size_t size,
+		     enum prefix_req prefix)
+{
+	dfu_file file;
+	long i;
+
+	memset(&file, 0, sizeof(file));
+	for (i = 0; i < ops; i++) {
+		dfu_load_buffer(&file, data, size, NEEDS_SUFFIX, prefix);
+		sink += file.size.prefix + file.dwCRC;
+	}
+	free(file.firmware);
+}
+
+static void run_load_suffix(long ops)
+{
+	run_load(ops, suffixed, suffixed_size, NO_PREFIX);
+}
+
+static void run_load_prefix(long ops)
+{
+	run_load(ops, prefixed, prefixed_size, NEEDS_PREFIX);
+}
+
+static void run_layout_parse(long ops)
+{
+	struct memsegment *list;
+	long i;
+
+	for (i = 0; i < ops; i++) {
+		list = parse_memory_layout(layout);
+		sink += list != NULL;
+		free_segment_list(list);
+	}
+}
+
+static void run_find_segment(long ops)
+{
+	long i;
+
+	for (i = 0; i < ops; i++)
+		sink += find_segment(segments, lookups[i % LOOKUPS])->pagesize;
+}
+
+static void run_dfuse_file(long ops)
+{
+	dfu_plan plan;
+	long i;
+
+	for (i = 0; i < ops; i++) {
+		if (dfu_plan_dfuse(&plan, segments, 0, &dfuse_file, 2048, -1))
+			errx(EX_SOFTWARE, "Cannot walk the DfuSe file");
+		sink += plan.count;
+		dfu_plan_free(&plan);
+	}
+}
+
+static const benchmark benchmarks[] = {
+	{ "crc32", run_crc32, &image_size },
+	{ "crc32_small", run_crc32_small, &small_size },
+	{ "hash", run_hash, &image_size },
+	{ "load_suffix", run_load_suffix, &suffixed_size },
+	{ "load_prefix", run_load_prefix, &prefixed_size },
+	{ "layout_parse", run_layout_parse, &layout_size },
+	{ "find_segment", run_find_segment, NULL },
+	{ "dfuse_file", run_dfuse_file, &dfuse_size },
+};
+
+/* Double the ops, or aim past the time, until a run takes long enough */
+static long measure(const benchmark *b, double seconds, uint64_t *usec)
+{
+	uint64_t target = seconds * 1e6;
+	uint64_t start;
+	long ops = 1;
+	double scale;
+
+	b->run(1);
+	for (;;) {
+		start = dfu_stats_clock();
+		b->run(ops);
+		*usec = dfu_stats_clock() - start;
+		if (*usec >= target)
+			return ops;
+		scale = *usec < 1000 ? 10 : 1.2 * target / *usec;
+		if (scale > 100)
+			scale = 100;
+		ops = ops * scale + 1;
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s image_size] [-t seconds] [-b name] [-v]\n",
+		name);
+	exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *filter = NULL;
+	double seconds = 0.5;
+	uint64_t usec;
+	double ns;
+	long ops;
+	int first = 1;
+	int opt;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "s:t:b:vh")) != -1) {
+		switch (opt) {
+		case 's':
+			image_size = strtoul(optarg, NULL, 0);
+			if (image_size == 0 ||
+			    image_size > LAYOUT_PAGES * PAGE_SIZE)
+				usage(argv[0]);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'b':
+			filter = optarg;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	make_inputs();
+	printf("{\n  \"image_size\": %zu,\n  \"benchmarks\": [", image_size);
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		const benchmark *b = &benchmarks[i];
+
+		if (filter && strstr(b->name, filter) == NULL)
+			continue;
+		ops = measure(b, seconds, &usec);
+		ns = usec * 1e3 / ops;
+		printf("%s\n    { \"name\": \"%s\", \"ops\": %ld, "
+		       "\"ns_per_op\": %.1f", first ? "" : ",", b->name, ops, ns);
+		if (b->bytes)
+			printf(", \"bytes_per_op\": %zu, \"bytes_per_sec\": %.0f",
+			       *b->bytes, *b->bytes * 1e9 / ns);
+		printf(" }");
+		fflush(stdout);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+
+	free_segment_list(segments);
+	free(dfuse_file.firmware);
+	free(layout);
+	free(prefixed);
+	free(suffixed);
+	free(image);
+	return 0;
+}
@@ -0,0 +1,465 @@
+/*
+ * Download plans: the DFU requests a download is made of, worked out
+ * before talking to the device
+ *
+ * dfuload_do_dnload() and dfuse_do_dnload() decide what to send while
+ * they send it, one blocking request after the other. Laying the same
+ * sequence out up front lets a single thread interleave many devices,
+ * and makes it possible to look at what a download would do without a
+ * device attached.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_file.h"
+#include "dfuse_mem.h"
+#include "quirks.h"
+#include "dfu_plan.h"
+
+static dfu_plan_op *plan_add(dfu_plan *plan, enum dfu_plan_type type)
+{
+	dfu_plan_op *op;
+
+	if (plan->count == plan->capacity) {
+		plan->capacity = plan->capacity ? 2 * plan->capacity : 64;
+		plan->ops = realloc(plan->ops, sizeof(*plan->ops) * plan->capacity);
+		if (plan->ops == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+	op = &plan->ops[plan->count++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	return op;
+}
+
+int dfu_plan_dnload(dfu_plan *plan, const dfu_file *file, int xfer_size)
+{
+	const uint8_t *buf = file->firmware;
+	off_t expected_size = file->size.total - file->size.suffix;
+	off_t bytes_sent = 0;
+	uint16_t transaction = 0;
+	dfu_plan_op *op;
+
+	memset(plan, 0, sizeof(*plan));
+	if (xfer_size <= 0)
+		return EINVAL;
+
+	while (bytes_sent < expected_size) {
+		int chunk_size = xfer_size;
+
+		if (expected_size - bytes_sent < xfer_size)
+			chunk_size = (int) (expected_size - bytes_sent);
+		op = plan_add(plan, DFU_PLAN_DNLOAD);
+		op->transaction = transaction++;
+		op->data = buf + bytes_sent;
+		op->size = chunk_size;
+		bytes_sent += chunk_size;
+	}
+	plan->bytes = expected_size;
+
+	op = plan_add(plan, DFU_PLAN_MANIFEST);
+	op->transaction = transaction;
+	return 0;
+}
+
+static int plan_writeable(struct memsegment *layout, unsigned int address)
+{
+	struct memsegment *segment = find_segment(layout, address);
+
+	if (!segment || !(segment->memtype & DFUSE_WRITEABLE)) {
+		warnx("Page at 0x%08x is not writeable", address);
+		return 0;
+	}
+	return 1;
+}
+
+static void plan_erase(dfu_plan *plan, unsigned int address, int page_size,
+		       unsigned int *last_erased_page)
+{
+	dfu_plan_op *op;
+
+	if ((address & ~(page_size - 1)) == *last_erased_page)
+		return;
+	op = plan_add(plan, DFU_PLAN_ERASE);
+	op->address = address;
+	op->size = page_size;
+	*last_erased_page = address & ~(page_size - 1);
+}
+
+/* Same passes as dfuse_dnload_element(), without --force */
+static int plan_element(dfu_plan *plan, struct memsegment *layout,
+			unsigned int dwElementAddress, unsigned int dwElementSize,
+			const uint8_t *data, int xfer_size,
+			unsigned int *last_erased_page)
+{
+	unsigned int p;
+
+	if (dwElementSize == 0)
+		return 0;
+	if (!plan_writeable(layout, dwElementAddress + dwElementSize - 1))
+		return EFAULT;
+
+	/* First pass: Erase involved pages */
+	for (p = 0; p < dwElementSize; p += xfer_size) {
+		unsigned int address = dwElementAddress + p;
+		unsigned int erase_address;
+		struct memsegment *segment;
+		int chunk_size = xfer_size;
+
+		if (!plan_writeable(layout, address))
+			return EFAULT;
+		segment = find_segment(layout, address);
+		if (!(segment->memtype & DFUSE_ERASABLE))
+			continue;
+		if (p + chunk_size > dwElementSize)
+			chunk_size = dwElementSize - p;
+
+		for (erase_address = address;
+		     erase_address < address + chunk_size;
+		     erase_address += segment->pagesize)
+			plan_erase(plan, erase_address, segment->pagesize,
+				   last_erased_page);
+		plan_erase(plan, address + chunk_size - 1, segment->pagesize,
+			   last_erased_page);
+	}
+
+	/* Second pass: Write data to (erased) pages */
+	for (p = 0; p < dwElementSize; p += xfer_size) {
+		dfu_plan_op *op;
+		int chunk_size = xfer_size;
+
+		if (p + chunk_size > dwElementSize)
+			chunk_size = dwElementSize - p;
+
+		op = plan_add(plan, DFU_PLAN_SET_ADDRESS);
+		op->address = dwElementAddress + p;
+
+		/* transaction = 2 for no address offset */
+		op = plan_add(plan, DFU_PLAN_DNLOAD);
+		op->transaction = 2;
+		op->data = data + p;
+		op->size = chunk_size;
+		plan->bytes += chunk_size;
+	}
+	return 0;
+}
+
+static unsigned int quad2uint(const uint8_t *p)
+{
+	return (*p + (*(p + 1) << 8) + (*(p + 2) << 16) + (*(p + 3) << 24));
+}
+
+/* Walk a DfuSe file like dfuse_do_dfuse_dnload(), EINVAL if corrupt */
+static int plan_dfuse_file(dfu_plan *plan, struct memsegment *layout,
+			   int altsetting, const uint8_t *data, int rem,
+			   int xfer_size, unsigned int *last_erased_page)
+{
+	int bTargets;
+	int image;
+	int ret;
+
+	if (rem < 11 || strncmp((const char *) data, "DfuSe", 5) || data[5] != 0x01) {
+		warnx("No valid DfuSe signature");
+		return EINVAL;
+	}
+	bTargets = data[10];
+	data += 11;
+	rem -= 11;
+
+	for (image = 1; image <= bTargets; image++) {
+		int bAlternateSetting;
+		unsigned int dwNbElements;
+		unsigned int element;
+
+		if (rem < 274 || strncmp((const char *) data, "Target", 6)) {
+			warnx("No valid target signature");
+			return EINVAL;
+		}
+		bAlternateSetting = data[6];
+		dwNbElements = quad2uint(data + 270);
+		data += 274;
+		rem -= 274;
+
+		for (element = 1; element <= dwNbElements; element++) {
+			unsigned int dwElementAddress;
+			unsigned int dwElementSize;
+
+			if (rem < 8) {
+				warnx("Corrupt DfuSe file: element header");
+				return EINVAL;
+			}
+			dwElementAddress = quad2uint(data);
+			dwElementSize = quad2uint(data + 4);
+			data += 8;
+			rem -= 8;
+			if (dwElementSize > (unsigned int) rem) {
+				warnx("File too small for element size");
+				return EINVAL;
+			}
+			if (bAlternateSetting == altsetting) {
+				ret = plan_element(plan, layout, dwElementAddress,
+						   dwElementSize, data, xfer_size,
+						   last_erased_page);
+				if (ret)
+					return ret;
+			}
+			data += dwElementSize;
+			rem -= dwElementSize;
+		}
+	}
+	if (rem != 0)
+		warnx("%d bytes leftover", rem);
+	return 0;
+}
+
+int dfu_plan_dfuse(dfu_plan *plan, struct memsegment *layout, int altsetting,
+		   const dfu_file *file, int xfer_size, int64_t address)
+{
+	unsigned int last_erased_page = 1; /* non-aligned value, won't match */
+	const uint8_t *data = file->firmware + file->size.prefix;
+	int rem = file->size.total - file->size.prefix - file->size.suffix;
+	int ret;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->dfuse = 1;
+	if (xfer_size <= 0 || layout == NULL)
+		return EINVAL;
+
+	if (file->bcdDFU == 0x11a) {
+		ret = plan_dfuse_file(plan, layout, altsetting, data, rem,
+				      xfer_size, &last_erased_page);
+	} else {
+		if (address < 0)
+			address = layout->start;
+		ret = plan_element(plan, layout, (unsigned int) address, rem,
+				   data, xfer_size, &last_erased_page);
+	}
+	if (ret) {
+		dfu_plan_free(plan);
+		return ret;
+	}
+	plan_add(plan, DFU_PLAN_ABORT);
+	return 0;
+}
+
+int dfu_plan_build(dfu_plan *plan, dfu_if *dif, const dfu_file *file,
+		   int xfer_size, int64_t dfuse_address)
+{
+	struct memsegment *layout;
+	int ret;
+
+	if (libusb_le16_to_cpu(dif->func_dfu.bcdDFUVersion) != 0x11a)
+		return dfu_plan_dnload(plan, file, xfer_size);
+
+	memset(plan, 0, sizeof(*plan));
+	layout = parse_memory_layout((char *) dif->alt_name);
+	if (!layout) {
+		warnx("Failed to parse memory layout");
+		return EINVAL;
+	}
+	if (dif->quirks & QUIRK_DFUSE_LAYOUT)
+		fixup_dfuse_layout(dif, &layout);
+	ret = dfu_plan_dfuse(plan, layout, dif->altsetting, file, xfer_size,
+			     dfuse_address);
+	free_segment_list(layout);
+	return ret;
+}
+
+int dfu_plan_layout(dfu_plan *plan, const char *layout, int altsetting,
+		    const dfu_file *file, int xfer_size, int64_t dfuse_address)
+{
+	struct memsegment *segments;
+	char *copy;
+	int ret;
+
+	if (layout == NULL)
+		return dfu_plan_dnload(plan, file, xfer_size);
+
+	memset(plan, 0, sizeof(*plan));
+	copy = dfu_malloc(strlen(layout) + 1);
+	strcpy(copy, layout);
+	segments = parse_memory_layout(copy);
+	free(copy);
+	if (!segments) {
+		warnx("Failed to parse memory layout");
+		return EINVAL;
+	}
+	ret = dfu_plan_dfuse(plan, segments, altsetting, file, xfer_size,
+			     dfuse_address);
+	free_segment_list(segments);
+	return ret;
+}
+
+void dfu_plan_free(dfu_plan *plan)
+{
+	free(plan->ops);
+	memset(plan, 0, sizeof(*plan));
+}
+
+const dfu_timing dfu_timing_default = {
+	.request = 0.001,
+	.byte = 0.000002,
+	.dnload = 0.005,
+	.erase_page = 0.005,
+	.erase_kib = 0.008,
+	.command = 0.001,
+	.manifest = 0.05,
+	.polls = 2,
+};
+
+int dfu_timing_parse(dfu_timing *timing, const char *spec)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} fields[] = {
+		{ "request", offsetof(dfu_timing, request) },
+		{ "byte", offsetof(dfu_timing, byte) },
+		{ "dnload", offsetof(dfu_timing, dnload) },
+		{ "erase_page", offsetof(dfu_timing, erase_page) },
+		{ "erase_kib", offsetof(dfu_timing, erase_kib) },
+		{ "command", offsetof(dfu_timing, command) },
+		{ "manifest", offsetof(dfu_timing, manifest) },
+	};
+
+	while (*spec) {
+		size_t len = strcspn(spec, "=");
+		char *end;
+		double value;
+		unsigned int i;
+
+		if (spec[len] != '=')
+			return EINVAL;
+		value = strtod(spec + len + 1, &end);
+		if (end == spec + len + 1 || (*end && *end != ',') || value < 0)
+			return EINVAL;
+		if (len == 5 && !strncmp(spec, "polls", 5)) {
+			timing->polls = (int) value;
+		} else {
+			for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+				if (strlen(fields[i].name) == len &&
+				    !strncmp(spec, fields[i].name, len))
+					break;
+			if (i == sizeof(fields) / sizeof(fields[0]))
+				return EINVAL;
+			*(double *) ((char *) timing + fields[i].offset) = value;
+		}
+		spec = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/*
+ * A DNLOAD or DfuSe command is one request followed by GETSTATUS
+ * polls with the busy time waited out in between, ABORT is what
+ * dfu_abort_to_idle() sends: ABORT and one GETSTATUS.
+ */
+double dfu_plan_op_cost(const dfu_timing *timing, const dfu_plan_op *op,
+			int *getstatus)
+{
+	double busy;
+
+	switch (op->type) {
+	case DFU_PLAN_DNLOAD:
+		busy = timing->dnload + op->size * timing->byte;
+		break;
+	case DFU_PLAN_ERASE:
+		busy = timing->erase_page + timing->erase_kib * op->size / 1024;
+		break;
+	case DFU_PLAN_SET_ADDRESS:
+		busy = timing->command;
+		break;
+	case DFU_PLAN_MANIFEST:
+		busy = timing->manifest;
+		break;
+	case DFU_PLAN_ABORT:
+	default:
+		*getstatus = 1;
+		return 2 * timing->request;
+	}
+	*getstatus = timing->polls;
+	return (1 + timing->polls) * timing->request + busy;
+}
+
+void dfu_plan_estimate_time(const dfu_plan *plan, const dfu_timing *timing,
+			    dfu_plan_estimate *estimate)
+{
+	int i;
+
+	memset(estimate, 0, sizeof(*estimate));
+	for (i = 0; i < plan->count; i++) {
+		const dfu_plan_op *op = &plan->ops[i];
+		int getstatus;
+		double t = dfu_plan_op_cost(timing, op, &getstatus);
+
+		estimate->ops[op->type]++;
+		estimate->seconds[op->type] += t;
+		estimate->getstatus += getstatus;
+		estimate->requests += 1 + getstatus;
+		estimate->total += t;
+	}
+}
+
+void dfu_plan_print(FILE *out, const dfu_plan *plan, const dfu_timing *timing)
+{
+	static const char *names[DFU_PLAN_NUM_TYPES] = {
+		"DNLOAD", "ERASE", "SET_ADDRESS", "MANIFEST", "ABORT"
+	};
+	dfu_plan_estimate estimate;
+	double t = 0;
+	int i;
+
+	for (i = 0; i < plan->count; i++) {
+		const dfu_plan_op *op = &plan->ops[i];
+		int getstatus;
+
+		t += dfu_plan_op_cost(timing, op, &getstatus);
+		fprintf(out, "%6d %-11s ", i, names[op->type]);
+		switch (op->type) {
+		case DFU_PLAN_DNLOAD:
+			fprintf(out, "block %-5u %6d bytes", op->transaction, op->size);
+			break;
+		case DFU_PLAN_ERASE:
+			fprintf(out, "0x%08x %6d bytes", op->address, op->size);
+			break;
+		case DFU_PLAN_SET_ADDRESS:
+			fprintf(out, "0x%08x%13s", op->address, "");
+			break;
+		default:
+			fprintf(out, "%-24s", "");
+			break;
+		}
+		fprintf(out, "  GETSTATUS x%d  %9.3f s\n", getstatus, t);
+	}
+
+	dfu_plan_estimate_time(plan, timing, &estimate);
+	fprintf(out, "%zu bytes in %d DNLOAD, %d ERASE, %d SET_ADDRESS\n",
+		plan->bytes, estimate.ops[DFU_PLAN_DNLOAD],
+		estimate.ops[DFU_PLAN_ERASE], estimate.ops[DFU_PLAN_SET_ADDRESS]);
+	fprintf(out, "%d control requests, %d of them GETSTATUS\n",
+		estimate.requests, estimate.getstatus);
+	fprintf(out, "Estimated %.3f s (erase %.3f s, download %.3f s)\n",
+		estimate.total, estimate.seconds[DFU_PLAN_ERASE],
+		estimate.seconds[DFU_PLAN_DNLOAD]);
+}
@@ -0,0 +1,121 @@
+/*
+ * Download plans: the DFU requests a download is made of, worked out
+ * before talking to the device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_PLAN_H
+#define DFU_PLAN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfu.h"
+#include "dfuse_mem.h"
+
+enum dfu_plan_type {
+	DFU_PLAN_DNLOAD,	/* DNLOAD one block, poll until dfuDNLOAD-IDLE */
+	DFU_PLAN_ERASE,		/* DfuSe erase page command */
+	DFU_PLAN_SET_ADDRESS,	/* DfuSe set address pointer command */
+	DFU_PLAN_MANIFEST,	/* zero length DNLOAD, poll through manifestation */
+	DFU_PLAN_ABORT		/* ABORT back to dfuIDLE */
+};
+#define DFU_PLAN_NUM_TYPES (DFU_PLAN_ABORT + 1)
+
+typedef struct {
+	enum dfu_plan_type type;
+	uint16_t transaction;	/* wValue of DNLOAD and MANIFEST */
+	uint32_t address;	/* ERASE and SET_ADDRESS */
+	const uint8_t *data;	/* DNLOAD, points into the image */
+	int size;		/* DNLOAD payload, ERASE page size */
+} dfu_plan_op;
+
+/*
+ * A plan only points into the image it was made from and is never
+ * changed while it runs, so one plan can drive any number of devices
+ * with the same memory layout and transfer size.
+ */
+typedef struct dfu_plan {
+	dfu_plan_op *ops;
+	int count;
+	int capacity;
+	int dfuse;		/* DfuSe devices wait bwPollTimeout after every request */
+	size_t bytes;		/* payload carried by DNLOAD ops */
+} dfu_plan;
+
+/* Plain DFU: the file as dfuload_do_dnload() sends it */
+int dfu_plan_dnload(dfu_plan *plan, const dfu_file *file, int xfer_size);
+
+/*
+ * DfuSe: a DfuSe file's elements for the given alternate setting, or a
+ * raw binary written at address (-1 for the start of the layout).
+ * Pages are erased as dfuse_do_dnload() erases them.
+ */
+int dfu_plan_dfuse(dfu_plan *plan, struct memsegment *layout, int altsetting,
+		   const dfu_file *file, int xfer_size, int64_t address);
+
+/* Pick the plan type from the interface, parsing its DfuSe layout */
+int dfu_plan_build(dfu_plan *plan, dfu_if *dif, const dfu_file *file,
+		   int xfer_size, int64_t dfuse_address);
+
+/* Like dfu_plan_build() without a device: layout NULL for plain DFU */
+int dfu_plan_layout(dfu_plan *plan, const char *layout, int altsetting,
+		    const dfu_file *file, int xfer_size, int64_t dfuse_address);
+
+void dfu_plan_free(dfu_plan *plan);
+
+/*
+ * What a device takes for each kind of request, in seconds. The busy
+ * times are what the device reports in bwPollTimeout and are waited
+ * out between GETSTATUS requests.
+ */
+typedef struct {
+	double request;		/* one control request round trip */
+	double byte;		/* each DNLOAD payload byte on the bus */
+	double dnload;		/* busy after a DNLOAD block */
+	double erase_page;	/* busy per ERASE, plus erase_kib per KiB */
+	double erase_kib;
+	double command;		/* busy after SET_ADDRESS */
+	double manifest;	/* busy in manifestation */
+	int polls;		/* GETSTATUS requests per DNLOAD or command */
+} dfu_timing;
+
+/* Typical full speed STM32 bootloader */
+extern const dfu_timing dfu_timing_default;
+
+/* Override fields from "request=0.001,erase_kib=0.01,...", EINVAL if bad */
+int dfu_timing_parse(dfu_timing *timing, const char *spec);
+
+typedef struct {
+	int ops[DFU_PLAN_NUM_TYPES];
+	int getstatus;		/* GETSTATUS requests */
+	int requests;		/* all control requests, GETSTATUS included */
+	double seconds[DFU_PLAN_NUM_TYPES];
+	double total;
+} dfu_plan_estimate;
+
+/* Requests and time one op takes under the timing profile */
+double dfu_plan_op_cost(const dfu_timing *timing, const dfu_plan_op *op,
+			int *getstatus);
+
+void dfu_plan_estimate_time(const dfu_plan *plan, const dfu_timing *timing,
+			    dfu_plan_estimate *estimate);
+
+/* One line per op with its GETSTATUS count and finish time */
+void dfu_plan_print(FILE *out, const dfu_plan *plan, const dfu_timing *timing);
+
+#endif /* DFU_PLAN_H */
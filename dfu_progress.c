@@ -0,0 +1,175 @@
+/*
+ * Time left and throughput of a running download
+ *
+ * A percentage of bytes says little about a DfuSe download, where the
+ * erase before the first block can take longer than the writes. The
+ * plan tells what is left, the timing profile what each op should
+ * cost, and measuring the ops already done tells how far off the
+ * profile is for this device. Each phase is rescaled by what it
+ * measured so far, falling back to the download as a whole and then
+ * to the profile while there is little to go by.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "dfu_sched.h"
+#include "dfu_progress.h"
+
+/* Modeled seconds a measurement must cover before it outweighs the
+ * estimate it corrects */
+#define PRIOR_SECONDS 0.5
+
+/* Time constant of the throughput average */
+#define THROUGHPUT_TAU 1.0
+
+static enum dfu_progress_phase op_phase(const dfu_plan_op *op)
+{
+	switch (op->type) {
+	case DFU_PLAN_ERASE:
+		return DFU_PROGRESS_ERASE;
+	case DFU_PLAN_DNLOAD:
+	case DFU_PLAN_SET_ADDRESS:
+		return DFU_PROGRESS_WRITE;
+	default:
+		return DFU_PROGRESS_FINISH;
+	}
+}
+
+void dfu_progress_init(dfu_progress *progress, const dfu_timing *timing)
+{
+	memset(progress, 0, sizeof(*progress));
+	progress->timing = timing ? *timing : dfu_timing_default;
+}
+
+void dfu_progress_begin(dfu_progress *progress, const dfu_plan *plan)
+{
+	dfu_timing timing = progress->timing;
+	double eta = 0;
+	int getstatus;
+	int i;
+
+	dfu_progress_init(progress, &timing);
+	progress->plan = plan;
+	for (i = 0; i < plan->count; i++) {
+		const dfu_plan_op *op = &plan->ops[i];
+
+		progress->model_left[op_phase(op)] +=
+		    dfu_plan_op_cost(&timing, op, &getstatus);
+	}
+	for (i = 0; i < DFU_PROGRESS_NUM_PHASES; i++)
+		eta += progress->model_left[i];
+
+	progress->eta = eta;
+	progress->phase = plan->count ? op_phase(&plan->ops[0]) :
+	    DFU_PROGRESS_FINISH;
+	progress->start = progress->last = dfu_sched_now();
+}
+
+/* Share the time since the last update out over the ops that finished
+ * in it, by what each was modeled to take */
+static void progress_account(dfu_progress *progress, int ops_done,
+			     double now)
+{
+	const dfu_plan *plan = progress->plan;
+	double dt = now - progress->last;
+	double model = 0;
+	double write_time = 0;
+	size_t write_bytes = 0;
+	int getstatus;
+	int i;
+
+	for (i = progress->op; i < ops_done; i++)
+		model += dfu_plan_op_cost(&progress->timing, &plan->ops[i],
+					  &getstatus);
+
+	for (i = progress->op; i < ops_done; i++) {
+		const dfu_plan_op *op = &plan->ops[i];
+		enum dfu_progress_phase phase = op_phase(op);
+		double cost = dfu_plan_op_cost(&progress->timing, op, &getstatus);
+		double share = model > 0 ? dt * cost / model :
+		    dt / (ops_done - progress->op);
+
+		progress->actual[phase] += share;
+		progress->model_done[phase] += cost;
+		progress->model_left[phase] -= cost;
+		if (op->type == DFU_PLAN_DNLOAD) {
+			write_time += share;
+			write_bytes += op->size;
+		}
+	}
+
+	if (write_bytes && write_time > 0) {
+		double rate = write_bytes / write_time;
+
+		if (progress->bytes == 0)
+			progress->throughput = rate;
+		else
+			progress->throughput += (1 - exp(-write_time / THROUGHPUT_TAU)) *
+			    (rate - progress->throughput);
+	}
+	progress->bytes += write_bytes;
+	progress->op = ops_done;
+	progress->last = now;
+}
+
+void dfu_progress_update(dfu_progress *progress, int ops_done)
+{
+	const dfu_plan *plan = progress->plan;
+	double now = dfu_sched_now();
+	double actual = 0, model = 0, overall, eta = 0;
+	int i;
+
+	if (plan == NULL)
+		return;
+	if (ops_done > plan->count)
+		ops_done = plan->count;
+	if (ops_done > progress->op)
+		progress_account(progress, ops_done, now);
+
+	progress->elapsed = now - progress->start;
+	if (ops_done == plan->count) {
+		progress->phase = DFU_PROGRESS_FINISH;
+		progress->eta = 0;
+		progress->percent = 100;
+		return;
+	}
+
+	for (i = 0; i < DFU_PROGRESS_NUM_PHASES; i++) {
+		actual += progress->actual[i];
+		model += progress->model_done[i];
+	}
+	overall = (actual + PRIOR_SECONDS) / (model + PRIOR_SECONDS);
+	for (i = 0; i < DFU_PROGRESS_NUM_PHASES; i++) {
+		double scale = (progress->actual[i] + PRIOR_SECONDS * overall) /
+		    (progress->model_done[i] + PRIOR_SECONDS);
+
+		if (progress->model_left[i] > 0)
+			eta += progress->model_left[i] * scale;
+	}
+	/* the op in flight has been running since the last update */
+	eta -= now - progress->last;
+
+	progress->phase = op_phase(&plan->ops[ops_done]);
+	progress->eta = eta > 0 ? eta : 0;
+	if (progress->elapsed + progress->eta > 0)
+		progress->percent = 100 * progress->elapsed /
+		    (progress->elapsed + progress->eta);
+	/* 100 only once the last op is done */
+	if (progress->percent > 99)
+		progress->percent = 99;
+}
@@ -0,0 +1,68 @@
+/*
+ * Time left and throughput of a running download
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_PROGRESS_H
+#define DFU_PROGRESS_H
+
+#include <stddef.h>
+
+#include "dfu_plan.h"
+
+enum dfu_progress_phase {
+	DFU_PROGRESS_ERASE,	/* ERASE ops */
+	DFU_PROGRESS_WRITE,	/* DNLOAD and SET_ADDRESS ops */
+	DFU_PROGRESS_FINISH,	/* MANIFEST and ABORT */
+	DFU_PROGRESS_NUM_PHASES
+};
+
+/*
+ * The first block of fields is the report and may be read from other
+ * threads while the download runs; the rest is estimator state.
+ */
+typedef struct dfu_progress {
+	int percent;		/* of the estimated total time */
+	enum dfu_progress_phase phase;	/* of the next op */
+	double elapsed;		/* seconds since dfu_progress_begin() */
+	double eta;		/* seconds left */
+	double throughput;	/* payload bytes per second, moving average */
+	size_t bytes;		/* payload sent */
+
+	dfu_timing timing;
+	const dfu_plan *plan;
+	int op;			/* ops done */
+	double start;
+	double last;		/* when the last op finished */
+	double model_done[DFU_PROGRESS_NUM_PHASES];
+	double model_left[DFU_PROGRESS_NUM_PHASES];
+	double actual[DFU_PROGRESS_NUM_PHASES];
+} dfu_progress;
+
+/* Once per tracker; timing NULL for dfu_timing_default */
+void dfu_progress_init(dfu_progress *progress, const dfu_timing *timing);
+
+/* Start tracking a plan, which must stay valid while it is updated */
+void dfu_progress_begin(dfu_progress *progress, const dfu_plan *plan);
+
+/*
+ * Report that the first ops_done ops of the plan have finished. Can be
+ * called again with the same count to age the report while an op is
+ * still running.
+ */
+void dfu_progress_update(dfu_progress *progress, int ops_done);
+
+#endif /* DFU_PROGRESS_H */
@@ -0,0 +1,485 @@
+/*
+ * Job queue for production flashing: submit, prioritise, collect results
+ *
+ * A fixture submits one job per board as boards are plugged in and
+ * collects a result record per board afterwards. A fixed pool of
+ * workers drains the queue through the session API, admitting jobs
+ * under the same per-hub and per-controller limits as dfu_flash_jobs().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_session.h"
+#include "dfu_lock.h"
+#include "dfu_queue.h"
+
+/* How often idle workers look for queued jobs past their deadline */
+#define DEADLINE_POLL_MS 100
+
+typedef struct {
+	dfu_job_spec spec;	/* holds a reference to the image until done */
+	dfu_if *dif;
+	int id;
+	double deadline;	/* absolute, 0 for none */
+	dfu_progress progress;	/* of the flash step */
+	dfu_cancel cancel;
+	dfu_job_result result;
+} queue_job;
+
+struct dfu_queue {
+	queue_job **jobs;	/* by id */
+	int count;
+	int capacity;
+	int *pending;		/* ids of queued jobs */
+	int npending;
+	int running;
+	int stopping;
+	dfu_sched_limits limits;
+	dfu_sched_slots slots;
+	pthread_t *threads;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+static char *queue_strdup(const char *str)
+{
+	char *copy;
+
+	if (str == NULL)
+		return NULL;
+	copy = dfu_malloc(strlen(str) + 1);
+	strcpy(copy, str);
+	return copy;
+}
+
+/* Does a run before b? */
+static int job_before(const queue_job *a, const queue_job *b)
+{
+	if (a->spec.priority != b->spec.priority)
+		return a->spec.priority > b->spec.priority;
+	if (a->deadline != b->deadline) {
+		if (a->deadline == 0 || b->deadline == 0)
+			return b->deadline == 0;
+		return a->deadline < b->deadline;
+	}
+	return a->id < b->id;
+}
+
+static void job_finish(queue_job *job, int result)
+{
+	job->result.result = result;
+	job->result.end = dfu_sched_now();
+	job->result.state = DFU_JOB_DONE;
+	dfu_image_unref(job->spec.image);
+	job->spec.image = NULL;
+}
+
+/*
+ * Called with the lock held. Fails jobs past their deadline and takes
+ * the best admissible one off the pending list, or returns NULL.
+ */
+static queue_job *queue_pick(dfu_queue *queue, int *expired)
+{
+	double now = dfu_sched_now();
+	queue_job *best = NULL;
+	int best_n = -1;
+	int n;
+
+	for (n = 0; n < queue->npending; n++) {
+		queue_job *job = queue->jobs[queue->pending[n]];
+
+		if (job->deadline != 0 && now >= job->deadline) {
+			job_finish(job, ETIMEDOUT);
+			queue->pending[n--] = queue->pending[--queue->npending];
+			(*expired)++;
+			continue;
+		}
+		if (best != NULL && !job_before(job, best))
+			continue;
+		if (dfu_sched_admit(&queue->slots, &queue->limits, job->dif) < 0)
+			continue;
+		best = job;
+		best_n = n;
+	}
+	if (best != NULL)
+		queue->pending[best_n] = queue->pending[--queue->npending];
+	return best;
+}
+
+/* DfuSe downloads do not manifest, the device stays in DFU mode */
+static int dif_is_dfuse(const dfu_if *dif)
+{
+	return libusb_le16_to_cpu(dif->func_dfu.bcdDFUVersion) == 0x11a;
+}
+
+static int job_step(queue_job *job, dfu_session *session, int step)
+{
+	switch (step) {
+	case DFU_STEP_ERASE:
+		return dfu_session_erase(session);
+	case DFU_STEP_FLASH:
+		return dfu_session_download_progress(session,
+						     &job->spec.image->file,
+						     &job->result.progress,
+						     &job->progress);
+	case DFU_STEP_VERIFY:
+		return dfu_session_verify(session, job->spec.image);
+	case DFU_STEP_LEAVE:
+		return dfu_session_leave(session);
+	default:
+		return EINVAL;
+	}
+}
+
+/* The first step of the job, what an early failure is put down to */
+static int job_first_step(const queue_job *job)
+{
+	int step;
+
+	for (step = 0; step < DFU_NUM_STEPS; step++)
+		if (job->spec.ops & (1 << step))
+			return step;
+	return -1;
+}
+
+static int job_run(queue_job *job)
+{
+	dfu_session session;
+	int reopen = 0;
+	int step;
+	int ret = 0;
+
+	if (job->spec.image != NULL)
+		ret = dfu_check_file_id(job->dif, &job->spec.image->file);
+	if (!ret)
+		ret = dfu_lock_device(job->dif);
+	if (ret) {
+		job->result.failed_step = job_first_step(job);
+		return ret;
+	}
+
+	ret = dfu_session_open(&session, job->dif);
+	if (ret)
+		job->result.failed_step = job_first_step(job);
+	else
+		dfu_session_set_cancel(&session, &job->cancel);
+	for (step = 0; step < DFU_NUM_STEPS && !ret; step++) {
+		double t;
+
+		if (!(job->spec.ops & (1 << step)))
+			continue;
+		if (dfu_cancelled(&job->cancel)) {
+			ret = ECANCELED;
+			job->result.failed_step = step;
+			break;
+		}
+		t = dfu_sched_now();
+		if (reopen) {
+			/* manifestation leaves the device in no state for
+			 * more requests, start over from dfuIDLE */
+			reopen = 0;
+			dfu_session_close(&session);
+			ret = dfu_session_open(&session, job->dif);
+			if (!ret)
+				dfu_session_set_cancel(&session, &job->cancel);
+		}
+		if (!ret)
+			ret = job_step(job, &session, step);
+		reopen = step == DFU_STEP_FLASH && !dif_is_dfuse(job->dif);
+		job->result.step_time[step] = dfu_sched_now() - t;
+		if (ret)
+			job->result.failed_step = step;
+	}
+	dfu_session_close(&session);
+	dfu_unlock_device(job->dif);
+	return ret;
+}
+
+static void queue_wait_changed(dfu_queue *queue, int poll)
+{
+	struct timeval now;
+	struct timespec until;
+
+	if (!poll) {
+		pthread_cond_wait(&queue->changed, &queue->lock);
+		return;
+	}
+	gettimeofday(&now, NULL);
+	until.tv_sec = now.tv_sec;
+	until.tv_nsec = now.tv_usec * 1000 + DEADLINE_POLL_MS * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&queue->changed, &queue->lock, &until);
+}
+
+static void *queue_worker(void *arg)
+{
+	dfu_queue *queue = arg;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		queue_job *job;
+		int expired = 0;
+		int ret;
+
+		job = queue_pick(queue, &expired);
+		if (expired)
+			pthread_cond_broadcast(&queue->changed);
+		if (job == NULL) {
+			if (queue->stopping && queue->npending == 0)
+				break;
+			queue_wait_changed(queue, queue->npending > 0);
+			continue;
+		}
+		job->result.state = DFU_JOB_RUNNING;
+		job->result.start = dfu_sched_now();
+		dfu_sched_add(&queue->slots, job->dif);
+		queue->running++;
+		pthread_mutex_unlock(&queue->lock);
+
+		ret = job_run(job);
+		if (verbose)
+			printf("%s: %s after %.3f s\n",
+			       job->result.path ? job->result.path : job->result.serial,
+			       ret ? "failed" : "done",
+			       dfu_sched_now() - job->result.start);
+
+		pthread_mutex_lock(&queue->lock);
+		dfu_sched_drop(&queue->slots, job->dif);
+		queue->running--;
+		job_finish(job, ret);
+		pthread_cond_broadcast(&queue->changed);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+dfu_queue *dfu_queue_create(const dfu_sched_limits *limits)
+{
+	dfu_queue *queue;
+	int nthreads;
+	int i;
+
+	queue = dfu_malloc(sizeof(*queue));
+	memset(queue, 0, sizeof(*queue));
+	if (limits)
+		queue->limits = *limits;
+
+	nthreads = queue->limits.threads > 0 ? queue->limits.threads : dfu_num_devices;
+	if (nthreads < 1)
+		nthreads = 1;
+	queue->slots.running = dfu_malloc(sizeof(*queue->slots.running) * nthreads);
+	queue->threads = dfu_malloc(sizeof(pthread_t) * nthreads);
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->changed, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&queue->threads[i], NULL, queue_worker, queue)) {
+			warnx("Cannot start flash worker");
+			break;
+		}
+	}
+	queue->nthreads = i;
+	if (queue->nthreads == 0) {
+		dfu_queue_destroy(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+int dfu_queue_submit(dfu_queue *queue, const dfu_job_spec *spec, int *id)
+{
+	queue_job *job;
+	int index;
+
+	if ((spec->ops & (DFU_OP_FLASH | DFU_OP_VERIFY)) && spec->image == NULL)
+		return EINVAL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->stopping) {
+		pthread_mutex_unlock(&queue->lock);
+		return EINVAL;
+	}
+	index = dfu_select(&spec->device);
+	if (index < 0) {
+		pthread_mutex_unlock(&queue->lock);
+		return -index;
+	}
+	/* a device that is not manifestation tolerant resets after the
+	 * flash and comes back elsewhere, nothing is left to verify or
+	 * leave on this interface */
+	if ((spec->ops & DFU_OP_FLASH) &&
+	    (spec->ops & (DFU_OP_VERIFY | DFU_OP_LEAVE)) &&
+	    !dif_is_dfuse(dfu_devices[index]) &&
+	    !(dfu_devices[index]->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)) {
+		pthread_mutex_unlock(&queue->lock);
+		return EINVAL;
+	}
+
+	if (queue->count == queue->capacity) {
+		queue->capacity = queue->capacity ? 2 * queue->capacity : 16;
+		queue->jobs = realloc(queue->jobs, sizeof(*queue->jobs) * queue->capacity);
+		queue->pending = realloc(queue->pending, sizeof(*queue->pending) * queue->capacity);
+		if (queue->jobs == NULL || queue->pending == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+	}
+
+	job = dfu_malloc(sizeof(*job));
+	memset(job, 0, sizeof(*job));
+	job->spec = *spec;
+	job->spec.device.serial = NULL;
+	job->spec.device.path = NULL;
+	if (job->spec.image != NULL)
+		dfu_image_ref(job->spec.image);
+	job->dif = dfu_devices[index];
+	job->result.state = DFU_JOB_QUEUED;
+	job->result.failed_step = -1;
+	job->result.serial = queue_strdup(job->dif->serial_name);
+	job->result.path = queue_strdup(job->dif->path);
+	job->result.submitted = dfu_sched_now();
+	dfu_progress_init(&job->progress, NULL);
+	dfu_cancel_init(&job->cancel);
+	if (spec->deadline > 0)
+		job->deadline = job->result.submitted + spec->deadline;
+
+	job->id = queue->count;
+	*id = job->id;
+	queue->jobs[queue->count++] = job;
+	queue->pending[queue->npending++] = *id;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+/* The estimate is written by the worker without the lock, like the
+ * percentage */
+static void job_snapshot(queue_job *job, dfu_job_result *result)
+{
+	*result = job->result;
+	result->eta = job->progress.eta;
+	result->throughput = job->progress.throughput;
+}
+
+int dfu_queue_result(dfu_queue *queue, int id, dfu_job_result *result)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (id < 0 || id >= queue->count) {
+		pthread_mutex_unlock(&queue->lock);
+		return EINVAL;
+	}
+	job_snapshot(queue->jobs[id], result);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+int dfu_queue_cancel(dfu_queue *queue, int id)
+{
+	queue_job *job;
+	int n;
+
+	pthread_mutex_lock(&queue->lock);
+	if (id < 0 || id >= queue->count) {
+		pthread_mutex_unlock(&queue->lock);
+		return EINVAL;
+	}
+	job = queue->jobs[id];
+	switch (job->result.state) {
+	case DFU_JOB_QUEUED:
+		for (n = 0; n < queue->npending; n++) {
+			if (queue->pending[n] == id) {
+				queue->pending[n] = queue->pending[--queue->npending];
+				break;
+			}
+		}
+		job_finish(job, ECANCELED);
+		pthread_cond_broadcast(&queue->changed);
+		break;
+	case DFU_JOB_RUNNING:
+		/* the worker finishes it once the device is back in dfuIDLE */
+		dfu_cancel_request(&job->cancel);
+		break;
+	case DFU_JOB_DONE:
+		break;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+int dfu_queue_wait(dfu_queue *queue, int id, dfu_job_result *result)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (id < 0 || id >= queue->count) {
+		pthread_mutex_unlock(&queue->lock);
+		return EINVAL;
+	}
+	while (queue->jobs[id]->result.state != DFU_JOB_DONE)
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	job_snapshot(queue->jobs[id], result);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+void dfu_queue_drain(dfu_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->npending > 0 || queue->running > 0)
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void dfu_queue_destroy(dfu_queue *queue)
+{
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->stopping = 1;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+
+	for (i = 0; i < queue->nthreads; i++)
+		pthread_join(queue->threads[i], NULL);
+
+	for (i = 0; i < queue->count; i++) {
+		queue_job *job = queue->jobs[i];
+
+		dfu_image_unref(job->spec.image);
+		free((char *) job->result.serial);
+		free((char *) job->result.path);
+		dfu_cancel_destroy(&job->cancel);
+		free(job);
+	}
+	pthread_cond_destroy(&queue->changed);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->pending);
+	free(queue->jobs);
+	free(queue->threads);
+	free(queue->slots.running);
+	free(queue);
+}
@@ -0,0 +1,105 @@
+/*
+ * Job queue for production flashing: submit, prioritise, collect results
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_QUEUE_H
+#define DFU_QUEUE_H
+
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfu_sched.h"
+
+/* Steps of a job, run in this order */
+enum dfu_step {
+	DFU_STEP_ERASE,
+	DFU_STEP_FLASH,
+	DFU_STEP_VERIFY,
+	DFU_STEP_LEAVE,
+	DFU_NUM_STEPS
+};
+
+#define DFU_OP_ERASE	(1 << DFU_STEP_ERASE)
+#define DFU_OP_FLASH	(1 << DFU_STEP_FLASH)
+#define DFU_OP_VERIFY	(1 << DFU_STEP_VERIFY)
+#define DFU_OP_LEAVE	(1 << DFU_STEP_LEAVE)
+
+enum dfu_job_state {
+	DFU_JOB_QUEUED,
+	DFU_JOB_RUNNING,
+	DFU_JOB_DONE
+};
+
+typedef struct {
+	dfu_selector device;	/* resolved when the job is submitted */
+	dfu_image *image;	/* needed for DFU_OP_FLASH and DFU_OP_VERIFY */
+	unsigned int ops;	/* DFU_OP_* */
+	int priority;		/* higher starts first */
+	double deadline;	/* seconds after submission, 0 for none */
+} dfu_job_spec;
+
+/* Times are dfu_sched_now() values, strings live as long as the queue */
+typedef struct {
+	enum dfu_job_state state;
+	int result;		/* 0 or errno value, ETIMEDOUT if never started,
+				 * ECANCELED if cancelled */
+	int failed_step;	/* enum dfu_step, -1 if none failed; the first
+				 * step if the device could not be opened */
+	const char *serial;
+	const char *path;
+	int progress;		/* percent of the flash step */
+	double eta;		/* seconds left in the flash step */
+	double throughput;	/* bytes per second in the flash step */
+	double submitted;
+	double start;
+	double end;
+	double step_time[DFU_NUM_STEPS];	/* seconds spent in each step */
+} dfu_job_result;
+
+typedef struct dfu_queue dfu_queue;
+
+/*
+ * Start a worker pool on the probed device table, which must stay in
+ * place until the queue is destroyed. Without a thread limit there is
+ * one worker per probed interface.
+ */
+dfu_queue *dfu_queue_create(const dfu_sched_limits *limits);
+
+/*
+ * Queue a job and return its id. Among the jobs allowed to start the
+ * highest priority wins, then the earliest deadline, then the oldest.
+ * A job still queued at its deadline fails with ETIMEDOUT. Flashing
+ * and then verifying or leaving takes a DfuSe or a manifestation
+ * tolerant device, else EINVAL.
+ */
+int dfu_queue_submit(dfu_queue *queue, const dfu_job_spec *spec, int *id);
+
+/*
+ * Take a queued job off the queue, or stop a running one between
+ * requests and send its device back to dfuIDLE, freeing its slot for
+ * the next job. Does not wait; dfu_queue_wait() tells when it is done.
+ */
+int dfu_queue_cancel(dfu_queue *queue, int id);
+
+/* Snapshot of a job, whatever its state */
+int dfu_queue_result(dfu_queue *queue, int id, dfu_job_result *result);
+/* Wait for the job to finish and return its record */
+int dfu_queue_wait(dfu_queue *queue, int id, dfu_job_result *result);
+/* Wait until every submitted job has finished */
+void dfu_queue_drain(dfu_queue *queue);
+void dfu_queue_destroy(dfu_queue *queue);
+
+#endif /* DFU_QUEUE_H */
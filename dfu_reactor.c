@@ -0,0 +1,796 @@
+/*
+ * Single-threaded engine driving the downloads of many devices at once
+ *
+ * Every device runs the requests of a dfu_plan as a small state
+ * machine: send the request, read the status, wait bwPollTimeout, go
+ * on. Requests are asynchronous libusb control transfers completed
+ * from libusb_handle_events(), and the waits sit on a timer wheel, so
+ * one thread keeps any number of devices busy without a stack and a
+ * context switch per device.
+ *
+ * Under a transport with a control hook (a replay, faults) requests go
+ * through that instead, done at once and completed on the reactor's
+ * next round, and the wheel runs on the transport's clock, so the same
+ * state machine can be benchmarked and fault tested without a device.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "quirks.h"
+#include "dfu_sched.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+#include "dfu_metrics.h"
+#include "dfu_trace.h"
+#include "dfu_record.h"
+#include "dfu_transport.h"
+#include "dfu_reactor.h"
+
+#define DFU_TIMEOUT 5000
+/* One slot per millisecond; longer waits go round the wheel again */
+#define WHEEL_SLOTS 256
+/* Upper bound for one wait in libusb while transfers are in flight */
+#define IDLE_WAIT_MS 1000
+/* some devices (e.g. TAS1020b) need some time before we can obtain
+ * the status during manifestation */
+#define MANIFEST_WAIT_MS 1000
+
+enum dev_phase {
+	PHASE_REQUEST,		/* request of the current op in flight */
+	PHASE_STATUS,		/* GETSTATUS in flight */
+	PHASE_POLL,		/* waiting before the next GETSTATUS */
+	PHASE_NEXT,		/* waiting before the next op */
+	PHASE_ABORT,		/* cancelled, ABORT in flight */
+	PHASE_RESET,		/* manifested, reset after event handling */
+	PHASE_DONE
+};
+
+typedef struct reactor_dev {
+	dfu_reactor *reactor;
+	dfu_session *session;
+	const dfu_plan *plan;
+	int op;
+	enum dev_phase phase;
+	int *percent;
+	dfu_progress *progress;
+	size_t bytes_done;
+	dfu_reactor_cb done;
+	void *user;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;	/* setup packet followed by data */
+	uint64_t expires;	/* tick, while on the wheel */
+	uint64_t op_start;	/* dfu_stats_clock() of the op's request */
+	uint64_t sent;		/* of the transfer in flight */
+	uint64_t busy_start;	/* end of a DNLOAD block */
+	unsigned int last_poll;	/* ms, of the last status read */
+	int stalls;		/* GETSTATUS stalls during the op */
+	unsigned int reset_delay; /* ms before the next op, once reset */
+	struct reactor_dev *timer_next;
+	struct reactor_dev *completed_next;
+	struct reactor_dev *next;
+} reactor_dev;
+
+struct dfu_reactor {
+	libusb_context *ctx;
+	const dfu_transport *transport;	/* with a control hook, or NULL */
+	reactor_dev *completed;	/* transport transfers, oldest first */
+	reactor_dev **completed_tail;
+	reactor_dev *devices;
+	int active;
+	int result;
+	double t0;
+	uint64_t now;		/* last tick the wheel was advanced to */
+	int timers;		/* devices on the wheel */
+	int resets;		/* devices in PHASE_RESET */
+	reactor_dev *wheel[WHEEL_SLOTS];
+};
+
+static void dev_start_op(reactor_dev *dev);
+static void dev_get_status(reactor_dev *dev);
+
+/* Seconds, on the transport's clock if it has one */
+static double reactor_clock(const dfu_reactor *reactor)
+{
+	const dfu_transport *transport = reactor->transport;
+
+	if (transport && transport->clock)
+		return transport->clock(transport->user) / 1e6;
+	return dfu_sched_now();
+}
+
+static uint64_t reactor_tick(const dfu_reactor *reactor)
+{
+	return (uint64_t) ((reactor_clock(reactor) - reactor->t0) * 1000);
+}
+
+static void timer_add(reactor_dev *dev, unsigned int ms)
+{
+	dfu_reactor *reactor = dev->reactor;
+	reactor_dev **slot;
+
+	/* a timer always lands on a slot the wheel has not passed yet */
+	dev->expires = reactor_tick(reactor) + ms;
+	if (dev->expires <= reactor->now)
+		dev->expires = reactor->now + 1;
+	slot = &reactor->wheel[dev->expires % WHEEL_SLOTS];
+	dev->timer_next = *slot;
+	*slot = dev;
+	reactor->timers++;
+}
+
+static void timer_remove(reactor_dev *dev)
+{
+	reactor_dev **link = &dev->reactor->wheel[dev->expires % WHEEL_SLOTS];
+
+	while (*link && *link != dev)
+		link = &(*link)->timer_next;
+	if (*link) {
+		*link = dev->timer_next;
+		dev->reactor->timers--;
+	}
+}
+
+static int dev_cancelled(reactor_dev *dev);
+static void dev_cancel(reactor_dev *dev);
+
+static void timer_fire(reactor_dev *dev)
+{
+	if (dev_cancelled(dev))
+		dev_cancel(dev);
+	else if (dev->phase == PHASE_POLL)
+		dev_get_status(dev);
+	else if (dev->phase == PHASE_NEXT)
+		dev_start_op(dev);
+}
+
+/* Fire every timer due by tick to */
+static void wheel_advance(dfu_reactor *reactor, uint64_t to)
+{
+	reactor_dev *fired = NULL;
+	uint64_t steps;
+	uint64_t i;
+
+	if (to <= reactor->now)
+		return;
+	steps = to - reactor->now;
+	if (steps > WHEEL_SLOTS)
+		steps = WHEEL_SLOTS;
+	for (i = 1; i <= steps; i++) {
+		reactor_dev **link = &reactor->wheel[(reactor->now + i) % WHEEL_SLOTS];
+
+		while (*link) {
+			reactor_dev *dev = *link;
+
+			if (dev->expires > to) {
+				link = &dev->timer_next;
+				continue;
+			}
+			*link = dev->timer_next;
+			dev->timer_next = fired;
+			fired = dev;
+			reactor->timers--;
+		}
+	}
+	reactor->now = to;
+
+	/* firing may add timers, so the wheel is left alone meanwhile */
+	while (fired) {
+		reactor_dev *dev = fired;
+
+		fired = dev->timer_next;
+		timer_fire(dev);
+	}
+}
+
+/* Milliseconds to the next timer, -1 if there is none */
+static int wheel_next(const dfu_reactor *reactor, uint64_t tick)
+{
+	uint64_t i;
+
+	if (reactor->timers == 0)
+		return -1;
+	for (i = 1; i <= WHEEL_SLOTS; i++) {
+		const reactor_dev *dev;
+		uint64_t at = reactor->now + i;
+
+		for (dev = reactor->wheel[at % WHEEL_SLOTS]; dev; dev = dev->timer_next)
+			if (dev->expires == at)
+				return at > tick ? (int) (at - tick) : 0;
+	}
+	/* nothing due within a turn, look again after one */
+	return WHEEL_SLOTS;
+}
+
+static void dev_finish(reactor_dev *dev, int result)
+{
+	dfu_reactor *reactor = dev->reactor;
+
+	dev->phase = PHASE_DONE;
+	reactor->active--;
+	if (result && !reactor->result)
+		reactor->result = result;
+	if (!result && dev->percent)
+		*dev->percent = 100;
+	if (dev->done)
+		dev->done(dev->session, result, dev->user);
+}
+
+static void transfer_cb(struct libusb_transfer *transfer);
+
+/* The transfer through dfu_control_transfer(), which also records it,
+ * with the status libusb would have given it */
+static void transport_submit(reactor_dev *dev)
+{
+	struct libusb_transfer *transfer = dev->transfer;
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+	dfu_reactor *reactor = dev->reactor;
+	int ret;
+
+	ret = dfu_control_transfer(transfer->dev_handle, setup->bmRequestType,
+				   setup->bRequest,
+				   libusb_le16_to_cpu(setup->wValue),
+				   libusb_le16_to_cpu(setup->wIndex),
+				   libusb_control_transfer_get_data(transfer),
+				   libusb_le16_to_cpu(setup->wLength),
+				   transfer->timeout);
+	transfer->actual_length = ret < 0 ? 0 : ret;
+	switch (ret) {
+	case LIBUSB_ERROR_PIPE:
+		transfer->status = LIBUSB_TRANSFER_STALL;
+		break;
+	case LIBUSB_ERROR_TIMEOUT:
+		transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+		break;
+	default:
+		transfer->status = ret < 0 ? LIBUSB_TRANSFER_ERROR :
+			LIBUSB_TRANSFER_COMPLETED;
+		break;
+	}
+	/* completed from the next round, as libusb would */
+	dev->completed_next = NULL;
+	*reactor->completed_tail = dev;
+	reactor->completed_tail = &dev->completed_next;
+}
+
+static void dev_submit(reactor_dev *dev, uint8_t direction, uint8_t request,
+		       uint16_t value, const void *data, uint16_t length)
+{
+	dfu_if *dif = dev->session->dif;
+	int ret;
+
+	libusb_fill_control_setup(dev->buffer, direction |
+				  LIBUSB_REQUEST_TYPE_CLASS |
+				  LIBUSB_RECIPIENT_INTERFACE,
+				  request, value, dif->intf, length);
+	if (direction == LIBUSB_ENDPOINT_OUT && length)
+		memcpy(dev->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	libusb_fill_control_transfer(dev->transfer, dif->dev_handle, dev->buffer,
+				     transfer_cb, dev, DFU_TIMEOUT);
+	dev->sent = dfu_stats_clock();
+	if (dev->reactor->transport) {
+		transport_submit(dev);
+		return;
+	}
+	ret = libusb_submit_transfer(dev->transfer);
+	if (ret < 0) {
+		warnx("Cannot submit transfer (%s)", libusb_error_name(ret));
+		dev_finish(dev, EIO);
+	}
+}
+
+/* Manifestation runs to its end, as in dfuload_do_dnload() */
+static int dev_cancelled(reactor_dev *dev)
+{
+	if (dev->op < dev->plan->count &&
+	    dev->plan->ops[dev->op].type == DFU_PLAN_MANIFEST)
+		return 0;
+	return dfu_cancelled(dev->session->dif->cancel);
+}
+
+/* Whatever the ABORT gets back, the device is done with ECANCELED */
+static void dev_cancel(reactor_dev *dev)
+{
+	dev->phase = PHASE_ABORT;
+	dev_submit(dev, LIBUSB_ENDPOINT_OUT, DFU_ABORT, 0, NULL, 0);
+}
+
+static void dev_get_status(reactor_dev *dev)
+{
+	dev->phase = PHASE_STATUS;
+	dev_submit(dev, LIBUSB_ENDPOINT_IN, DFU_GETSTATUS, 0, NULL, 6);
+}
+
+static void dfuse_command(reactor_dev *dev, uint8_t command, uint32_t address)
+{
+	uint8_t buf[5];
+
+	buf[0] = command;
+	buf[1] = address & 0xff;
+	buf[2] = (address >> 8) & 0xff;
+	buf[3] = (address >> 16) & 0xff;
+	buf[4] = (address >> 24) & 0xff;
+	dev_submit(dev, LIBUSB_ENDPOINT_OUT, DFU_DNLOAD, 0, buf, sizeof(buf));
+}
+
+static void dev_start_op(reactor_dev *dev)
+{
+	const dfu_plan_op *op;
+
+	if (dev->op == dev->plan->count) {
+		dev_finish(dev, 0);
+		return;
+	}
+	op = &dev->plan->ops[dev->op];
+	dev->phase = PHASE_REQUEST;
+	dev->op_start = dfu_stats_clock();
+	dev->stalls = 0;
+	switch (op->type) {
+	case DFU_PLAN_DNLOAD:
+		dev_submit(dev, LIBUSB_ENDPOINT_OUT, DFU_DNLOAD,
+			   op->transaction, op->data, op->size);
+		break;
+	case DFU_PLAN_ERASE:
+		dfuse_command(dev, 0x41, op->address);	/* Erase command */
+		break;
+	case DFU_PLAN_SET_ADDRESS:
+		dfuse_command(dev, 0x21, op->address);	/* Set Address Pointer command */
+		break;
+	case DFU_PLAN_MANIFEST:
+		/* send one zero sized download request to signalize end */
+		dev_submit(dev, LIBUSB_ENDPOINT_OUT, DFU_DNLOAD,
+			   op->transaction, NULL, 0);
+		break;
+	case DFU_PLAN_ABORT:
+		dev_submit(dev, LIBUSB_ENDPOINT_OUT, DFU_ABORT, 0, NULL, 0);
+		break;
+	}
+}
+
+static void dev_op_done(reactor_dev *dev, unsigned int delay)
+{
+	const dfu_plan_op *op = &dev->plan->ops[dev->op];
+	dfu_if *dif = dev->session->dif;
+
+	if (op->type == DFU_PLAN_ERASE || op->type == DFU_PLAN_SET_ADDRESS)
+		DFU_PROBE6(dfuse_command, dfu_trace_dev(dif),
+			   op->type == DFU_PLAN_ERASE ? 0x41 : 0x21, op->address,
+			   5, dif->state, dfu_stats_clock() - dev->op_start);
+	if (op->type == DFU_PLAN_ERASE)
+		dfu_stats_record(dif, DFU_STAT_ERASE, dev->op_start);
+	else if (op->type == DFU_PLAN_SET_ADDRESS)
+		dfu_stats_record(dif, DFU_STAT_SET_ADDRESS, dev->op_start);
+	if (op->type == DFU_PLAN_DNLOAD) {
+		dfu_stats_record(dif, DFU_STAT_DNLOAD_BUSY, dev->busy_start);
+		dev->bytes_done += op->size;
+		if (dev->percent && dev->plan->bytes)
+			*dev->percent = dev->bytes_done * 100 / dev->plan->bytes;
+	}
+	dev->op++;
+	if (dev->progress)
+		dfu_progress_update(dev->progress, dev->op);
+	if (delay) {
+		dev->phase = PHASE_NEXT;
+		timer_add(dev, delay);
+	} else {
+		dev_start_op(dev);
+	}
+}
+
+static void dev_poll_later(reactor_dev *dev, unsigned int delay)
+{
+	dev->phase = PHASE_POLL;
+	timer_add(dev, delay);
+}
+
+static void dev_status(reactor_dev *dev, const unsigned char *buffer)
+{
+	const dfu_plan_op *op = &dev->plan->ops[dev->op];
+	dfu_if *dif = dev->session->dif;
+	unsigned int poll;
+	int bStatus = buffer[0];
+	int bState = buffer[4];
+
+	if (dif->quirks & QUIRK_POLLTIMEOUT)
+		poll = DEFAULT_POLLTIMEOUT;
+	else
+		poll = buffer[1] | (buffer[2] << 8) | (buffer[3] << 16);
+	dev->last_poll = poll;
+	DFU_PROBE6(getstatus, dfu_trace_dev(dif), 6, bState, bStatus, poll,
+		   dfu_stats_clock() - dev->sent);
+	if (bState != dif->state) {
+		DFU_PROBE3(state, dfu_trace_dev(dif), dif->state, bState);
+		dif->state = bState;
+	}
+
+	if (bStatus != DFU_STATUS_OK || bState == DFU_STATE_dfuERROR) {
+		warnx("%s: state(%u) = %s, status(%u) = %s",
+		      dif->path ? dif->path : dif->serial_name,
+		      bState, dfu_state_to_string(bState),
+		      bStatus, dfu_status_to_string(bStatus));
+		dev_finish(dev, EIO);
+		return;
+	}
+
+	switch (op->type) {
+	case DFU_PLAN_DNLOAD:
+		if (bState == DFU_STATE_dfuDNLOAD_IDLE ||
+		    (dev->plan->dfuse && bState == DFU_STATE_dfuMANIFEST))
+			dev_op_done(dev, dev->plan->dfuse ? poll : 0);
+		else
+			dev_poll_later(dev, poll);	/* device executes flashing */
+		break;
+	case DFU_PLAN_ERASE:
+	case DFU_PLAN_SET_ADDRESS:
+		if (bState == DFU_STATE_dfuDNBUSY)
+			dev_poll_later(dev, poll);
+		else
+			dev_op_done(dev, poll);
+		break;
+	case DFU_PLAN_MANIFEST:
+		if (bState == DFU_STATE_dfuMANIFEST_SYNC ||
+		    bState == DFU_STATE_dfuMANIFEST) {
+			dev_poll_later(dev, poll + MANIFEST_WAIT_MS);
+			break;
+		}
+		if (bState == DFU_STATE_dfuMANIFEST_WAIT_RST) {
+			/* a reset blocks, never from within a callback */
+			dev->phase = PHASE_RESET;
+			dev->reset_delay = poll;
+			dev->reactor->resets++;
+			break;
+		}
+		dev_op_done(dev, poll);
+		break;
+	case DFU_PLAN_ABORT:
+		if (bState != DFU_STATE_dfuIDLE) {
+			warnx("Failed to enter idle state on abort");
+			dev_finish(dev, EIO);
+			break;
+		}
+		dev_op_done(dev, poll);
+		break;
+	}
+}
+
+/* The transfer as libusb_control_transfer() would have returned it */
+static void record_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+	int result;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		result = transfer->actual_length;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		result = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		result = LIBUSB_ERROR_TIMEOUT;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		result = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	default:
+		result = LIBUSB_ERROR_IO;
+		break;
+	}
+	dfu_record_control(transfer->dev_handle, setup->bmRequestType,
+			   setup->bRequest, libusb_le16_to_cpu(setup->wValue),
+			   libusb_le16_to_cpu(setup->wIndex),
+			   libusb_le16_to_cpu(setup->wLength),
+			   libusb_control_transfer_get_data(transfer), result,
+			   ((reactor_dev *) transfer->user_data)->sent,
+			   dfu_stats_clock());
+}
+
+static void transfer_cb(struct libusb_transfer *transfer)
+{
+	reactor_dev *dev = transfer->user_data;
+	dfu_if *dif = dev->session->dif;
+
+	/* dfu_control_transfer() recorded those of a transport */
+	if (dfu_recording() && !dev->reactor->transport)
+		record_transfer(transfer);
+	if (dev->phase == PHASE_ABORT) {
+		DFU_PROBE3(abort, dfu_trace_dev(dif), transfer->status ==
+			   LIBUSB_TRANSFER_COMPLETED ? 0 : LIBUSB_ERROR_IO,
+			   dfu_stats_clock() - dev->sent);
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+			dfu_stats_record(dif, DFU_STAT_ABORT, dev->sent);
+		dev_finish(dev, ECANCELED);
+		return;
+	}
+	/* Workaround for some STM32L4 bootloaders that report a too short
+	 * poll timeout and may stall the pipe when we poll */
+	if (dev->phase == PHASE_STATUS &&
+	    transfer->status == LIBUSB_TRANSFER_STALL &&
+	    dev->last_poll != 0 && dev->stalls < 3) {
+		dev->stalls++;
+		dfu_metrics_retry(DFU_RETRY_STALL);
+		if (verbose)
+			fprintf(stderr, "* Device stalled USB pipe, reusing last poll timeout\n");
+		if (dev_cancelled(dev))
+			dev_cancel(dev);
+		else
+			dev_poll_later(dev, dev->last_poll);
+		return;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		warnx("Control transfer failed (status %d)", transfer->status);
+		dev_finish(dev, EIO);
+		return;
+	}
+	if (dev->phase == PHASE_STATUS) {
+		dfu_stats_record(dif, DFU_STAT_GETSTATUS, dev->sent);
+	} else if (dev->plan->ops[dev->op].type == DFU_PLAN_DNLOAD) {
+		DFU_PROBE5(dnload, dfu_trace_dev(dif),
+			   dev->plan->ops[dev->op].transaction,
+			   dev->plan->ops[dev->op].size, transfer->actual_length,
+			   dfu_stats_clock() - dev->sent);
+		dfu_stats_record(dif, DFU_STAT_DNLOAD, dev->sent);
+		dev->busy_start = dfu_stats_clock();
+	} else if (dev->plan->ops[dev->op].type == DFU_PLAN_ABORT) {
+		DFU_PROBE3(abort, dfu_trace_dev(dif), 0,
+			   dfu_stats_clock() - dev->sent);
+		dfu_stats_record(dif, DFU_STAT_ABORT, dev->sent);
+	}
+	if (dev_cancelled(dev)) {
+		dev_cancel(dev);
+		return;
+	}
+	if (dev->phase == PHASE_REQUEST) {
+		dev_get_status(dev);
+	} else if (dev->phase == PHASE_STATUS) {
+		if (transfer->actual_length < 6) {
+			warnx("Short status reply");
+			dev_finish(dev, EIO);
+			return;
+		}
+		dev_status(dev, libusb_control_transfer_get_data(transfer));
+	}
+}
+
+dfu_reactor *dfu_reactor_create(libusb_context *ctx)
+{
+	dfu_reactor *reactor;
+
+	reactor = dfu_malloc(sizeof(*reactor));
+	memset(reactor, 0, sizeof(*reactor));
+	reactor->ctx = ctx;
+	if (dfu_get_transport() && dfu_get_transport()->control)
+		reactor->transport = dfu_get_transport();
+	reactor->completed_tail = &reactor->completed;
+	reactor->t0 = reactor_clock(reactor);
+	return reactor;
+}
+
+int dfu_reactor_add_progress(dfu_reactor *reactor, dfu_session *session,
+			     const dfu_plan *plan, int *percent,
+			     dfu_progress *progress,
+			     dfu_reactor_cb done, void *user)
+{
+	reactor_dev *dev;
+	int max_size = 6;
+	int i;
+
+	if (session->dif == NULL || session->dif->dev_handle == NULL)
+		return EINVAL;
+	for (i = 0; i < plan->count; i++)
+		if (plan->ops[i].size > max_size)
+			max_size = plan->ops[i].size;
+
+	dev = dfu_malloc(sizeof(*dev));
+	memset(dev, 0, sizeof(*dev));
+	dev->transfer = libusb_alloc_transfer(0);
+	if (dev->transfer == NULL) {
+		free(dev);
+		return ENOMEM;
+	}
+	dev->buffer = dfu_malloc(LIBUSB_CONTROL_SETUP_SIZE + max_size);
+	dev->reactor = reactor;
+	dev->session = session;
+	dev->plan = plan;
+	dev->percent = percent;
+	dev->progress = progress;
+	dev->done = done;
+	dev->user = user;
+	if (percent)
+		*percent = 0;
+	if (progress)
+		dfu_progress_begin(progress, plan);
+
+	dev->next = reactor->devices;
+	reactor->devices = dev;
+	reactor->active++;
+
+	/* start from dfu_reactor_run(), like every other step */
+	dev->phase = PHASE_NEXT;
+	timer_add(dev, 0);
+	return 0;
+}
+
+int dfu_reactor_add(dfu_reactor *reactor, dfu_session *session,
+		    const dfu_plan *plan, int *percent,
+		    dfu_reactor_cb done, void *user)
+{
+	return dfu_reactor_add_progress(reactor, session, plan, percent, NULL,
+					done, user);
+}
+
+const struct libusb_pollfd **dfu_reactor_get_pollfds(dfu_reactor *reactor)
+{
+	if (reactor->transport)
+		return NULL;
+	return libusb_get_pollfds(reactor->ctx);
+}
+
+void dfu_reactor_set_pollfd_notifiers(dfu_reactor *reactor,
+				      void (*added)(int fd, short events,
+						    void *user),
+				      void (*removed)(int fd, void *user),
+				      void *user)
+{
+	if (reactor->transport)
+		return;
+	libusb_set_pollfd_notifiers(reactor->ctx, added, removed, user);
+}
+
+int dfu_reactor_next_timeout(dfu_reactor *reactor, struct timeval *tv)
+{
+	struct timeval usb;
+	int ms = wheel_next(reactor, reactor_tick(reactor));
+
+	if (reactor->completed)
+		ms = 0;
+	/* libusb has deadlines of its own unless its pollfds cover them */
+	if (!reactor->transport &&
+	    libusb_get_next_timeout(reactor->ctx, &usb) == 1) {
+		int usb_ms = usb.tv_sec * 1000 + (usb.tv_usec + 999) / 1000;
+
+		if (ms < 0 || usb_ms < ms)
+			ms = usb_ms;
+	}
+	if (ms < 0)
+		return 0;
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+	return 1;
+}
+
+/* Devices waiting on the wheel need not wait out a poll timeout once
+ * they are cancelled */
+static void reactor_cancel_waiting(dfu_reactor *reactor)
+{
+	reactor_dev *dev;
+
+	for (dev = reactor->devices; dev; dev = dev->next) {
+		if ((dev->phase == PHASE_POLL || dev->phase == PHASE_NEXT) &&
+		    dev_cancelled(dev)) {
+			timer_remove(dev);
+			dev_cancel(dev);
+		}
+	}
+}
+
+/* Reset the devices waiting for it, as dfuload_do_dnload() does */
+static void reactor_reset_waiting(dfu_reactor *reactor)
+{
+	reactor_dev *dev;
+	int ret;
+
+	for (dev = reactor->devices; dev && reactor->resets; dev = dev->next) {
+		if (dev->phase != PHASE_RESET)
+			continue;
+		reactor->resets--;
+		ret = dfu_reset_device(dev->session->dif->dev_handle);
+		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND)
+			warnx("error resetting after download (%s)",
+			      libusb_error_name(ret));
+		/* the image is in, a failed reset is not a failed download */
+		dev_op_done(dev, dev->reset_delay);
+	}
+}
+
+/* What libusb_handle_events_timeout_completed() does for libusb */
+static void transport_events(dfu_reactor *reactor, struct timeval *tv)
+{
+	reactor_dev *dev;
+
+	if (reactor->completed == NULL) {
+		/* the transport's sleep, virtual for a replay */
+		dfu_sleep(tv->tv_sec * 1000 + tv->tv_usec / 1000);
+		return;
+	}
+	/* transfers submitted from the callbacks wait for the next round */
+	dev = reactor->completed;
+	reactor->completed = NULL;
+	reactor->completed_tail = &reactor->completed;
+	while (dev) {
+		reactor_dev *next = dev->completed_next;
+
+		transfer_cb(dev->transfer);
+		dev = next;
+	}
+}
+
+static int reactor_events(dfu_reactor *reactor, struct timeval *tv)
+{
+	int ret;
+
+	if (reactor->transport) {
+		transport_events(reactor, tv);
+	} else {
+		ret = libusb_handle_events_timeout_completed(reactor->ctx, tv,
+							     NULL);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+			warnx("Error handling USB events (%s)",
+			      libusb_error_name(ret));
+	}
+	reactor_reset_waiting(reactor);
+	wheel_advance(reactor, reactor_tick(reactor));
+	reactor_cancel_waiting(reactor);
+	return reactor->active;
+}
+
+int dfu_process_events(dfu_reactor *reactor)
+{
+	struct timeval zero = { 0, 0 };
+
+	return reactor_events(reactor, &zero);
+}
+
+int dfu_reactor_run(dfu_reactor *reactor)
+{
+	/* devices added before the first call start here */
+	wheel_advance(reactor, reactor_tick(reactor));
+	while (reactor->active > 0) {
+		struct timeval tv;
+
+		if (!dfu_reactor_next_timeout(reactor, &tv) ||
+		    tv.tv_sec * 1000 + tv.tv_usec / 1000 > IDLE_WAIT_MS) {
+			tv.tv_sec = IDLE_WAIT_MS / 1000;
+			tv.tv_usec = (IDLE_WAIT_MS % 1000) * 1000;
+		}
+		reactor_events(reactor, &tv);
+	}
+	return reactor->result;
+}
+
+void dfu_reactor_destroy(dfu_reactor *reactor)
+{
+	while (reactor->devices) {
+		reactor_dev *dev = reactor->devices;
+
+		reactor->devices = dev->next;
+		libusb_free_transfer(dev->transfer);
+		free(dev->buffer);
+		free(dev);
+	}
+	free(reactor);
+}
@@ -0,0 +1,89 @@
+/*
+ * Single-threaded engine driving the downloads of many devices at once
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_REACTOR_H
+#define DFU_REACTOR_H
+
+#include <sys/time.h>
+
+#include "dfu.h"
+#include "dfu_plan.h"
+#include "dfu_session.h"
+#include "dfu_progress.h"
+
+typedef struct libusb_context libusb_context;
+struct libusb_pollfd;
+typedef struct dfu_reactor dfu_reactor;
+
+/* Called from dfu_reactor_run() or dfu_process_events() once a device
+ * is done, result 0 or errno */
+typedef void (*dfu_reactor_cb)(dfu_session *session, int result, void *user);
+
+dfu_reactor *dfu_reactor_create(libusb_context *ctx);
+
+/*
+ * Queue the plan on an open session. The session, the plan and the
+ * image behind it must stay valid until the callback has run; percent
+ * may be NULL. A device whose session token is cancelled is sent an
+ * ABORT and done with ECANCELED.
+ */
+int dfu_reactor_add(dfu_reactor *reactor, dfu_session *session,
+		    const dfu_plan *plan, int *percent,
+		    dfu_reactor_cb done, void *user);
+
+/* Same, with progress updated as each op finishes; may be NULL */
+int dfu_reactor_add_progress(dfu_reactor *reactor, dfu_session *session,
+			     const dfu_plan *plan, int *percent,
+			     dfu_progress *progress,
+			     dfu_reactor_cb done, void *user);
+
+/*
+ * Run until every added device is done. Returns 0 if all of them
+ * succeeded, else the first failing device's result.
+ */
+int dfu_reactor_run(dfu_reactor *reactor);
+
+/*
+ * For callers with an event loop of their own: watch the pollfds
+ * (NULL on platforms without them, see libusb_get_pollfds()), wake up
+ * no later than the next timeout and call dfu_process_events() when
+ * either fires. Nothing blocks and no thread is needed.
+ */
+const struct libusb_pollfd **dfu_reactor_get_pollfds(dfu_reactor *reactor);
+
+/*
+ * The snapshot above goes stale when libusb opens or closes a file
+ * descriptor; added and removed are called from within libusb as it
+ * does, as with libusb_set_pollfd_notifiers(). The context is shared,
+ * so this replaces any notifiers set on it; NULL ones stop the calls.
+ */
+void dfu_reactor_set_pollfd_notifiers(dfu_reactor *reactor,
+				      void (*added)(int fd, short events,
+						    void *user),
+				      void (*removed)(int fd, void *user),
+				      void *user);
+
+/* Like libusb_get_next_timeout(): 1 and tv set, or 0 if none pending */
+int dfu_reactor_next_timeout(dfu_reactor *reactor, struct timeval *tv);
+
+/* Handle what is ready without waiting; returns the devices still busy */
+int dfu_process_events(dfu_reactor *reactor);
+
+void dfu_reactor_destroy(dfu_reactor *reactor);
+
+#endif /* DFU_REACTOR_H */
@@ -0,0 +1,254 @@
+/*
+ * Flight recorder of the control transfers to DFU devices
+ *
+ * A board that flashes slowly in the field seldom does so on the bench.
+ * With the recorder on, every control transfer lands in a ring of the
+ * most recent trace, timestamped at both ends, and the ring can be
+ * saved whenever something looked off, for offline analysis or replay.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_hash.h"
+#include "dfu_stats.h"
+#include "dfu_record.h"
+
+#define MAX_PAYLOAD 0xffff
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int recording;
+static unsigned char *ring;
+static size_t ring_size;
+static size_t ring_head;	/* oldest record */
+static size_t ring_used;
+static uint32_t ring_records;
+static uint64_t ring_dropped;
+static int ring_flags;
+static uint64_t t0;		/* dfu_stats_clock() at start */
+static uint64_t t0_wall;
+
+static unsigned char *put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	p = put16(p, v);
+	return put16(p, v >> 16);
+}
+
+static unsigned char *put64(unsigned char *p, uint64_t v)
+{
+	p = put32(p, v);
+	return put32(p, v >> 32);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int dfu_record_start(size_t size, int flags)
+{
+	struct timeval now;
+
+	pthread_mutex_lock(&ring_lock);
+	if (ring != NULL) {
+		pthread_mutex_unlock(&ring_lock);
+		return EBUSY;
+	}
+	ring = dfu_malloc(size);
+	ring_size = size;
+	ring_head = 0;
+	ring_used = 0;
+	ring_records = 0;
+	ring_dropped = 0;
+	ring_flags = flags;
+	gettimeofday(&now, NULL);
+	t0_wall = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	t0 = dfu_stats_clock();
+	__atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ring_lock);
+	return 0;
+}
+
+void dfu_record_stop(void)
+{
+	pthread_mutex_lock(&ring_lock);
+	__atomic_store_n(&recording, 0, __ATOMIC_RELEASE);
+	free(ring);
+	ring = NULL;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+int dfu_recording(void)
+{
+	return __atomic_load_n(&recording, __ATOMIC_ACQUIRE);
+}
+
+/* Copy into the ring at offset from the head, wrapping at its end */
+static void ring_write(size_t offset, const unsigned char *data, size_t size)
+{
+	size_t at = (ring_head + offset) % ring_size;
+	size_t first = ring_size - at;
+
+	if (first > size)
+		first = size;
+	memcpy(ring + at, data, first);
+	memcpy(ring, data + first, size - first);
+}
+
+static void ring_read(size_t offset, unsigned char *data, size_t size)
+{
+	size_t at = (ring_head + offset) % ring_size;
+	size_t first = ring_size - at;
+
+	if (first > size)
+		first = size;
+	memcpy(data, ring + at, first);
+	memcpy(data + first, ring, size - first);
+}
+
+void dfu_record_control(libusb_device_handle *device, uint8_t request_type,
+			uint8_t request, uint16_t value, uint16_t index,
+			uint16_t length, const unsigned char *data, int result,
+			uint64_t start, uint64_t end)
+{
+	unsigned char entry[DFU_RECORD_ENTRY_SIZE];
+	libusb_device *dev = device ? libusb_get_device(device) : NULL;
+	size_t payload = result > 0 && data ? result : 0;
+	size_t stored;
+	unsigned char *p;
+
+	if (payload > MAX_PAYLOAD)
+		payload = MAX_PAYLOAD;
+
+	pthread_mutex_lock(&ring_lock);
+	if (ring == NULL) {
+		pthread_mutex_unlock(&ring_lock);
+		return;
+	}
+	stored = payload;
+	if (!(ring_flags & DFU_RECORD_DATA) && payload > DFU_RECORD_SMALL)
+		stored = 0;
+	if (sizeof(entry) + stored > ring_size) {
+		ring_dropped++;
+		pthread_mutex_unlock(&ring_lock);
+		return;
+	}
+	/* let the oldest records go */
+	while (ring_used + sizeof(entry) + stored > ring_size) {
+		unsigned char size[4];
+
+		ring_read(0, size, sizeof(size));
+		ring_head = (ring_head + get32(size)) % ring_size;
+		ring_used -= get32(size);
+		ring_records--;
+		ring_dropped++;
+	}
+
+	p = put32(entry, sizeof(entry) + stored);
+	p = put64(p, start - t0);
+	p = put32(p, end - start);
+	p = put16(p, dev ? libusb_get_bus_number(dev) << 8 |
+		  libusb_get_device_address(dev) : 0);
+	*p++ = request_type;
+	*p++ = request;
+	p = put16(p, value);
+	p = put16(p, index);
+	p = put16(p, length);
+	p = put32(p, result);
+	p = put32(p, payload ? dfu_crc32(0xffffffff, data, payload) : 0);
+	put16(p, stored);
+	ring_write(ring_used, entry, sizeof(entry));
+	if (stored)
+		ring_write(ring_used + sizeof(entry), data, stored);
+	ring_used += sizeof(entry) + stored;
+	ring_records++;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+int dfu_record_save(const char *path)
+{
+	unsigned char header[DFU_RECORD_HEADER_SIZE];
+	unsigned char *copy;
+	char *tmp;
+	size_t used;
+	FILE *f;
+	int ret = 0;
+	int fd;
+
+	pthread_mutex_lock(&ring_lock);
+	if (ring == NULL) {
+		pthread_mutex_unlock(&ring_lock);
+		return EINVAL;
+	}
+	memcpy(header, DFU_RECORD_MAGIC, 8);
+	put64(put32(put16(put16(header + 8, DFU_RECORD_VERSION), ring_flags),
+		    ring_records), ring_dropped);
+	put64(header + 24, t0_wall);
+	used = ring_used;
+	copy = dfu_malloc(used + 1);
+	ring_read(0, copy, used);
+	pthread_mutex_unlock(&ring_lock);
+
+	tmp = dfu_malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	/* the payloads are firmware, keep them to ourselves */
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_NOFOLLOW,
+		  0600);
+	f = fd < 0 ? NULL : fdopen(fd, "wb");
+	if (f == NULL) {
+		ret = errno;
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	if (fwrite(header, sizeof(header), 1, f) != 1 ||
+	    (used && fwrite(copy, used, 1, f) != 1))
+		ret = EIO;
+	if (fclose(f) && !ret)
+		ret = errno;
+	if (ret) {
+		unlink(tmp);
+		goto out;
+	}
+#ifdef _WIN32
+	unlink(path);
+#endif
+	if (rename(tmp, path)) {
+		ret = errno;
+		unlink(tmp);
+	}
+out:
+	free(tmp);
+	free(copy);
+	return ret;
+}
@@ -0,0 +1,75 @@
+/*
+ * Flight recorder of the control transfers to DFU devices
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_RECORD_H
+#define DFU_RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <libusb.h>
+
+/*
+ * Trace file, all fields little endian:
+ *
+ *   header  "DFUTRACE", u16 version, u16 flags, u32 records,
+ *           u64 dropped (oldest records the ring let go),
+ *           u64 wall clock at dfu_record_start() in us since the epoch
+ *   record  u32 size of the record, u64 start in us since
+ *           dfu_record_start(), u32 duration in us, u16 device
+ *           (bus << 8 | address), the 8 byte setup packet, i32 result,
+ *           u32 dfu_crc32() of the payload, u16 payload bytes stored,
+ *           then those bytes
+ *
+ * The payload is what went over the bus, result bytes if it is
+ * positive. Its CRC is always there; the bytes are stored when they
+ * are few (status replies, DfuSe commands) or with DFU_RECORD_DATA.
+ */
+#define DFU_RECORD_MAGIC	"DFUTRACE"
+#define DFU_RECORD_VERSION	1
+#define DFU_RECORD_HEADER_SIZE	32
+#define DFU_RECORD_ENTRY_SIZE	36
+#define DFU_RECORD_SMALL	16	/* payloads stored without DFU_RECORD_DATA */
+
+#define DFU_RECORD_DATA		0x0001	/* store every payload */
+
+/*
+ * Keep the most recent ring_size bytes of trace in memory from now on.
+ * Returns 0, or EBUSY if already recording.
+ */
+int dfu_record_start(size_t ring_size, int flags);
+
+/* Stop and free the ring, without saving it */
+void dfu_record_stop(void);
+
+int dfu_recording(void);
+
+/*
+ * Write what the ring holds to path through a temporary file and a
+ * rename, while recording goes on. The file is created 0600. Returns
+ * 0 or an errno value.
+ */
+int dfu_record_save(const char *path);
+
+/* start and end are dfu_stats_clock() around the transfer; device NULL
+ * for one that is not on a bus, recorded as device 0 */
+void dfu_record_control(libusb_device_handle *device, uint8_t request_type,
+			uint8_t request, uint16_t value, uint16_t index,
+			uint16_t length, const unsigned char *data, int result,
+			uint64_t start, uint64_t end);
+
+#endif /* DFU_RECORD_H */
@@ -0,0 +1,342 @@
+/*
+ * Playing a recorded device back to the library
+ *
+ * A trace from dfu_record.c holds how a real device (an STM32L4 that
+ * stalls during polls, a GD32 with its odd layout, a slow manifest)
+ * answered and how long it took. Played back on a virtual clock it
+ * lets changes to the download loop, the DfuSe planner or the poller
+ * be timed against that device, the same way on every run and with no
+ * hardware attached.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_hash.h"
+#include "dfu_record.h"
+#include "dfu_replay.h"
+
+typedef struct {
+	uint64_t start;
+	uint32_t duration;
+	uint8_t request_type;
+	uint8_t request;
+	uint16_t value;
+	uint16_t length;
+	int result;
+	uint32_t crc;
+	uint16_t stored;
+	const unsigned char *data;
+} replay_record;
+
+/*
+ * A request and the GETSTATUS records that followed it, which come
+ * next in the records array. base is when the request ended; the
+ * first exchange has no request if the trace starts with a GETSTATUS,
+ * and base is then the start of that.
+ */
+typedef struct {
+	const replay_record *request;
+	const replay_record *status;
+	int nstatus;
+	uint64_t base;
+} replay_exchange;
+
+struct dfu_replay {
+	unsigned char *file;
+	replay_record *records;
+	replay_exchange *exchanges;
+	int nexchanges;
+	dfu_transport transport;
+	const dfu_transport *previous;
+	/* playback */
+	int cur;		/* exchange of the last request, -1 before */
+	int status;		/* last status reply within it */
+	uint64_t now;
+	uint64_t request_end;
+	dfu_replay_result result;
+};
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+static int is_status(const replay_record *r)
+{
+	return r->request == DFU_GETSTATUS &&
+	       (r->request_type & LIBUSB_ENDPOINT_IN);
+}
+
+static int parse(dfu_replay *replay, size_t size, int device)
+{
+	const unsigned char *p = replay->file + DFU_RECORD_HEADER_SIZE;
+	const unsigned char *end = replay->file + size;
+	replay_exchange *ex = NULL;
+	uint32_t nrecords;
+	int n = 0;
+
+	if (size < DFU_RECORD_HEADER_SIZE ||
+	    memcmp(replay->file, DFU_RECORD_MAGIC, 8) ||
+	    get16(replay->file + 8) != DFU_RECORD_VERSION)
+		return EINVAL;
+	nrecords = get32(replay->file + 12);
+	replay->records = dfu_malloc((nrecords + 1) * sizeof(replay_record));
+	/* at most one exchange per record */
+	replay->exchanges = dfu_malloc((nrecords + 1) * sizeof(replay_exchange));
+	memset(replay->exchanges, 0, (nrecords + 1) * sizeof(replay_exchange));
+
+	while (p < end) {
+		replay_record *r = &replay->records[n];
+		uint32_t rsize;
+
+		if (end - p < DFU_RECORD_ENTRY_SIZE || n == (int) nrecords)
+			return EINVAL;
+		rsize = get32(p);
+		if (rsize < DFU_RECORD_ENTRY_SIZE || rsize > (size_t) (end - p))
+			return EINVAL;
+		if (device == -1)
+			device = get16(p + 16);
+		if (get16(p + 16) != device) {
+			p += rsize;
+			continue;
+		}
+		r->start = get64(p + 4);
+		r->duration = get32(p + 12);
+		r->request_type = p[18];
+		r->request = p[19];
+		r->value = get16(p + 20);
+		r->length = get16(p + 24);
+		r->result = (int32_t) get32(p + 26);
+		r->crc = get32(p + 30);
+		r->stored = get16(p + 34);
+		r->data = p + DFU_RECORD_ENTRY_SIZE;
+		if ((uint32_t) (DFU_RECORD_ENTRY_SIZE + r->stored) > rsize)
+			return EINVAL;
+		p += rsize;
+		n++;
+
+		if (!is_status(r) || ex == NULL) {
+			ex = &replay->exchanges[replay->nexchanges++];
+			ex->request = is_status(r) ? NULL : r;
+			ex->status = is_status(r) ? r : r + 1;
+			ex->base = is_status(r) ? r->start : r->start + r->duration;
+		}
+		if (is_status(r))
+			ex->nstatus++;
+	}
+	return 0;
+}
+
+dfu_replay *dfu_replay_load(const char *path, int device, int *err)
+{
+	dfu_replay *replay;
+	FILE *f;
+	long size;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		*err = errno;
+		return NULL;
+	}
+	replay = dfu_malloc(sizeof(*replay));
+	memset(replay, 0, sizeof(*replay));
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET)) {
+		*err = errno;
+		goto fail;
+	}
+	replay->file = dfu_malloc(size + 1);
+	if (size && fread(replay->file, size, 1, f) != 1) {
+		*err = EIO;
+		goto fail;
+	}
+	*err = parse(replay, size, device);
+	if (*err)
+		goto fail;
+	fclose(f);
+	return replay;
+fail:
+	fclose(f);
+	dfu_replay_free(replay);
+	return NULL;
+}
+
+void dfu_replay_free(dfu_replay *replay)
+{
+	free(replay->exchanges);
+	free(replay->records);
+	free(replay->file);
+	free(replay);
+}
+
+/* What the device sent back, zeros where the trace has only the CRC */
+static int reply(const replay_record *r, unsigned char *data, uint16_t length)
+{
+	int n;
+
+	if (r->result <= 0 || !(r->request_type & LIBUSB_ENDPOINT_IN))
+		return r->result;
+	n = r->result < length ? r->result : length;
+	memset(data, 0, n);
+	memcpy(data, r->data, r->stored < n ? r->stored : n);
+	return n;
+}
+
+/* When the reply after status i is taken to be there, from base */
+static uint64_t changed(const replay_exchange *ex, int i)
+{
+	uint64_t end = ex->status[i].start + ex->status[i].duration;
+
+	return (end + ex->status[i + 1].start) / 2 - ex->base;
+}
+
+static int replay_status(dfu_replay *replay, unsigned char *data,
+			 uint16_t length)
+{
+	const replay_exchange *ex;
+	uint64_t since;
+	int i;
+
+	replay->result.polls++;
+	if (replay->cur < 0 || replay->exchanges[replay->cur].nstatus == 0) {
+		replay->result.mismatches++;
+		return LIBUSB_ERROR_PIPE;
+	}
+	ex = &replay->exchanges[replay->cur];
+	since = replay->now - replay->request_end;
+	/*
+	 * The device moved on to the next reply somewhere between two polls
+	 * of the trace; take the middle, which also absorbs the sleeps that
+	 * overshot while recording. Never go back to an earlier reply.
+	 */
+	i = replay->status < 0 ? 0 : replay->status;
+	while (i + 1 < ex->nstatus && since >= changed(ex, i))
+		i++;
+	replay->status = i;
+	replay->now += ex->status[i].duration;
+	return reply(&ex->status[i], data, length);
+}
+
+static int replay_control(void *user, libusb_device_handle *device,
+			  uint8_t request_type, uint8_t request, uint16_t value,
+			  uint16_t index, unsigned char *data, uint16_t length,
+			  unsigned int timeout)
+{
+	dfu_replay *replay = user;
+	const replay_record *r = NULL;
+	int i;
+
+	/* one device, and waits are virtual */
+	(void)device;
+	(void)index;
+	(void)timeout;
+
+	if (request == DFU_GETSTATUS && (request_type & LIBUSB_ENDPOINT_IN))
+		return replay_status(replay, data, length);
+
+	replay->result.requests++;
+	for (i = replay->cur + 1; i < replay->nexchanges; i++) {
+		r = replay->exchanges[i].request;
+		if (r && r->request == request &&
+		    (r->request_type & LIBUSB_ENDPOINT_IN) ==
+		    (request_type & LIBUSB_ENDPOINT_IN))
+			break;
+	}
+	if (i == replay->nexchanges) {
+		if (verbose)
+			fprintf(stderr, "replay: request %d not in the trace\n",
+				request);
+		replay->result.mismatches++;
+		return LIBUSB_ERROR_PIPE;
+	}
+	/* skipped over requests, or sent other data */
+	if (i != replay->cur + 1 && replay->cur >= 0)
+		replay->result.mismatches++;
+	if (r->value != value || r->length != length ||
+	    (!(request_type & LIBUSB_ENDPOINT_IN) && r->result > 0 && data &&
+	     r->crc != dfu_crc32(0xffffffff, data, r->result)))
+		replay->result.mismatches++;
+
+	replay->cur = i;
+	replay->status = -1;
+	replay->now += r->duration;
+	replay->request_end = replay->now;
+	return reply(r, data, length);
+}
+
+static int replay_reset(void *user, libusb_device_handle *device)
+{
+	(void)user;
+	(void)device;
+	return 0;
+}
+
+static void replay_sleep(void *user, unsigned int msec)
+{
+	dfu_replay *replay = user;
+
+	replay->now += (uint64_t) msec * 1000;
+	replay->result.waited += (uint64_t) msec * 1000;
+}
+
+static uint64_t replay_clock(void *user)
+{
+	return ((dfu_replay *) user)->now;
+}
+
+void dfu_replay_start(dfu_replay *replay)
+{
+	replay->transport.control = replay_control;
+	replay->transport.reset = replay_reset;
+	replay->transport.sleep = replay_sleep;
+	replay->transport.clock = replay_clock;
+	replay->transport.user = replay;
+	replay->cur = -1;
+	replay->status = -1;
+	replay->now = 0;
+	replay->request_end = 0;
+	memset(&replay->result, 0, sizeof(replay->result));
+	/* a trace that starts with a GETSTATUS answers it from there */
+	if (replay->nexchanges && replay->exchanges[0].request == NULL)
+		replay->cur = 0;
+	replay->previous = dfu_get_transport();
+	dfu_set_transport(&replay->transport);
+}
+
+void dfu_replay_stop(dfu_replay *replay, dfu_replay_result *result)
+{
+	dfu_set_transport(replay->previous);
+	replay->result.elapsed = replay->now;
+	if (result)
+		*result = replay->result;
+}
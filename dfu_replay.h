@@ -0,0 +1,56 @@
+/*
+ * Playing a recorded device back to the library
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_REPLAY_H
+#define DFU_REPLAY_H
+
+#include <stdint.h>
+
+#include "dfu_transport.h"
+
+typedef struct dfu_replay dfu_replay;
+
+typedef struct {
+	uint64_t elapsed;	/* virtual us since dfu_replay_start() */
+	uint64_t waited;	/* of it in host sleeps */
+	unsigned int requests;	/* other than GETSTATUS */
+	unsigned int polls;	/* GETSTATUS */
+	unsigned int mismatches;	/* requests the trace did not have */
+} dfu_replay_result;
+
+/*
+ * Read a dfu_record_save() file and keep the transfers of one device
+ * (bus << 8 | address), or of the first one in it for device -1.
+ * Returns NULL with *err set on failure.
+ */
+dfu_replay *dfu_replay_load(const char *path, int device, int *err);
+void dfu_replay_free(dfu_replay *replay);
+
+/*
+ * Become the transport (see dfu_transport.h), from the start of the
+ * trace and with the virtual clock at 0. Each request is answered the
+ * way the device answered it, and takes as long. A GETSTATUS gets the
+ * reply the device would have given by then, timed from the end of the
+ * request before it, so a poller that polls less often sees the device
+ * done sooner and one that polls more often sees it busy again. Sleeps
+ * only advance the clock, which makes a replay deterministic.
+ */
+void dfu_replay_start(dfu_replay *replay);
+void dfu_replay_stop(dfu_replay *replay, dfu_replay_result *result);
+
+#endif /* DFU_REPLAY_H */
@@ -0,0 +1,289 @@
+/*
+ * Concurrent flashing of several devices, spread over the USB tree
+ *
+ * All DFU traffic is control transfers on EP0, and a hub (or host
+ * controller) can only schedule so many of those per frame. Flashing
+ * many boards behind one hub therefore gains little beyond a couple of
+ * parallel jobs, while boards on another controller could be served at
+ * full speed. The scheduler caps the jobs running per hub and per
+ * controller, prefers the least loaded controller and starts the
+ * largest images first so that the tail of the batch is short.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_session.h"
+#include "dfu_sched.h"
+#include "dfu_lock.h"
+
+typedef struct {
+	dfu_flash_job *jobs;
+	int count;
+	int *order;		/* job indices, largest image first */
+	char *started;
+	int pending;
+	dfu_sched_limits limits;
+	dfu_sched_slots slots;
+	double t0;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} sched_state;
+
+double dfu_sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static off_t job_size(const dfu_flash_job *job)
+{
+	return job->image->payload_size;
+}
+
+/*
+ * Controller load if one more flash on dif fits within the limits,
+ * -1 if it has to wait. A device never runs two jobs at once.
+ */
+int dfu_sched_admit(const dfu_sched_slots *slots,
+		    const dfu_sched_limits *limits, const dfu_if *dif)
+{
+	int hub = 0;
+	int controller = 0;
+	int i;
+
+	if (limits->threads > 0 && slots->count >= limits->threads)
+		return -1;
+	for (i = 0; i < slots->count; i++) {
+		const dfu_if *other = slots->running[i];
+
+		if (other->dev == dif->dev)
+			return -1;
+		if (other->topo.controller == dif->topo.controller)
+			controller++;
+		if (other->topo.hub == dif->topo.hub)
+			hub++;
+	}
+	if (limits->per_hub > 0 && hub >= limits->per_hub)
+		return -1;
+	if (limits->per_controller > 0 && controller >= limits->per_controller)
+		return -1;
+	return controller;
+}
+
+void dfu_sched_add(dfu_sched_slots *slots, const dfu_if *dif)
+{
+	slots->running[slots->count++] = dif;
+}
+
+void dfu_sched_drop(dfu_sched_slots *slots, const dfu_if *dif)
+{
+	int i;
+
+	for (i = 0; i < slots->count; i++) {
+		if (slots->running[i] == dif) {
+			slots->running[i] = slots->running[--slots->count];
+			return;
+		}
+	}
+}
+
+/* Pick the next job to start, or -1 if none is allowed right now */
+static int sched_pick(sched_state *st)
+{
+	int best = -1;
+	int best_load = 0;
+	int n;
+
+	for (n = 0; n < st->count; n++) {
+		int i = st->order[n];
+		int load;
+
+		if (st->started[i])
+			continue;
+		load = dfu_sched_admit(&st->slots, &st->limits, st->jobs[i].dif);
+		if (load < 0)
+			continue;
+		/* order[] is by size, so on a tie the larger image wins */
+		if (best < 0 || load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+static void run_job(dfu_flash_job *job, double t0)
+{
+	dfu_image *image = dfu_image_ref(job->image);
+	dfu_session session;
+	int ret;
+
+	job->start = dfu_sched_now() - t0;
+	ret = dfu_check_file_id(job->dif, &image->file);
+	if (!ret)
+		ret = dfu_lock_device(job->dif);
+	if (!ret) {
+		ret = dfu_session_open(&session, job->dif);
+		if (!ret) {
+			ret = dfu_session_download(&session, &image->file,
+						   &job->progress);
+			dfu_session_close(&session);
+		}
+		dfu_unlock_device(job->dif);
+	}
+	dfu_image_unref(image);
+	job->result = ret;
+	job->end = dfu_sched_now() - t0;
+	job->finished = 1;
+
+	if (verbose)
+		printf("%s: %s after %.3f s\n",
+		       job->dif->path ? job->dif->path : job->dif->serial_name,
+		       ret ? "failed" : "done", job->end - job->start);
+}
+
+static void *sched_worker(void *arg)
+{
+	sched_state *st = arg;
+
+	pthread_mutex_lock(&st->lock);
+	while (st->pending > 0) {
+		dfu_flash_job *job;
+		int i = sched_pick(st);
+
+		if (i < 0) {
+			pthread_cond_wait(&st->changed, &st->lock);
+			continue;
+		}
+		job = &st->jobs[i];
+		st->started[i] = 1;
+		st->pending--;
+		dfu_sched_add(&st->slots, job->dif);
+		pthread_mutex_unlock(&st->lock);
+
+		run_job(job, st->t0);
+
+		pthread_mutex_lock(&st->lock);
+		dfu_sched_drop(&st->slots, job->dif);
+		pthread_cond_broadcast(&st->changed);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+/* Stable, so that equal sizes keep the caller's order */
+static void sort_by_size(const dfu_flash_job *jobs, int *order, int count)
+{
+	int i;
+	int j;
+
+	for (i = 1; i < count; i++) {
+		int v = order[i];
+		off_t size = job_size(&jobs[v]);
+
+		for (j = i; j > 0 && job_size(&jobs[order[j - 1]]) < size; j--)
+			order[j] = order[j - 1];
+		order[j] = v;
+	}
+}
+
+int dfu_flash_jobs(dfu_flash_job *jobs, int count,
+		   const dfu_sched_limits *limits)
+{
+	sched_state st;
+	pthread_t *threads;
+	int nthreads;
+	int ret = 0;
+	int i;
+
+	if (count <= 0)
+		return 0;
+
+	memset(&st, 0, sizeof(st));
+	st.jobs = jobs;
+	st.count = count;
+	st.pending = count;
+	if (limits)
+		st.limits = *limits;
+	st.t0 = dfu_sched_now();
+
+	nthreads = st.limits.threads > 0 && st.limits.threads < count ?
+	    st.limits.threads : count;
+
+	st.order = dfu_malloc(sizeof(int) * count);
+	st.started = dfu_malloc(count);
+	st.slots.running = dfu_malloc(sizeof(*st.slots.running) * nthreads);
+	threads = dfu_malloc(sizeof(pthread_t) * nthreads);
+
+	for (i = 0; i < count; i++) {
+		st.order[i] = i;
+		st.started[i] = 0;
+		jobs[i].progress = 0;
+		jobs[i].finished = 0;
+		jobs[i].result = 0;
+	}
+	sort_by_size(jobs, st.order, count);
+
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.changed, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, sched_worker, &st)) {
+			warnx("Cannot start flash worker");
+			break;
+		}
+	}
+	if (i == 0) {
+		/* no worker at all, do the work here */
+		sched_worker(&st);
+	}
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&st.changed);
+	pthread_mutex_destroy(&st.lock);
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].result && !ret)
+			ret = jobs[i].result;
+	}
+	if (verbose) {
+		double elapsed = dfu_sched_now() - st.t0;
+		long long bytes = 0;
+
+		for (i = 0; i < count; i++)
+			bytes += job_size(&jobs[i]);
+		printf("Flashed %d devices, %lld bytes in %.3f s (%.0f bytes/s)\n",
+		       count, bytes, elapsed, elapsed > 0 ? bytes / elapsed : 0.0);
+	}
+
+	free(threads);
+	free(st.slots.running);
+	free(st.started);
+	free(st.order);
+	return ret;
+}
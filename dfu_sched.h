@@ -0,0 +1,68 @@
+/*
+ * Concurrent flashing of several devices, spread over the USB tree
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_SCHED_H
+#define DFU_SCHED_H
+
+#include "dfu.h"
+#include "dfu_image.h"
+
+typedef struct {
+	/* filled in by the caller */
+	dfu_if *dif;		/* target, from probe_devices() */
+	dfu_image *image;	/* shared between jobs, referenced while running */
+
+	/* filled in by dfu_flash_jobs() */
+	int progress;		/* percent */
+	int finished;
+	int result;		/* 0 or errno value */
+	double start;		/* seconds since dfu_flash_jobs() was called */
+	double end;
+} dfu_flash_job;
+
+/* Zero means unlimited for every field */
+typedef struct {
+	int threads;		/* flashes running at once */
+	int per_hub;		/* flashes running behind the same hub */
+	int per_controller;	/* flashes running on the same host controller */
+} dfu_sched_limits;
+
+/* Jobs currently running, for checking new ones against the limits */
+typedef struct {
+	const dfu_if **running;	/* room for as many as can run at once */
+	int count;
+} dfu_sched_slots;
+
+double dfu_sched_now(void);
+
+int dfu_sched_admit(const dfu_sched_slots *slots,
+		    const dfu_sched_limits *limits, const dfu_if *dif);
+void dfu_sched_add(dfu_sched_slots *slots, const dfu_if *dif);
+void dfu_sched_drop(dfu_sched_slots *slots, const dfu_if *dif);
+
+/*
+ * Flash every job, several at a time. Larger images start first, and
+ * among the jobs allowed to start the one on the least busy host
+ * controller wins, so that no controller idles while another one has
+ * a backlog. Returns 0 if all jobs succeeded, else the first failing
+ * job's result.
+ */
+int dfu_flash_jobs(dfu_flash_job *jobs, int count,
+		   const dfu_sched_limits *limits);
+
+#endif /* DFU_SCHED_H */
@@ -0,0 +1,461 @@
+/*
+ * Per-device DFU session: open, bring to dfuIDLE, transfer, close
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libusb.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_load.h"
+#include "dfuse.h"
+#include "dfu_image.h"
+#include "dfu_writer.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+#include "dfu_metrics.h"
+#include "dfu_transport.h"
+#include "dfu_session.h"
+
+/* Give up bringing a device to dfuIDLE after this many status rounds */
+#define MAX_STATUS_ROUNDS 8
+
+int dfu_check_file_id(const dfu_if *dif, const dfu_file *file)
+{
+	if ((file->idVendor  != 0xffff && file->idVendor  != dif->vendor) ||
+	    (file->idProduct != 0xffff && file->idProduct != dif->product)) {
+		fprintf(stderr, "Error: File ID %04x:%04x does "
+			"not match device (%04x:%04x)\n",
+			file->idVendor, file->idProduct,
+			dif->vendor, dif->product);
+		return EINVAL;
+	}
+	return 0;
+}
+
+static int session_to_idle(dfu_if *dif)
+{
+	dfu_status status;
+	uint64_t start;
+	int rounds = 0;
+	int ret;
+
+status_again:
+	if (++rounds > MAX_STATUS_ROUNDS) {
+		warnx("Device did not reach dfuIDLE");
+		return EIO;
+	}
+	ret = dfu_get_status(dif, &status);
+	if (ret < 0)
+		warnx("error get_status: %s", libusb_error_name(ret));
+
+	dfu_sleep(status.bwPollTimeout);
+
+	switch (status.bState) {
+	case DFU_STATE_appIDLE:
+	case DFU_STATE_appDETACH:
+		warnx("Device still in Runtime Mode!");
+		break;
+	case DFU_STATE_dfuERROR:
+		start = dfu_stats_clock();
+		if (dfu_clear_status(dif->dev_handle, dif->intf) < 0)
+			warnx("error clear_status");
+		dfu_stats_record(dif, DFU_STAT_CLRSTATUS, start);
+		dfu_metrics_retry(DFU_RETRY_IDLE);
+		goto status_again;
+	case DFU_STATE_dfuDNLOAD_IDLE:
+	case DFU_STATE_dfuUPLOAD_IDLE:
+		start = dfu_stats_clock();
+		if (dfu_abort(dif->dev_handle, dif->intf) < 0)
+			warnx("can't send DFU_ABORT");
+		dfu_stats_record(dif, DFU_STAT_ABORT, start);
+		dfu_metrics_retry(DFU_RETRY_IDLE);
+		goto status_again;
+	case DFU_STATE_dfuIDLE:
+	default:
+		break;
+	}
+
+	if (DFU_STATUS_OK != status.bStatus) {
+		/* Clear our status & try again. */
+		start = dfu_stats_clock();
+		if (dfu_clear_status(dif->dev_handle, dif->intf) < 0)
+			warnx("USB communication error");
+		dfu_stats_record(dif, DFU_STAT_CLRSTATUS, start);
+		if (dfu_get_status(dif, &status) < 0)
+			warnx("USB communication error");
+		if (DFU_STATUS_OK != status.bStatus)
+			warnx("Status is not OK: %d", status.bStatus);
+
+		dfu_sleep(status.bwPollTimeout);
+	}
+	return 0;
+}
+
+/* Claim, select the alternate setting and go to dfuIDLE */
+static int session_claim(dfu_session *session, dfu_if *dif)
+{
+	int ret;
+
+	ret = libusb_claim_interface(dif->dev_handle, dif->intf);
+	if (ret < 0) {
+		warnx("Cannot claim interface - %s", libusb_error_name(ret));
+		return EIO;
+	}
+
+	ret = libusb_set_interface_alt_setting(dif->dev_handle, dif->intf, dif->altsetting);
+	if (ret < 0) {
+		warnx("Cannot set alternate interface: %s", libusb_error_name(ret));
+		return EIO;
+	}
+
+	dif->stats = dfu_stats_device(dif);
+	if (session_to_idle(dif))
+		return EIO;
+
+	session->transfer_size = libusb_le16_to_cpu(dif->func_dfu.wTransferSize);
+	if (!session->transfer_size)
+		warnx("Transfer size must be specified");
+	if (session->transfer_size < dif->bMaxPacketSize0)
+		session->transfer_size = dif->bMaxPacketSize0;
+	return 0;
+}
+
+/*
+ * Open and claim the DFU interface, select its alternate setting and
+ * bring the device to dfuIDLE. On failure the device is left closed.
+ */
+int dfu_session_open(dfu_session *session, dfu_if *dif)
+{
+	int ret;
+
+	memset(session, 0, sizeof(*session));
+	session->dif = dif;
+
+	ret = libusb_open(dif->dev, &dif->dev_handle);
+	if (ret || !dif->dev_handle) {
+		warnx("Cannot open device: %s", libusb_error_name(ret));
+		dif->dev_handle = NULL;
+		return EIO;
+	}
+
+	ret = session_claim(session, dif);
+	if (ret) {
+		libusb_close(dif->dev_handle);
+		dif->dev_handle = NULL;
+	}
+	return ret;
+}
+
+/*
+ * Like dfu_session_open() on a handle the caller opened and keeps;
+ * closing the session leaves the handle open.
+ */
+int dfu_session_attach(dfu_session *session, dfu_if *dif)
+{
+	memset(session, 0, sizeof(*session));
+	session->dif = dif;
+	session->borrowed = 1;
+
+	if (dif->dev_handle == NULL)
+		return EINVAL;
+	return session_claim(session, dif);
+}
+
+/* The loops return a negative value on failure, -ECANCELED once the
+ * token stopped them */
+static int session_error(off_t ret, int err)
+{
+	if (ret >= 0)
+		return 0;
+	return ret == -ECANCELED ? ECANCELED : err;
+}
+
+void dfu_session_set_cancel(dfu_session *session, dfu_cancel *cancel)
+{
+	session->dif->cancel = cancel;
+}
+
+void dfu_session_set_stats(dfu_session *session, dfu_stats *stats)
+{
+	session->dif->session_stats = stats;
+}
+
+static int session_is_dfuse(const dfu_session *session)
+{
+	return libusb_le16_to_cpu(session->dif->func_dfu.bcdDFUVersion) == 0x11a;
+}
+
+/*
+ * DfuSe devices get the plan of dfu_plan_build(): a DfuSe file's
+ * elements for the session's alternate setting, anything else written
+ * from the start of the memory layout. They stay in DFU mode until
+ * dfu_session_leave().
+ */
+static int session_download(dfu_session *session, const dfu_file *file,
+			    int *percent, dfu_progress *progress)
+{
+	dfu_plan plan;
+	int ret;
+
+	if (!session_is_dfuse(session) && progress == NULL)
+		return session_error(dfuload_do_dnload(session->dif,
+						       session->transfer_size,
+						       file, percent, NULL), EFAULT);
+
+	ret = dfu_plan_build(&plan, session->dif, file, session->transfer_size, -1);
+	if (ret)
+		return ret;
+	if (progress != NULL)
+		dfu_progress_begin(progress, &plan);
+	if (plan.dfuse)
+		ret = dfuse_do_plan(session->dif, &plan, percent, progress);
+	else
+		ret = dfuload_do_dnload(session->dif, session->transfer_size,
+					file, percent, progress);
+	ret = session_error(ret, EFAULT);
+	if (progress != NULL)
+		progress->plan = NULL;
+	dfu_plan_free(&plan);
+	return ret;
+}
+
+int dfu_session_download(dfu_session *session, const dfu_file *file,
+			 int *percent)
+{
+	return session_download(session, file, percent, NULL);
+}
+
+/*
+ * Like dfu_session_download(), keeping progress up to date against a
+ * plan of the same download.
+ */
+int dfu_session_download_progress(dfu_session *session, const dfu_file *file,
+				  int *percent, dfu_progress *progress)
+{
+	return session_download(session, file, percent, progress);
+}
+
+/*
+ * DfuSe devices upload from the address pointer, see dfuse_do_upload()
+ * for how the start address and length are chosen.
+ */
+static int session_upload(dfu_session *session, dfu_sink *sink,
+			  int expected_size)
+{
+	int ret;
+
+	if (session_is_dfuse(session))
+		ret = dfuse_do_upload(session->dif, session->transfer_size,
+				      sink, NULL);
+	else
+		ret = dfuload_do_upload(session->dif, session->transfer_size,
+					expected_size, sink);
+	return session_error(ret, EIO);
+}
+
+/*
+ * Read the device memory into fd; expected_size 0 reads until the
+ * device sends a short block. If hash is not NULL it is initialized
+ * and fed what was received, finish it with dfu_hash_final().
+ */
+int dfu_session_upload(dfu_session *session, int fd, int expected_size,
+		       dfu_hash *hash)
+{
+	dfu_sink sink;
+	int ret;
+	int err;
+
+	dfu_sink_fd(&sink, fd);
+	sink.hash = hash;
+	if (hash != NULL)
+		dfu_hash_init(hash);
+	sink.writer = dfu_writer_create(fd, session->transfer_size);
+	ret = session_upload(session, &sink, expected_size);
+	err = dfu_sink_close(&sink);
+	if (err) {
+		warnx("Cannot write upload: %s", strerror(err));
+		if (!ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/* Read at most size bytes of device memory into buf, hash as above */
+int dfu_session_upload_buffer(dfu_session *session, void *buf, size_t size,
+			      size_t *received, int *percent, dfu_hash *hash)
+{
+	dfu_sink sink;
+	int ret;
+
+	dfu_sink_buffer(&sink, buf, size);
+	sink.percent = percent;
+	sink.hash = hash;
+	if (hash != NULL)
+		dfu_hash_init(hash);
+	ret = session_upload(session, &sink, size);
+	*received = sink.size;
+	dfu_sink_close(&sink);
+	return ret;
+}
+
+/*
+ * Dump all readable memory of a DfuSe device, see dfuse_do_dump().
+ * Plain DFU devices have no memory layout to walk.
+ */
+int dfu_session_dump(dfu_session *session, int fd,
+		     enum dfuse_dump_format format)
+{
+	int ret;
+
+	if (!session_is_dfuse(session))
+		return EINVAL;
+	ret = dfuse_do_dump(session->dif, session->transfer_size, fd, format);
+	return ret < 0 ? -ret : 0;
+}
+
+/*
+ * Plain DFU devices erase as part of the download, so there is
+ * nothing to do for them; DfuSe devices get a mass erase.
+ */
+int dfu_session_erase(dfu_session *session)
+{
+	if (!session_is_dfuse(session))
+		return 0;
+	return session_error(dfuse_do_mass_erase(session->dif), EIO);
+}
+
+/*
+ * Read back what a DfuSe download of the image wrote, one run of
+ * contiguous DNLOAD ops of its plan at a time
+ */
+static int session_verify_dfuse(dfu_session *session, const dfu_image *image)
+{
+	const dfu_plan_op *first = NULL;
+	unsigned int address = 0;
+	unsigned int start = 0;
+	unsigned int length = 0;
+	uint8_t *readback = NULL;
+	dfu_plan plan;
+	dfu_sink sink;
+	int ret;
+	int i;
+
+	ret = dfu_plan_build(&plan, session->dif, &image->file,
+			     session->transfer_size, -1);
+	if (ret)
+		return ret;
+	readback = dfu_malloc(plan.bytes ? plan.bytes : 1);
+	for (i = 0; i <= plan.count && !ret; i++) {
+		const dfu_plan_op *op = i < plan.count ? &plan.ops[i] : NULL;
+
+		if (op != NULL && op->type == DFU_PLAN_SET_ADDRESS) {
+			address = op->address;
+			continue;
+		}
+		if (op != NULL && op->type != DFU_PLAN_DNLOAD)
+			continue;
+		if (op != NULL && first != NULL &&
+		    address == start + length && op->data == first->data + length) {
+			length += op->size;
+			continue;
+		}
+		if (first != NULL) {
+			dfu_sink_buffer(&sink, readback, length);
+			ret = dfuse_do_read(session->dif, session->transfer_size,
+					    start, length, &sink);
+			dfu_sink_close(&sink);
+			if (ret >= 0 && (unsigned int) ret != length)
+				ret = EIO;
+			else if (ret >= 0 && memcmp(readback, first->data, length))
+				ret = EILSEQ;
+			else
+				ret = session_error(ret, EIO);
+		}
+		if (op != NULL) {
+			first = op;
+			start = address;
+			length = op->size;
+		}
+	}
+	free(readback);
+	dfu_plan_free(&plan);
+	return ret;
+}
+
+/* Read back the image payload; EILSEQ if the device content differs */
+int dfu_session_verify(dfu_session *session, const dfu_image *image)
+{
+	uint8_t *readback;
+	size_t received = 0;
+	int ret;
+
+	if (session_is_dfuse(session))
+		return session_verify_dfuse(session, image);
+
+	readback = dfu_malloc(image->payload_size ? image->payload_size : 1);
+	ret = dfu_session_upload_buffer(session, readback, image->payload_size,
+					&received, NULL, NULL);
+	if (!ret && received != image->payload_size)
+		ret = EIO;
+	if (!ret && memcmp(readback, image->payload, received))
+		ret = EILSEQ;
+	free(readback);
+	return ret;
+}
+
+/*
+ * Start the application. The device usually drops off the bus, so
+ * the session should be closed afterwards.
+ */
+int dfu_session_leave(dfu_session *session)
+{
+	int ret;
+
+	if (session_is_dfuse(session)) {
+		if (dfuse_do_leave(session->dif) < 0)
+			return EIO;
+		return 0;
+	}
+	ret = dfu_reset_device(session->dif->dev_handle);
+	if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+		warnx("error resetting device (%s)", libusb_error_name(ret));
+		return EIO;
+	}
+	return 0;
+}
+
+void dfu_session_close(dfu_session *session)
+{
+	if (session->dif == NULL)
+		return;
+	session->dif->cancel = NULL;
+	session->dif->session_stats = NULL;
+	if (session->dif->dev_handle == NULL)
+		return;
+	if (session->borrowed) {
+		libusb_release_interface(session->dif->dev_handle,
+					 session->dif->intf);
+		return;
+	}
+	libusb_close(session->dif->dev_handle);
+	session->dif->dev_handle = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+ * Per-device DFU session: open, bring to dfuIDLE, transfer, close
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_SESSION_H
+#define DFU_SESSION_H
+
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfuse.h"
+#include "dfu_progress.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+
+/*
+ * One session drives one probed interface. Sessions on different
+ * devices share no state and may run in different threads.
+ * All functions return 0 or an errno value, like dfu_flash(), and
+ * ECANCELED when the session's token stopped them.
+ */
+typedef struct dfu_session {
+	dfu_if *dif;
+	int transfer_size;
+	int borrowed;		/* dev_handle belongs to the caller */
+} dfu_session;
+
+int dfu_check_file_id(const dfu_if *dif, const dfu_file *file);
+
+int dfu_session_open(dfu_session *session, dfu_if *dif);
+int dfu_session_attach(dfu_session *session, dfu_if *dif);
+/* Until the session is closed; NULL for none */
+void dfu_session_set_cancel(dfu_session *session, dfu_cancel *cancel);
+/* Time this session's requests into stats as well as the device's
+ * (dfu_stats_device()), until it is closed; NULL for none */
+void dfu_session_set_stats(dfu_session *session, dfu_stats *stats);
+int dfu_session_download(dfu_session *session, const dfu_file *file,
+			 int *percent);
+int dfu_session_download_progress(dfu_session *session, const dfu_file *file,
+				  int *percent, dfu_progress *progress);
+int dfu_session_upload(dfu_session *session, int fd, int expected_size,
+		       dfu_hash *hash);
+int dfu_session_upload_buffer(dfu_session *session, void *buf, size_t size,
+			      size_t *received, int *percent, dfu_hash *hash);
+int dfu_session_dump(dfu_session *session, int fd,
+		     enum dfuse_dump_format format);
+int dfu_session_erase(dfu_session *session);
+int dfu_session_verify(dfu_session *session, const dfu_image *image);
+int dfu_session_leave(dfu_session *session);
+void dfu_session_close(dfu_session *session);
+
+#endif /* DFU_SESSION_H */
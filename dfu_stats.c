@@ -0,0 +1,217 @@
+/*
+ * Latency histograms of DFU requests, per session and per device
+ *
+ * Means hide the hub that adds 20 ms to one GETSTATUS in a hundred.
+ * Every request is timed into a histogram with HDR-style log-linear
+ * buckets, so tails keep their shape at a fixed 2 KiB per request
+ * kind and recording is a few relaxed atomic adds.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "portable.h"
+#include "dfu.h"
+#include "dfu_stats.h"
+
+typedef struct device_stats {
+	char *key;
+	dfu_stats stats;
+	struct device_stats *next;
+} device_stats;
+
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static device_stats *devices;
+
+static const char *kind_names[DFU_STAT_NUM_KINDS] = {
+	"dnload", "upload", "getstatus", "clrstatus", "abort",
+	"set_address", "erase", "dnload_busy"
+};
+
+const char *dfu_stat_kind_name(enum dfu_stat_kind kind)
+{
+	if ((unsigned int) kind >= DFU_STAT_NUM_KINDS)
+		return "unknown";
+	return kind_names[kind];
+}
+
+uint64_t dfu_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucket_index(uint64_t usec)
+{
+	int exp;
+
+	if (usec < DFU_HIST_SUB_COUNT)
+		return usec;
+	exp = 63 - __builtin_clzll(usec);
+	if (exp > DFU_HIST_MAX_EXP)
+		return DFU_HIST_BUCKETS - 1;
+	return (exp - DFU_HIST_SUB_BITS + 1) * DFU_HIST_SUB_COUNT +
+	    ((usec >> (exp - DFU_HIST_SUB_BITS)) & (DFU_HIST_SUB_COUNT - 1));
+}
+
+uint64_t dfu_histogram_bucket_low(int bucket)
+{
+	int group = bucket / DFU_HIST_SUB_COUNT;
+	int sub = bucket % DFU_HIST_SUB_COUNT;
+
+	if (group == 0)
+		return sub;
+	return (uint64_t) (DFU_HIST_SUB_COUNT + sub) << (group - 1);
+}
+
+void dfu_histogram_add(dfu_histogram *hist, uint64_t usec)
+{
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hist->bucket[bucket_index(usec)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	while (usec > max &&
+	       !__atomic_compare_exchange_n(&hist->max, &max, usec, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void dfu_histogram_merge(dfu_histogram *to, const dfu_histogram *from)
+{
+	int i;
+
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (i = 0; i < DFU_HIST_BUCKETS; i++)
+		to->bucket[i] += from->bucket[i];
+}
+
+uint64_t dfu_histogram_percentile(const dfu_histogram *hist, double percentile)
+{
+	uint64_t count = 0;
+	uint64_t target;
+	uint64_t seen = 0;
+	int i;
+
+	/* the total of the buckets, count may be ahead of them */
+	for (i = 0; i < DFU_HIST_BUCKETS; i++)
+		count += hist->bucket[i];
+	if (count == 0)
+		return 0;
+	target = (uint64_t) (count * percentile / 100 + 0.999999);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < DFU_HIST_BUCKETS - 1; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target)
+			break;
+	}
+	if (i == DFU_HIST_BUCKETS - 1 ||
+	    dfu_histogram_bucket_low(i + 1) - 1 > hist->max)
+		return hist->max;
+	return dfu_histogram_bucket_low(i + 1) - 1;
+}
+
+void dfu_stats_reset(dfu_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+void dfu_stats_record(dfu_if *dif, enum dfu_stat_kind kind, uint64_t start)
+{
+	uint64_t usec;
+
+	if (dif->stats == NULL && dif->session_stats == NULL)
+		return;
+	usec = dfu_stats_clock() - start;
+	if (dif->stats)
+		dfu_histogram_add(&dif->stats->hist[kind], usec);
+	if (dif->session_stats)
+		dfu_histogram_add(&dif->session_stats->hist[kind], usec);
+}
+
+dfu_stats *dfu_stats_device(const dfu_if *dif)
+{
+	device_stats *dev;
+	char key[64];
+	const char *name = dif->path ? dif->path : dif->serial_name;
+
+	if (name == NULL || name[0] == '\0') {
+		snprintf(key, sizeof(key), "%04x:%04x@%u-%u", dif->vendor,
+			 dif->product, dif->busnum, dif->devnum);
+		name = key;
+	}
+
+	pthread_mutex_lock(&devices_lock);
+	for (dev = devices; dev != NULL; dev = dev->next)
+		if (!strcmp(dev->key, name))
+			break;
+	if (dev == NULL) {
+		dev = dfu_malloc(sizeof(*dev));
+		memset(dev, 0, sizeof(*dev));
+		dev->key = dfu_malloc(strlen(name) + 1);
+		strcpy(dev->key, name);
+		dev->next = devices;
+		devices = dev;
+	}
+	pthread_mutex_unlock(&devices_lock);
+	return &dev->stats;
+}
+
+void dfu_stats_total(dfu_stats *total)
+{
+	device_stats *dev;
+	int kind;
+
+	dfu_stats_reset(total);
+	pthread_mutex_lock(&devices_lock);
+	for (dev = devices; dev != NULL; dev = dev->next)
+		for (kind = 0; kind < DFU_STAT_NUM_KINDS; kind++)
+			dfu_histogram_merge(&total->hist[kind],
+					    &dev->stats.hist[kind]);
+	pthread_mutex_unlock(&devices_lock);
+}
+
+void dfu_stats_print(FILE *out, const dfu_stats *stats)
+{
+	int kind;
+
+	fprintf(out, "%-12s %8s %9s %9s %9s %9s %9s %9s\n", "request",
+		"count", "mean_us", "p50", "p90", "p99", "p99.9", "max");
+	for (kind = 0; kind < DFU_STAT_NUM_KINDS; kind++) {
+		const dfu_histogram *hist = &stats->hist[kind];
+
+		if (hist->count == 0)
+			continue;
+		fprintf(out, "%-12s %8llu %9.0f %9llu %9llu %9llu %9llu %9llu\n",
+			kind_names[kind], (unsigned long long) hist->count,
+			(double) hist->sum / hist->count,
+			(unsigned long long) dfu_histogram_percentile(hist, 50),
+			(unsigned long long) dfu_histogram_percentile(hist, 90),
+			(unsigned long long) dfu_histogram_percentile(hist, 99),
+			(unsigned long long) dfu_histogram_percentile(hist, 99.9),
+			(unsigned long long) hist->max);
+	}
+}
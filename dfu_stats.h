@@ -0,0 +1,93 @@
+/*
+ * Latency histograms of DFU requests, per session and per device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_STATS_H
+#define DFU_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct dfu_if_t dfu_if;
+
+enum dfu_stat_kind {
+	DFU_STAT_DNLOAD,	/* DNLOAD of a data block, request only */
+	DFU_STAT_UPLOAD,
+	DFU_STAT_GETSTATUS,
+	DFU_STAT_CLRSTATUS,
+	DFU_STAT_ABORT,
+	DFU_STAT_SET_ADDRESS,	/* DfuSe command, request to done */
+	DFU_STAT_ERASE,		/* DfuSe page erase, request to done */
+	DFU_STAT_DNLOAD_BUSY,	/* end of DNLOAD to dfuDNLOAD-IDLE */
+	DFU_STAT_NUM_KINDS
+};
+
+/*
+ * Log-linear buckets of microseconds: exact below 16 us, then 16 per
+ * power of two, so any value is within 6.25% of its bucket. The top
+ * bucket holds everything from about 9 hours up.
+ */
+#define DFU_HIST_SUB_BITS	4
+#define DFU_HIST_SUB_COUNT	(1 << DFU_HIST_SUB_BITS)
+#define DFU_HIST_MAX_EXP	35
+#define DFU_HIST_BUCKETS	((DFU_HIST_MAX_EXP - DFU_HIST_SUB_BITS + 2) * DFU_HIST_SUB_COUNT)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;		/* us */
+	uint64_t max;		/* us */
+	uint32_t bucket[DFU_HIST_BUCKETS];
+} dfu_histogram;
+
+typedef struct dfu_stats {
+	dfu_histogram hist[DFU_STAT_NUM_KINDS];
+} dfu_stats;
+
+/* Monotonic microseconds, the start argument of dfu_stats_record() */
+uint64_t dfu_stats_clock(void);
+
+/*
+ * Add the time since start to the session and device histograms of
+ * dif, whichever are set. Safe against readers in other threads.
+ */
+void dfu_stats_record(dfu_if *dif, enum dfu_stat_kind kind, uint64_t start);
+
+/*
+ * Histograms of a device for as long as the process runs, found again
+ * by USB path (else serial number) after the bus is probed anew.
+ */
+dfu_stats *dfu_stats_device(const dfu_if *dif);
+
+/* Sum of the histograms of every device from dfu_stats_device() */
+void dfu_stats_total(dfu_stats *total);
+
+void dfu_stats_reset(dfu_stats *stats);
+void dfu_histogram_add(dfu_histogram *hist, uint64_t usec);
+void dfu_histogram_merge(dfu_histogram *to, const dfu_histogram *from);
+
+/* Upper edge of the bucket holding the given percentile, 0 if empty */
+uint64_t dfu_histogram_percentile(const dfu_histogram *hist, double percentile);
+
+/* Smallest value of the bucket, for exporting the buckets as ranges */
+uint64_t dfu_histogram_bucket_low(int bucket);
+
+const char *dfu_stat_kind_name(enum dfu_stat_kind kind);
+
+/* One line per kind with count, mean and percentiles in microseconds */
+void dfu_stats_print(FILE *out, const dfu_stats *stats);
+
+#endif /* DFU_STATS_H */
@@ -0,0 +1,109 @@
+/*
+ * Static tracepoints (USDT) at DFU requests and state changes
+ *
+ * Built against <sys/sdt.h> each probe is a nop in the code and a note
+ * in the ELF file, until perf, bpftrace or SystemTap attach to it:
+ *
+ *   bpftrace -e 'usdt:libdfu.so:libdfu:getstatus { @[arg0] = hist(arg5); }'
+ *
+ * Each probe has a semaphore the tracer raises while attached, and
+ * neither the arguments nor the timestamps for usec are taken while it
+ * is down. Without the header the probes and their arguments compile
+ * away.
+ *
+ * Probes of provider libdfu, dev being bus << 8 | address and usec the
+ * latency of the request:
+ *
+ *   dnload(dev, block, length, result, usec)
+ *   upload(dev, block, length, result, usec)
+ *   getstatus(dev, result, state, status, poll_timeout, usec)
+ *   clrstatus(dev, result, usec)
+ *   abort(dev, result, usec)
+ *   dfuse_command(dev, command, address, result, state, usec)
+ *	DfuSe command from request to leaving dfuDNBUSY
+ *   state(dev, from, to)
+ *	GETSTATUS saw a bState other than the one before
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_TRACE_H
+#define DFU_TRACE_H
+
+#include "dfu_stats.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define DFU_PROBE_NAMES(X) \
+	X(dnload) X(upload) X(getstatus) X(clrstatus) X(abort) \
+	X(dfuse_command) X(state)
+
+#define DFU_SEMAPHORE_DECLARE(name) \
+	extern volatile unsigned short libdfu_##name##_semaphore \
+		__attribute__((section(".probes")));
+#define DFU_SEMAPHORE_DEFINE(name) \
+	volatile unsigned short libdfu_##name##_semaphore \
+		__attribute__((section(".probes")));
+
+DFU_PROBE_NAMES(DFU_SEMAPHORE_DECLARE)
+
+/* Once in the library, dfu.c */
+#define DFU_TRACE_SEMAPHORES	DFU_PROBE_NAMES(DFU_SEMAPHORE_DEFINE)
+
+#define DFU_PROBE_ENABLED(name) \
+	__builtin_expect(libdfu_##name##_semaphore, 0)
+
+#define DFU_PROBE3(name, a, b, c) do { \
+	if (DFU_PROBE_ENABLED(name)) \
+		DTRACE_PROBE3(libdfu, name, a, b, c); } while (0)
+#define DFU_PROBE5(name, a, b, c, d, e) do { \
+	if (DFU_PROBE_ENABLED(name)) \
+		DTRACE_PROBE5(libdfu, name, a, b, c, d, e); } while (0)
+#define DFU_PROBE6(name, a, b, c, d, e, f) do { \
+	if (DFU_PROBE_ENABLED(name)) \
+		DTRACE_PROBE6(libdfu, name, a, b, c, d, e, f); } while (0)
+
+#else
+
+#define DFU_TRACE_SEMAPHORES
+#define DFU_PROBE_ENABLED(name)	0
+
+/* Arguments are still type checked, then dropped as dead code */
+#define DFU_PROBE3(name, a, b, c) \
+	do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+#define DFU_PROBE5(name, a, b, c, d, e) \
+	do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); \
+		(void) (e); } } while (0)
+#define DFU_PROBE6(name, a, b, c, d, e, f) \
+	do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); \
+		(void) (e); (void) (f); } } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+/*
+ * Start of a request timed only for its probe, 0 while nothing is
+ * attached to it, and the time since then for the probe's usec
+ */
+#define dfu_trace_clock(name) \
+	(DFU_PROBE_ENABLED(name) ? dfu_stats_clock() : 0)
+#define dfu_trace_since(start) \
+	((start) ? dfu_stats_clock() - (start) : 0)
+
+#define dfu_trace_dev(dif)	((dif)->busnum << 8 | (dif)->devnum)
+
+#endif /* DFU_TRACE_H */
@@ -0,0 +1,55 @@
+/*
+ * What the DFU request code does to the device, and how it waits
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_TRANSPORT_H
+#define DFU_TRANSPORT_H
+
+#include <stdint.h>
+#include <libusb.h>
+
+/*
+ * By default control transfers and resets go to libusb and waits are
+ * real sleeps. A transport set with dfu_set_transport() takes them
+ * over for the blocking code paths (dfu_load.c, dfuse.c, sessions),
+ * e.g. to play back a recorded device on a virtual clock. A reactor
+ * created while a transport with a control hook is set sends its
+ * transfers, waits and resets through it too. A NULL hook keeps the
+ * default.
+ */
+typedef struct dfu_transport {
+	/* as libusb_control_transfer() */
+	int (*control)(void *user, libusb_device_handle *device,
+		       uint8_t request_type, uint8_t request, uint16_t value,
+		       uint16_t index, unsigned char *data, uint16_t length,
+		       unsigned int timeout);
+	/* as libusb_reset_device() */
+	int (*reset)(void *user, libusb_device_handle *device);
+	void (*sleep)(void *user, unsigned int msec);
+	/* microseconds, for layers stacked on this one; NULL for real time */
+	uint64_t (*clock)(void *user);
+	void *user;
+} dfu_transport;
+
+/* Process wide, while no transfer runs; NULL for libusb */
+void dfu_set_transport(const dfu_transport *transport);
+const dfu_transport *dfu_get_transport(void);
+
+int dfu_reset_device(libusb_device_handle *device);
+void dfu_sleep(unsigned int msec);
+
+#endif /* DFU_TRANSPORT_H */
@@ -27,7 +27,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <libusb.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <dirent.h>
+#endif
 
 #include "portable.h"
 #include "dfu.h"
@@ -37,7 +42,11 @@
 #include "dfu_util.h"
 #include "dfuse.h"
 #include "quirks.h"
+#include "dfu_arena.h"
 
+/* Backing store for the dfu_root list and its strings, released as a
+ * whole by disconnect_devices() */
+static dfu_arena probe_arena = DFU_ARENA_INIT;
 
 /*
  * Look for a descriptor in a concatenated descriptor list. Will
@@ -154,7 +163,80 @@ static int get_string_descriptor_ascii(libusb_device_handle *devh,
 	return di;
 }
 
-static void probe_configuration(libusb_device *dev, struct libusb_device_descriptor *desc)
+static void fixup_func_dfu(usb_dfu_func_descriptor *func_dfu)
+{
+	if (func_dfu->bLength == 7) {
+		printf("Deducing device DFU version from functional descriptor "
+		    "length\n");
+		func_dfu->bcdDFUVersion = libusb_cpu_to_le16(0x0100);
+	} else if (func_dfu->bLength < 9) {
+		printf("Error obtaining DFU functional descriptor\n");
+		printf("Please report this as a bug!\n");
+		printf("Warning: Assuming DFU version 1.0\n");
+		func_dfu->bcdDFUVersion = libusb_cpu_to_le16(0x0100);
+		printf("Warning: Transfer size can not be detected\n");
+		func_dfu->wTransferSize = 0;
+	}
+}
+
+static int is_dfu_mode(const struct libusb_device_descriptor *desc,
+    const struct libusb_config_descriptor *cfg,
+    const struct libusb_interface_descriptor *intf,
+    const usb_dfu_func_descriptor *func_dfu)
+{
+	/* e.g. DSO Nano has bInterfaceProtocol 0 instead of 2 */
+	if (func_dfu->bcdDFUVersion == 0x011a && intf->bInterfaceProtocol == 0)
+		return 1;
+
+	/* LPC DFU bootloader has bInterfaceProtocol 1 (Runtime) instead of 2 */
+	if (desc->idVendor == 0x1fc9 && desc->idProduct == 0x000c && intf->bInterfaceProtocol == 1)
+		return 1;
+
+	/*
+	 * Old Jabra devices may have bInterfaceProtocol 0 instead of 2.
+	 * Also runtime PID and DFU pid are the same.
+	 * In DFU mode, the configuration descriptor has only 1 interface.
+	 */
+	if (desc->idVendor == 0x0b0e && intf->bInterfaceProtocol == 0 && cfg->bNumInterfaces == 1)
+		return 1;
+
+	return intf->bInterfaceProtocol == 2;
+}
+
+/* Interface and serial number strings, "UNKNOWN" if unavailable */
+static void read_names(libusb_device_handle *devh,
+    const struct libusb_device_descriptor *desc,
+    const struct libusb_interface_descriptor *intf, uint16_t quirks,
+    char *alt_name, char *serial_name)
+{
+	int ret;
+
+	if (intf->iInterface != 0)
+		ret = get_string_descriptor_ascii(devh,
+		    intf->iInterface, (void *)alt_name, MAX_DESC_STR_LEN);
+	else
+		ret = -1;
+	if (ret < 1)
+		strcpy(alt_name, "UNKNOWN");
+	if (desc->iSerialNumber != 0) {
+		if (quirks & QUIRK_UTF8_SERIAL) {
+			ret = get_utf8_string_descriptor(devh, desc->iSerialNumber,
+			    (void *)serial_name, MAX_DESC_STR_LEN - 1);
+			if (ret >= 0)
+				serial_name[ret] = '\0';
+		} else {
+			ret = get_string_descriptor_ascii(devh, desc->iSerialNumber,
+			    (void *)serial_name, MAX_DESC_STR_LEN);
+		}
+	} else {
+		ret = -1;
+	}
+	if (ret < 1)
+		strcpy(serial_name, "UNKNOWN");
+}
+
+static void probe_configuration(libusb_device *dev, struct libusb_device_descriptor *desc,
+    const dfu_topology *topo, const char *path)
 {
     usb_dfu_func_descriptor func_dfu;
 	libusb_device_handle *devh;
@@ -241,18 +323,7 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 		continue;
 
 found_dfu:
-		if (func_dfu.bLength == 7) {
-			printf("Deducing device DFU version from functional descriptor "
-			    "length\n");
-			func_dfu.bcdDFUVersion = libusb_cpu_to_le16(0x0100);
-		} else if (func_dfu.bLength < 9) {
-			printf("Error obtaining DFU functional descriptor\n");
-			printf("Please report this as a bug!\n");
-			printf("Warning: Assuming DFU version 1.0\n");
-			func_dfu.bcdDFUVersion = libusb_cpu_to_le16(0x0100);
-			printf("Warning: Transfer size can not be detected\n");
-			func_dfu.wTransferSize = 0;
-		}
+		fixup_func_dfu(&func_dfu);
 
 		for (intf_idx = 0; intf_idx < cfg->bNumInterfaces;
 		     intf_idx++) {
@@ -277,22 +348,7 @@ found_dfu:
 				    intf->bInterfaceSubClass != 1)
 					continue;
 
-				dfu_mode = (intf->bInterfaceProtocol == 2);
-				/* e.g. DSO Nano has bInterfaceProtocol 0 instead of 2 */
-				if (func_dfu.bcdDFUVersion == 0x011a && intf->bInterfaceProtocol == 0)
-					dfu_mode = 1;
-
-				/* LPC DFU bootloader has bInterfaceProtocol 1 (Runtime) instead of 2 */
-				if (desc->idVendor == 0x1fc9 && desc->idProduct == 0x000c && intf->bInterfaceProtocol == 1)
-					dfu_mode = 1;
-
-				/*
-				 * Old Jabra devices may have bInterfaceProtocol 0 instead of 2.
-				 * Also runtime PID and DFU pid are the same.
-				 * In DFU mode, the configuration descriptor has only 1 interface.
-				 */
-				if (desc->idVendor == 0x0b0e && intf->bInterfaceProtocol == 0 && cfg->bNumInterfaces == 1)
-					dfu_mode = 1;
+				dfu_mode = is_dfu_mode(desc, cfg, intf, &func_dfu);
 
 				if (dfu_mode &&
 				    match_iface_alt_index > -1 && match_iface_alt_index != intf->bAlternateSetting)
@@ -317,28 +373,7 @@ found_dfu:
 					warnx("Cannot open DFU device %04x:%04x", desc->idVendor, desc->idProduct);
 					break;
 				}
-				if (intf->iInterface != 0)
-					ret = get_string_descriptor_ascii(devh,
-					    intf->iInterface, (void *)alt_name, MAX_DESC_STR_LEN);
-				else
-					ret = -1;
-				if (ret < 1)
-					strcpy(alt_name, "UNKNOWN");
-				if (desc->iSerialNumber != 0) {
-					if (quirks & QUIRK_UTF8_SERIAL) {
-						ret = get_utf8_string_descriptor(devh, desc->iSerialNumber,
-						    (void *)serial_name, MAX_DESC_STR_LEN - 1);
-						if (ret >= 0)
-							serial_name[ret] = '\0';
-					} else {
-						ret = get_string_descriptor_ascii(devh, desc->iSerialNumber,
-						    (void *)serial_name, MAX_DESC_STR_LEN);
-					}
-				} else {
-					ret = -1;
-				}
-				if (ret < 1)
-					strcpy(serial_name, "UNKNOWN");
+				read_names(devh, desc, intf, quirks, alt_name, serial_name);
 				libusb_close(devh);
 
 				if (dfu_mode &&
@@ -353,7 +388,7 @@ found_dfu:
 						continue;
 				}
 
-				pdfu = dfu_malloc(sizeof(*pdfu));
+				pdfu = dfu_arena_alloc(&probe_arena, sizeof(*pdfu));
 
 				memset(pdfu, 0, sizeof(*pdfu));
 
@@ -368,12 +403,11 @@ found_dfu:
 				pdfu->altsetting = intf->bAlternateSetting;
 				pdfu->devnum = libusb_get_device_address(dev);
 				pdfu->busnum = libusb_get_bus_number(dev);
-				pdfu->alt_name = strdup(alt_name);
-				if (pdfu->alt_name == NULL)
-					errx(EX_SOFTWARE, "Out of memory");
-				pdfu->serial_name = strdup(serial_name);
-				if (pdfu->serial_name == NULL)
-					errx(EX_SOFTWARE, "Out of memory");
+				pdfu->topo = *topo;
+				pdfu->alt_name = dfu_arena_strdup(&probe_arena, alt_name);
+				pdfu->serial_name = dfu_arena_strdup(&probe_arena, serial_name);
+				if (path != NULL)
+					pdfu->path = dfu_arena_strdup(&probe_arena, path);
 				if (dfu_mode)
 					pdfu->flags |= DFU_IFF_DFU;
 				if (pdfu->quirks & QUIRK_FORCE_DFU11) {
@@ -391,65 +425,326 @@ found_dfu:
 	}
 }
 
-#define MAX_PATH_LEN 20
-char path_buf[MAX_PATH_LEN];
+/* Format a bus number and port chain as "bus-port.port..." */
+int format_path(uint8_t bus, const uint8_t *ports, int depth,
+    char *buf, size_t len)
+{
+	size_t n;
+	int j;
+
+	if (depth < 1 || len == 0)
+		return -1;
+	n = snprintf(buf, len, "%u-%u", bus, ports[0]);
+	for (j = 1; j < depth && n < len; j++)
+		n += snprintf(buf + n, len - n, ".%u", ports[j]);
+	if (n >= len)
+		return -1;
+	return (int) n;
+}
 
-char *get_path(libusb_device *dev)
+static int get_port_chain(libusb_device *dev, uint8_t *ports, int len)
 {
 #if (defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102) || (defined(LIBUSBX_API_VERSION) && LIBUSBX_API_VERSION >= 0x01000102)
-	uint8_t path[8];
-	int r,j;
-	r = libusb_get_port_numbers(dev, path, sizeof(path));
-	if (r > 0) {
-		sprintf(path_buf,"%d-%d",libusb_get_bus_number(dev),path[0]);
-		for (j = 1; j < r; j++){
-			sprintf(path_buf+strlen(path_buf),".%d",path[j]);
-		};
-	}
-	return path_buf;
+	return libusb_get_port_numbers(dev, ports, len);
 #else
 # warning "libusb too old - building without USB path support!"
 	(void)dev;
-	return NULL;
+	(void)ports;
+	(void)len;
+	return -1;
 #endif
 }
 
+/* Reentrant: writes the port path of dev into buf and returns its
+ * length, or -1 if the path is unknown or does not fit */
+int get_path(libusb_device *dev, char *buf, size_t len)
+{
+	uint8_t ports[DFU_MAX_PORT_DEPTH];
+	int r;
+
+	r = get_port_chain(dev, ports, sizeof(ports));
+	if (r < 1)
+		return -1;
+	return format_path(libusb_get_bus_number(dev), ports, r, buf, len);
+}
+
+/*
+ * libusb has no notion of host controllers, only of buses. An xHCI
+ * controller shows up as two buses (USB 2 and USB 3 root hubs), so on
+ * Linux we look at which device each root hub hangs off in sysfs and
+ * name every controller by the lowest bus number it carries. Elsewhere
+ * each bus counts as a controller of its own. Only the root hubs sysfs
+ * lists are looked at, a handful on most hosts.
+ */
+static void map_host_controllers(uint8_t *map)
+{
+	int bus;
+
+	for (bus = 0; bus < 256; bus++)
+		map[bus] = bus;
+#ifdef __linux__
+	{
+		struct root_hub {
+			int bus;
+			char parent[128];
+		} *roots = NULL;
+		struct dirent *entry;
+		char link[PATH_MAX];
+		char name[300];
+		int num_roots = 0;
+		int capacity = 0;
+		int i;
+		int j;
+		DIR *dir;
+
+		dir = opendir("/sys/bus/usb/devices");
+		if (dir == NULL)
+			return;
+		while ((entry = readdir(dir)) != NULL) {
+			ssize_t r;
+			char *slash;
+			char *end;
+
+			if (strncmp(entry->d_name, "usb", 3))
+				continue;
+			bus = strtol(entry->d_name + 3, &end, 10);
+			if (*end || bus < 1 || bus > 255)
+				continue;
+			snprintf(name, sizeof(name), "/sys/bus/usb/devices/%s",
+				 entry->d_name);
+			r = readlink(name, link, sizeof(link) - 1);
+			if (r <= 0)
+				continue;
+			link[r] = '\0';
+			slash = strrchr(link, '/');
+			if (slash == NULL ||
+			    (size_t) (slash - link) >= sizeof(roots->parent))
+				continue;
+			*slash = '\0';
+			if (num_roots == capacity) {
+				struct root_hub *grown;
+
+				capacity = capacity ? 2 * capacity : 8;
+				grown = realloc(roots, capacity * sizeof(*roots));
+				/* unmapped buses count as controllers of their own */
+				if (grown == NULL)
+					break;
+				roots = grown;
+			}
+			roots[num_roots].bus = bus;
+			strcpy(roots[num_roots].parent, link);
+			num_roots++;
+		}
+		closedir(dir);
+
+		for (i = 0; i < num_roots; i++)
+			for (j = 0; j < num_roots; j++)
+				if (roots[j].bus < map[roots[i].bus] &&
+				    !strcmp(roots[i].parent, roots[j].parent))
+					map[roots[i].bus] = roots[j].bus;
+		free(roots);
+	}
+#endif
+}
+
+static void probe_topology(libusb_device *dev, const uint8_t *controllers,
+    dfu_topology *topo)
+{
+	int r;
+	int j;
+
+	memset(topo, 0, sizeof(*topo));
+	topo->bus = libusb_get_bus_number(dev);
+	topo->controller = controllers[topo->bus];
+
+	r = get_port_chain(dev, topo->ports, sizeof(topo->ports));
+	if (r < 1)
+		return;
+	topo->depth = r;
+
+	/* bus, depth of the parent and its port chain, one byte each */
+	topo->hub = ((uint64_t) topo->bus << 56) | ((uint64_t) (r - 1) << 48);
+	for (j = 0; j < r - 1; j++)
+		topo->hub |= (uint64_t) topo->ports[j] << (8 * j);
+}
+
+/* Port path of the hub a device is plugged into, "usbN" for a root hub */
+int get_hub_path(const dfu_topology *topo, char *buf, size_t len)
+{
+	int n;
+
+	if (topo->depth < 2) {
+		n = snprintf(buf, len, "usb%u", topo->bus);
+		return n < (int) len ? n : -1;
+	}
+	return format_path(topo->bus, topo->ports, topo->depth - 1, buf, len);
+}
+
 void probe_devices(libusb_context *ctx)
 {
 	libusb_device **list;
 	ssize_t num_devs;
 	ssize_t i;
+	uint8_t controllers[256];
+
+	map_host_controllers(controllers);
 
 	num_devs = libusb_get_device_list(ctx, &list);
 	for (i = 0; i < num_devs; ++i) {
 		struct libusb_device_descriptor desc;
 		struct libusb_device *dev = list[i];
+		dfu_topology topo;
+		char path[DFU_MAX_PATH_LEN];
+		int has_path;
+
+		probe_topology(dev, controllers, &topo);
+		has_path = topo.depth > 0 &&
+		    format_path(topo.bus, topo.ports, topo.depth, path, sizeof(path)) > 0;
 
-		if (match_path != NULL && strcmp(get_path(dev),match_path) != 0)
+		if (match_path != NULL && (!has_path || strcmp(path, match_path) != 0))
 			continue;
 		if (libusb_get_device_descriptor(dev, &desc))
 			continue;
-		probe_configuration(dev, &desc);
+		probe_configuration(dev, &desc, &topo, has_path ? path : NULL);
 	}
 	libusb_free_device_list(list, 0);
+	dfu_index_build();
 }
 
+/*
+ * Drop everything found by probe_devices(). The list nodes and their
+ * strings live in the probe arena and go away in one step; only the
+ * libusb references and any handle left open need per-node work.
+ * Must be called before libusb_exit() on the probing context.
+ */
 void disconnect_devices(void)
 {
-    dfu_if *pdfu;
-    dfu_if *prev = NULL;
+	dfu_if *pdfu;
 
 	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
-		free(prev);
+		if (pdfu->dev_handle != NULL)
+			libusb_close(pdfu->dev_handle);
 		libusb_unref_device(pdfu->dev);
-		free(pdfu->alt_name);
-		free(pdfu->serial_name);
-		prev = pdfu;
 	}
-	free(prev);
+	dfu_index_clear();
+	dfu_arena_reset(&probe_arena);
 	dfu_root = NULL;
 }
 
+static char *strdup_or_die(const char *str)
+{
+	char *copy = dfu_malloc(strlen(str) + 1);
+
+	strcpy(copy, str);
+	return copy;
+}
+
+/*
+ * Describe an interface of a device the caller already has open, from
+ * the descriptors libusb has cached, without enumerating the bus. The
+ * handle is borrowed: dev_handle is set, but dfu_if_free() leaves it
+ * open. Returns NULL if the interface is not a DFU interface.
+ */
+dfu_if *dfu_if_from_handle(libusb_device_handle *devh, int interface,
+    int altsetting)
+{
+	libusb_device *dev = libusb_get_device(devh);
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *cfg;
+	const struct libusb_interface_descriptor *intf = NULL;
+	usb_dfu_func_descriptor func_dfu;
+	char alt_name[MAX_DESC_STR_LEN + 1];
+	char serial_name[MAX_DESC_STR_LEN + 1];
+	char path[DFU_MAX_PATH_LEN];
+	uint8_t controllers[256];
+	dfu_if *pdfu;
+	int i;
+	int j;
+
+	if (dev == NULL || libusb_get_device_descriptor(dev, &desc))
+		return NULL;
+	if (libusb_get_active_config_descriptor(dev, &cfg) || cfg == NULL)
+		return NULL;
+
+	for (i = 0; i < cfg->bNumInterfaces && intf == NULL; i++) {
+		const struct libusb_interface *uif = &cfg->interface[i];
+
+		for (j = 0; j < uif->num_altsetting; j++) {
+			if (uif->altsetting[j].bInterfaceNumber == interface &&
+			    uif->altsetting[j].bAlternateSetting == altsetting) {
+				intf = &uif->altsetting[j];
+				break;
+			}
+		}
+	}
+	if (intf == NULL || intf->bInterfaceClass != 0xfe ||
+	    intf->bInterfaceSubClass != 1) {
+		warnx("Interface %d alt %d is not a DFU interface",
+		      interface, altsetting);
+		libusb_free_config_descriptor(cfg);
+		return NULL;
+	}
+
+	memset(&func_dfu, 0, sizeof(func_dfu));
+	if (find_descriptor(intf->extra, intf->extra_length, USB_DT_DFU,
+			    &func_dfu, sizeof(func_dfu)) < 0 &&
+	    find_descriptor(cfg->extra, cfg->extra_length, USB_DT_DFU,
+			    &func_dfu, sizeof(func_dfu)) < 0 &&
+	    libusb_get_descriptor(devh, USB_DT_DFU, 0,
+				  (void *)&func_dfu, sizeof(func_dfu)) < 0) {
+		warnx("Device has DFU interface, "
+		    "but has no DFU functional descriptor");
+		/* fake version 1.0 */
+		func_dfu.bLength = 7;
+	}
+	fixup_func_dfu(&func_dfu);
+
+	pdfu = dfu_malloc(sizeof(*pdfu));
+	memset(pdfu, 0, sizeof(*pdfu));
+	pdfu->func_dfu = func_dfu;
+	pdfu->dev = libusb_ref_device(dev);
+	pdfu->dev_handle = devh;
+	pdfu->quirks = get_quirks(desc.idVendor, desc.idProduct, desc.bcdDevice);
+	pdfu->vendor = desc.idVendor;
+	pdfu->product = desc.idProduct;
+	pdfu->bcdDevice = desc.bcdDevice;
+	pdfu->configuration = cfg->bConfigurationValue;
+	pdfu->intf = intf->bInterfaceNumber;
+	pdfu->altsetting = intf->bAlternateSetting;
+	pdfu->devnum = libusb_get_device_address(dev);
+	pdfu->busnum = libusb_get_bus_number(dev);
+	if (is_dfu_mode(&desc, cfg, intf, &func_dfu))
+		pdfu->flags |= DFU_IFF_DFU;
+	if (pdfu->quirks & QUIRK_FORCE_DFU11)
+		pdfu->func_dfu.bcdDFUVersion = libusb_cpu_to_le16(0x0110);
+	pdfu->bMaxPacketSize0 = desc.bMaxPacketSize0;
+
+	read_names(devh, &desc, intf, pdfu->quirks, alt_name, serial_name);
+	pdfu->alt_name = strdup_or_die(alt_name);
+	pdfu->serial_name = strdup_or_die(serial_name);
+
+	map_host_controllers(controllers);
+	probe_topology(dev, controllers, &pdfu->topo);
+	if (pdfu->topo.depth > 0 &&
+	    format_path(pdfu->topo.bus, pdfu->topo.ports, pdfu->topo.depth,
+			path, sizeof(path)) > 0)
+		pdfu->path = strdup_or_die(path);
+
+	libusb_free_config_descriptor(cfg);
+	return pdfu;
+}
+
+void dfu_if_free(dfu_if *pdfu)
+{
+	if (pdfu == NULL)
+		return;
+	libusb_unref_device(pdfu->dev);
+	free(pdfu->alt_name);
+	free(pdfu->serial_name);
+	free(pdfu->path);
+	free(pdfu);
+}
+
 void print_dfu_if(dfu_if *dfu_if)
 {
 	printf("Found %s: [%04x:%04x] ver=%04x, devnum=%u, cfg=%u, intf=%u, "
@@ -458,7 +753,7 @@ void print_dfu_if(dfu_if *dfu_if)
 	       dfu_if->vendor, dfu_if->product,
 	       dfu_if->bcdDevice, dfu_if->devnum,
            dfu_if->configuration, dfu_if->intf,
-	       get_path(dfu_if->dev),
+	       dfu_if->path ? dfu_if->path : "-",
 	       dfu_if->altsetting, dfu_if->alt_name,
 	       dfu_if->serial_name);
 }
@@ -5,8 +5,12 @@
  * but 254 would even accommodate a UTF-8 encoding + NUL terminator */
 #define MAX_DESC_STR_LEN 254
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct dfu_if_t dfu_if;
 typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
 
 enum mode {
 	MODE_NONE,
@@ -21,5 +25,12 @@ void probe_devices(libusb_context *);
 void disconnect_devices(void);
 void print_dfu_if(dfu_if *);
 void list_dfu_interfaces(void);
+int format_path(uint8_t bus, const uint8_t *ports, int depth,
+		char *buf, size_t len);
+int get_path(libusb_device *dev, char *buf, size_t len);
+int get_hub_path(const dfu_topology *topo, char *buf, size_t len);
+dfu_if *dfu_if_from_handle(libusb_device_handle *devh, int interface,
+    int altsetting);
+void dfu_if_free(dfu_if *dif);
 
 #endif /* DFU_UTIL_H */
@@ -0,0 +1,267 @@
+/*
+ * Background writer for upload data
+ *
+ * Uploads used to write() every block right after its UPLOAD request,
+ * so a slow disk or NFS mount held up the USB side. The upload loop
+ * now receives into blocks of a single-producer single-consumer ring
+ * and a writer thread hands everything queued to one pwritev(). The
+ * ring indices are only ever advanced by one side each; the mutex is
+ * only taken when a side has to sleep.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfu_writer.h"
+
+#ifndef _WIN32
+
+/* Blocks in the ring; 64 blocks of a typical 2 KiB transfer size
+ * give the disk a few hundred milliseconds of slack */
+#define WRITER_BLOCKS 64
+
+#if defined(IOV_MAX) && IOV_MAX < WRITER_BLOCKS
+#define WRITER_MAX_IOV IOV_MAX
+#else
+#define WRITER_MAX_IOV WRITER_BLOCKS
+#endif
+
+struct dfu_writer {
+	int fd;
+	off_t offset;		/* where the next batch goes */
+	int block_size;
+	uint8_t *blocks;
+	int length[WRITER_BLOCKS];
+	unsigned int head;	/* blocks committed, advanced by the producer */
+	unsigned int tail;	/* blocks written, advanced by the writer thread */
+	int closing;
+	int error;
+	int producer_waits;
+	int writer_waits;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	pthread_t thread;
+};
+
+static unsigned int load_index(unsigned int *index)
+{
+	return __atomic_load_n(index, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Sleep until ready() holds. The waits flag is set before ready() is
+ * checked again and the other side tests it after moving its index,
+ * so at least one of the two sees the other.
+ */
+static void ring_wait(dfu_writer *writer, int *waits, pthread_cond_t *cond,
+		      int (*ready)(dfu_writer *))
+{
+	pthread_mutex_lock(&writer->lock);
+	__atomic_store_n(waits, 1, __ATOMIC_SEQ_CST);
+	while (!ready(writer))
+		pthread_cond_wait(cond, &writer->lock);
+	__atomic_store_n(waits, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+static void ring_wake(dfu_writer *writer, int *waits, pthread_cond_t *cond)
+{
+	if (!__atomic_load_n(waits, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&writer->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+static int has_free_block(dfu_writer *writer)
+{
+	return writer->head - load_index(&writer->tail) < WRITER_BLOCKS;
+}
+
+static int has_work(dfu_writer *writer)
+{
+	return load_index(&writer->head) != writer->tail ||
+	    __atomic_load_n(&writer->closing, __ATOMIC_SEQ_CST);
+}
+
+static uint8_t *block(dfu_writer *writer, unsigned int index)
+{
+	return writer->blocks + (size_t) (index % WRITER_BLOCKS) * writer->block_size;
+}
+
+/* pwritev() the whole batch, picking up after short writes */
+static int write_batch(dfu_writer *writer, struct iovec *iov, int count)
+{
+	while (count > 0) {
+		ssize_t n = pwritev(writer->fd, iov, count, writer->offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno;
+		if (n == 0)
+			return EIO;
+		writer->offset += n;
+		while (count > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	dfu_writer *writer = arg;
+	struct iovec iov[WRITER_MAX_IOV];
+
+	for (;;) {
+		unsigned int head = load_index(&writer->head);
+		unsigned int tail = writer->tail;
+		int count = 0;
+
+		if (head == tail) {
+			if (__atomic_load_n(&writer->closing, __ATOMIC_SEQ_CST))
+				break;
+			ring_wait(writer, &writer->writer_waits, &writer->filled,
+				  has_work);
+			continue;
+		}
+
+		while (tail + count != head && count < WRITER_MAX_IOV) {
+			iov[count].iov_base = block(writer, tail + count);
+			iov[count].iov_len = writer->length[(tail + count) % WRITER_BLOCKS];
+			count++;
+		}
+		/* after a failure keep draining so the producer never blocks */
+		if (!writer->error)
+			writer->error = write_batch(writer, iov, count);
+
+		__atomic_store_n(&writer->tail, tail + count, __ATOMIC_SEQ_CST);
+		ring_wake(writer, &writer->producer_waits, &writer->drained);
+	}
+	return NULL;
+}
+
+dfu_writer *dfu_writer_create(int fd, int block_size)
+{
+	dfu_writer *writer;
+	off_t offset;
+
+	if (block_size <= 0)
+		return NULL;
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return NULL;
+
+	writer = dfu_malloc(sizeof(*writer));
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = fd;
+	writer->offset = offset;
+	writer->block_size = block_size;
+	writer->blocks = dfu_malloc((size_t) block_size * WRITER_BLOCKS);
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->filled, NULL);
+	pthread_cond_init(&writer->drained, NULL);
+
+	if (pthread_create(&writer->thread, NULL, writer_thread, writer)) {
+		pthread_cond_destroy(&writer->drained);
+		pthread_cond_destroy(&writer->filled);
+		pthread_mutex_destroy(&writer->lock);
+		free(writer->blocks);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+void *dfu_writer_next(dfu_writer *writer)
+{
+	if (!has_free_block(writer))
+		ring_wait(writer, &writer->producer_waits, &writer->drained,
+			  has_free_block);
+	return block(writer, writer->head);
+}
+
+void dfu_writer_commit(dfu_writer *writer, int size)
+{
+	writer->length[writer->head % WRITER_BLOCKS] = size;
+	__atomic_store_n(&writer->head, writer->head + 1, __ATOMIC_SEQ_CST);
+	ring_wake(writer, &writer->writer_waits, &writer->filled);
+}
+
+int dfu_writer_close(dfu_writer *writer)
+{
+	int ret;
+
+	__atomic_store_n(&writer->closing, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&writer->lock);
+	pthread_cond_signal(&writer->filled);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	ret = writer->error;
+	if (lseek(writer->fd, writer->offset, SEEK_SET) < 0 && !ret)
+		ret = errno;
+
+	pthread_cond_destroy(&writer->drained);
+	pthread_cond_destroy(&writer->filled);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->blocks);
+	free(writer);
+	return ret;
+}
+
+#else /* _WIN32 */
+
+dfu_writer *dfu_writer_create(int fd, int block_size)
+{
+	return NULL;
+}
+
+void *dfu_writer_next(dfu_writer *writer)
+{
+	return NULL;
+}
+
+void dfu_writer_commit(dfu_writer *writer, int size)
+{
+}
+
+int dfu_writer_close(dfu_writer *writer)
+{
+	return 0;
+}
+
+#endif /* _WIN32 */
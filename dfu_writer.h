@@ -0,0 +1,44 @@
+/*
+ * Background writer for upload data
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_WRITER_H
+#define DFU_WRITER_H
+
+typedef struct dfu_writer dfu_writer;
+
+/*
+ * Start a thread writing blocks of up to block_size bytes to fd from
+ * its current offset on. Returns NULL if fd cannot be written at an
+ * offset (pipes, sockets) or on platforms without pwritev(); the
+ * caller then writes synchronously.
+ */
+dfu_writer *dfu_writer_create(int fd, int block_size);
+
+/* A free block to fill, waits while all blocks are queued */
+void *dfu_writer_next(dfu_writer *writer);
+
+/* Queue the block returned by dfu_writer_next() holding size bytes */
+void dfu_writer_commit(dfu_writer *writer, int size);
+
+/*
+ * Write out what is queued, stop the thread and leave the fd offset
+ * after the data. Returns 0 or the errno of the first failed write.
+ */
+int dfu_writer_close(dfu_writer *writer);
+
+#endif /* DFU_WRITER_H */
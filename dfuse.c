@@ -26,12 +26,22 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <libusb.h>
 
 #include "portable.h"
 #include "dfu.h"
 #include "usb_dfu.h"
 #include "dfu_file.h"
+#include "dfu_hash.h"
+#include "dfu_writer.h"
+#include "dfu_cancel.h"
+#include "dfu_stats.h"
+#include "dfu_metrics.h"
+#include "dfu_trace.h"
+#include "dfu_plan.h"
+#include "dfu_progress.h"
 #include "dfuse.h"
 #include "dfuse_mem.h"
 #include "quirks.h"
@@ -55,7 +65,8 @@ static unsigned int quad2uint(unsigned char *p)
 	return (*p + (*(p + 1) << 8) + (*(p + 2) << 16) + (*(p + 3) << 24));
 }
 
-static void dfuse_parse_options(const char *options)
+/* Returns 0, or -EINVAL for options it does not understand */
+static int dfuse_parse_options(const char *options)
 {
 	char *end;
 	const char *endword;
@@ -72,7 +83,8 @@ static void dfuse_parse_options(const char *options)
 			dfuse_address = number;
 			dfuse_address_present = 1;
 		} else {
-			errx(EX_IOERR, "Invalid dfuse address: %s", options);
+			warnx("Invalid dfuse address: %s", options);
+			return -EINVAL;
 		}
 		options = endword;
 	}
@@ -117,19 +129,22 @@ static void dfuse_parse_options(const char *options)
 		if (end == endword) {
 			dfuse_length = number;
 		} else {
-			errx(EX_IOERR, "Invalid dfuse modifier: %s", options);
+			warnx("Invalid dfuse modifier: %s", options);
+			return -EINVAL;
 		}
 		options = endword;
 	}
+	return 0;
 }
 
 /* DFU_UPLOAD request for DfuSe 1.1a */
 static int dfuse_upload(dfu_if *dif, const unsigned short length,
 		 unsigned char *data, unsigned short transaction)
 {
+	uint64_t start = dfu_stats_clock();
 	int status;
 
-	status = libusb_control_transfer(dif->dev_handle,
+	status = dfu_control_transfer(dif->dev_handle,
 		 /* bmRequestType */	 LIBUSB_ENDPOINT_IN |
 					 LIBUSB_REQUEST_TYPE_CLASS |
 					 LIBUSB_RECIPIENT_INTERFACE,
@@ -139,6 +154,9 @@ static int dfuse_upload(dfu_if *dif, const unsigned short length,
 		 /* Data          */	 data,
 		 /* wLength       */	 length,
 					 DFU_TIMEOUT);
+	dfu_stats_record(dif, DFU_STAT_UPLOAD, start);
+	DFU_PROBE5(upload, dfu_trace_dev(dif), transaction, length, status,
+		   dfu_stats_clock() - start);
 	if (status < 0) {
 		warnx("dfuse_upload: libusb_control_transfer returned %d (%s)",
 		      status, libusb_error_name(status));
@@ -150,9 +168,10 @@ static int dfuse_upload(dfu_if *dif, const unsigned short length,
 static int dfuse_download(dfu_if *dif, const unsigned short length,
 		   unsigned char *data, unsigned short transaction)
 {
+	uint64_t start = dfu_trace_clock(dnload);
 	int status;
 
-	status = libusb_control_transfer(dif->dev_handle,
+	status = dfu_control_transfer(dif->dev_handle,
 		 /* bmRequestType */	 LIBUSB_ENDPOINT_OUT |
 					 LIBUSB_REQUEST_TYPE_CLASS |
 					 LIBUSB_RECIPIENT_INTERFACE,
@@ -162,6 +181,8 @@ static int dfuse_download(dfu_if *dif, const unsigned short length,
 		 /* Data          */	 data,
 		 /* wLength       */	 length,
 					 DFU_TIMEOUT);
+	DFU_PROBE5(dnload, dfu_trace_dev(dif), transaction, length, status,
+		   dfu_trace_since(start));
 	if (status < 0) {
 		warnx("dfuse_download: libusb_control_transfer returned %d (%s)",
 		      status, libusb_error_name(status));
@@ -170,9 +191,11 @@ static int dfuse_download(dfu_if *dif, const unsigned short length,
 }
 
 /* DfuSe only commands */
-/* Leaves the device in dfuDNLOAD-IDLE state */
-static int dfuse_special_command(dfu_if *dif, unsigned int address,
-			  enum dfuse_command command)
+/* Leaves the device in dfuDNLOAD-IDLE state, returns a negative value
+ * on failure and -ECANCELED with the device aborted once cancelled.
+ * Pages are erased without looking at the memory layout. */
+static int dfuse_send_command(dfu_if *dif, unsigned int address,
+			      enum dfuse_command command)
 {
 	const char* dfuse_command_name[] = { "SET_ADDRESS" , "ERASE_PAGE",
 					     "MASS_ERASE", "READ_UNPROTECT"};
@@ -184,24 +207,14 @@ static int dfuse_special_command(dfu_if *dif, unsigned int address,
 	int zerotimeouts = 0;
 	int polltimeout = 0;
 	int stalls = 0;
+	uint64_t start = dfu_stats_clock();
 
-	if (command == ERASE_PAGE) {
-		struct memsegment *segment;
-		int page_size;
+	if (dfu_cancelled(dif->cancel))
+		return dfu_cancel_abort(dif);
 
-		segment = find_segment(mem_layout, address);
-		if (!segment || !(segment->memtype & DFUSE_ERASABLE)) {
-			errx(EX_IOERR, "Page at 0x%08x can not be erased",
-				address);
-		}
-		page_size = segment->pagesize;
-		if (verbose)
-			fprintf(stderr, "Erasing page size %i at address 0x%08x, page "
-			       "starting at 0x%08x\n", page_size, address,
-			       address & ~(page_size - 1));
+	if (command == ERASE_PAGE) {
 		buf[0] = 0x41;	/* Erase command */
 		length = 5;
-		last_erased_page = address & ~(page_size - 1);
 	} else if (command == SET_ADDRESS) {
 		if (verbose > 1)
 			fprintf(stderr, "  Setting address pointer to 0x%08x\n",
@@ -215,7 +228,8 @@ static int dfuse_special_command(dfu_if *dif, unsigned int address,
 		buf[0] = 0x92;
 		length = 1;
 	} else {
-		errx(EX_IOERR, "Non-supported special command %d", command);
+		warnx("Non-supported special command %d", command);
+		return -EINVAL;
 	}
 	buf[1] = address & 0xff;
 	buf[2] = (address >> 8) & 0xff;
@@ -224,8 +238,9 @@ static int dfuse_special_command(dfu_if *dif, unsigned int address,
 
 	ret = dfuse_download(dif, length, buf, 0);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error during special command \"%s\" download",
-			dfuse_command_name[command]);
+		warnx("Error during special command \"%s\" download",
+		      dfuse_command_name[command]);
+		return ret;
 	}
 	do {
 		ret = dfu_get_status(dif, &dst);
@@ -234,11 +249,13 @@ static int dfuse_special_command(dfu_if *dif, unsigned int address,
 		if (ret == LIBUSB_ERROR_PIPE && polltimeout != 0 && stalls < 3) {
 			dst.bState = DFU_STATE_dfuDNBUSY;
 			stalls++;
+			dfu_metrics_retry(DFU_RETRY_STALL);
 			if (verbose)
 				fprintf(stderr, "* Device stalled USB pipe, reusing last poll timeout\n");
 		} else if (ret < 0) {
-			errx(EX_IOERR, "Error during special command \"%s\" get_status",
-			     dfuse_command_name[command]);
+			warnx("Error during special command \"%s\" get_status",
+			      dfuse_command_name[command]);
+			return ret;
 		} else {
 			polltimeout = dst.bwPollTimeout;
 		}
@@ -248,8 +265,9 @@ static int dfuse_special_command(dfu_if *dif, unsigned int address,
 				fprintf(stderr, "state(%u) = %s, status(%u) = %s\n", dst.bState,
 				       dfu_state_to_string(dst.bState), dst.bStatus,
 				       dfu_status_to_string(dst.bStatus));
-				errx(EX_IOERR, "Wrong state after command \"%s\" download",
-				     dfuse_command_name[command]);
+				warnx("Wrong state after command \"%s\" download",
+				      dfuse_command_name[command]);
+				return -EIO;
 			}
 			/* STM32F405 lies about mass erase timeout */
 			if (command == MASS_ERASE && dst.bwPollTimeout == 100) {
@@ -260,46 +278,99 @@ static int dfuse_special_command(dfu_if *dif, unsigned int address,
 		/* wait while command is executed */
 		if (verbose > 1)
 			fprintf(stderr, "   Poll timeout %i ms\n", polltimeout);
-		milli_sleep(polltimeout);
-		if (command == READ_UNPROTECT)
+		if (dfu_cancel_sleep(dif->cancel, polltimeout))
+			return dfu_cancel_abort(dif);
+		if (command == READ_UNPROTECT) {
+			DFU_PROBE6(dfuse_command, dfu_trace_dev(dif), buf[0],
+				   address, ret, dst.bState,
+				   dfu_stats_clock() - start);
 			return ret;
+		}
 		/* Workaround for e.g. Black Magic Probe getting stuck */
 		if (dst.bwPollTimeout == 0) {
-			if (++zerotimeouts == 100)
-				errx(EX_IOERR, "Device stuck after special command request");
+			if (++zerotimeouts == 100) {
+				warnx("Device stuck after special command request");
+				return -EIO;
+			}
 		} else {
 			zerotimeouts = 0;
 		}
 	} while (dst.bState == DFU_STATE_dfuDNBUSY);
 
+	DFU_PROBE6(dfuse_command, dfu_trace_dev(dif), buf[0], address, ret,
+		   dst.bState, dfu_stats_clock() - start);
 	if (dst.bStatus != DFU_STATUS_OK) {
-		errx(EX_IOERR, "%s not correctly executed",
-			dfuse_command_name[command]);
+		warnx("%s not correctly executed", dfuse_command_name[command]);
+		return -EIO;
 	}
+	if (command == SET_ADDRESS)
+		dfu_stats_record(dif, DFU_STAT_SET_ADDRESS, start);
+	else if (command == ERASE_PAGE)
+		dfu_stats_record(dif, DFU_STAT_ERASE, start);
 	return ret;
 }
 
+/* The same, checking pages to erase against the memory layout */
+static int dfuse_special_command(dfu_if *dif, unsigned int address,
+			  enum dfuse_command command)
+{
+	if (command == ERASE_PAGE) {
+		struct memsegment *segment;
+		int page_size;
+
+		segment = find_segment(mem_layout, address);
+		if (!segment || !(segment->memtype & DFUSE_ERASABLE)) {
+			warnx("Page at 0x%08x can not be erased", address);
+			return -EINVAL;
+		}
+		page_size = segment->pagesize;
+		if (verbose)
+			fprintf(stderr, "Erasing page size %i at address 0x%08x, page "
+			       "starting at 0x%08x\n", page_size, address,
+			       address & ~(page_size - 1));
+		last_erased_page = address & ~(page_size - 1);
+	}
+	return dfuse_send_command(dif, address, command);
+}
+
 static int dfuse_dnload_chunk(dfu_if *dif, unsigned char *data, int size,
 		       int transaction)
 {
 	int bytes_sent;
     dfu_status dst;
+	uint64_t start = dfu_stats_clock();
+	int polltimeout = 0;
+	int stalls = 0;
 	int ret;
 
 	ret = dfuse_download(dif, size, size ? data : NULL, transaction);
+	if (size)
+		dfu_stats_record(dif, DFU_STAT_DNLOAD, start);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error during download");
+		warnx("Error during download");
 		return ret;
 	}
 	bytes_sent = ret;
 
+	start = dfu_stats_clock();
 	do {
 		ret = dfu_get_status(dif, &dst);
-		if (ret < 0) {
-			errx(EX_IOERR, "Error during download get_status");
+		/* The STM32L4 workaround of dfuse_special_command() */
+		if (ret == LIBUSB_ERROR_PIPE && polltimeout != 0 && stalls < 3) {
+			dst.bState = DFU_STATE_dfuDNBUSY;
+			dst.bwPollTimeout = polltimeout;
+			stalls++;
+			dfu_metrics_retry(DFU_RETRY_STALL);
+			if (verbose)
+				fprintf(stderr, "* Device stalled USB pipe, reusing last poll timeout\n");
+		} else if (ret < 0) {
+			warnx("Error during download get_status");
 			return ret;
+		} else {
+			polltimeout = dst.bwPollTimeout;
 		}
-		milli_sleep(dst.bwPollTimeout);
+		if (dfu_cancel_sleep(dif->cancel, dst.bwPollTimeout))
+			return -ECANCELED;
 	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
 		 dst.bState != DFU_STATE_dfuERROR &&
 		 dst.bState != DFU_STATE_dfuMANIFEST &&
@@ -307,6 +378,8 @@ static int dfuse_dnload_chunk(dfu_if *dif, unsigned char *data, int size,
 
 	if (dst.bState == DFU_STATE_dfuMANIFEST)
 			printf("Transitioning to dfuMANIFEST state\n");
+	else if (size && dst.bState == DFU_STATE_dfuDNLOAD_IDLE)
+		dfu_stats_record(dif, DFU_STAT_DNLOAD_BUSY, start);
 
 	if (dst.bStatus != DFU_STATUS_OK) {
 		fprintf(stderr, " failed!\n");
@@ -318,7 +391,7 @@ static int dfuse_dnload_chunk(dfu_if *dif, unsigned char *data, int size,
 	return bytes_sent;
 }
 
-int dfuse_do_upload(dfu_if *dif, int xfer_size, int fd,
+int dfuse_do_upload(dfu_if *dif, int xfer_size, dfu_sink *sink,
 		    const char *dfuse_options)
 {
 	int total_bytes = 0;
@@ -327,26 +400,27 @@ int dfuse_do_upload(dfu_if *dif, int xfer_size, int fd,
 	int transaction;
 	int ret;
 
-	buf = dfu_malloc(xfer_size);
-
-	if (dfuse_options)
-		dfuse_parse_options(dfuse_options);
+	if (dfuse_options && dfuse_parse_options(dfuse_options))
+		return -EINVAL;
 	if (dfuse_length)
 		upload_limit = dfuse_length;
 	if (dfuse_address_present) {
 		struct memsegment *segment;
 
 		mem_layout = parse_memory_layout((char *)dif->alt_name);
-		if (!mem_layout)
-			errx(EX_IOERR, "Failed to parse memory layout");
+		if (!mem_layout) {
+			warnx("Failed to parse memory layout");
+			return -EINVAL;
+		}
 		if (dif->quirks & QUIRK_DFUSE_LAYOUT)
 			fixup_dfuse_layout(dif, &mem_layout);
 
 		segment = find_segment(mem_layout, dfuse_address);
 		if (!dfuse_force &&
-		    (!segment || !(segment->memtype & DFUSE_READABLE)))
-			errx(EX_IOERR, "Page at 0x%08x is not readable",
-				dfuse_address);
+		    (!segment || !(segment->memtype & DFUSE_READABLE))) {
+			warnx("Page at 0x%08x is not readable", dfuse_address);
+			return -EINVAL;
+		}
 
 		if (!upload_limit) {
 			if (segment) {
@@ -359,8 +433,12 @@ int dfuse_do_upload(dfu_if *dif, int xfer_size, int fd,
 				printf("Limiting upload to %i bytes\n", upload_limit);
 			}
 		}
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
-		dfu_abort_to_idle(dif);
+		ret = dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+		if (ret < 0)
+			return ret;
+		ret = dfu_abort_to_idle(dif);
+		if (ret < 0)
+			return ret;
 	} else {
 		/* Boot loader decides the start address, unknown to us */
 		/* Use a short length to lower risk of running out of bounds */
@@ -371,26 +449,37 @@ int dfuse_do_upload(dfu_if *dif, int xfer_size, int fd,
 		printf("Limiting default upload to %i bytes\n", upload_limit);
 	}
 
+	if (sink->fd < 0 && (size_t) upload_limit > sink->capacity)
+		upload_limit = sink->capacity;
+
 	dfu_progress_bar("Upload", 0, 1);
 
 	transaction = 2;
 	while (1) {
 		int rc;
 
+		if (dfu_cancelled(dif->cancel)) {
+			ret = dfu_cancel_abort(dif);
+			goto out;
+		}
 		/* last chunk can be smaller than original xfer_size */
 		if (upload_limit - total_bytes < xfer_size)
 			xfer_size = upload_limit - total_bytes;
+		buf = dfu_sink_next(sink, xfer_size);
 		rc = dfuse_upload(dif, xfer_size, buf, transaction++);
 		if (rc < 0) {
 			ret = rc;
-			goto out_free;
+			goto out;
 		}
 
-		dfu_file_write_crc(fd, 0, buf, rc);
+		dfu_sink_commit(sink, rc);
 		total_bytes += rc;
 
-		if (total_bytes < 0)
-			errx(EX_SOFTWARE, "Received too many bytes");
+		if (total_bytes < 0) {
+			warnx("Received too many bytes");
+			ret = -EOVERFLOW;
+			goto out;
+		}
 
 		if (rc < xfer_size || total_bytes >= upload_limit) {
 			/* last block, return successfully */
@@ -402,21 +491,22 @@ int dfuse_do_upload(dfu_if *dif, int xfer_size, int fd,
 
 	dfu_progress_bar("Upload", total_bytes, total_bytes);
 
-	dfu_abort_to_idle(dif);
+	if (dfu_abort_to_idle(dif) < 0) {
+		ret = -EIO;
+		goto out;
+	}
 	if (dfuse_leave) {
 		if (dfuse_address_present)
 			dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
 		dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
 	}
 
- out_free:
-	free(buf);
-
+ out:
 	return ret;
 }
 
 /* Writes an element of any size to the device, taking care of page erases */
-/* returns 0 on success, otherwise -EINVAL */
+/* returns 0 on success, otherwise a negative errno */
 static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 			 unsigned int dwElementSize, unsigned char *data,
 			 int xfer_size)
@@ -430,8 +520,9 @@ static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 	    find_segment(mem_layout, dwElementAddress + dwElementSize - 1);
 	if (!dfuse_force &&
             (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
-		errx(EX_IOERR, "Last page at 0x%08x is not writeable",
-			dwElementAddress + dwElementSize - 1);
+		warnx("Last page at 0x%08x is not writeable",
+		      dwElementAddress + dwElementSize - 1);
+		return -EINVAL;
 	}
 
 	if (!verbose)
@@ -444,11 +535,13 @@ static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 		unsigned int address = dwElementAddress + p;
 		int chunk_size = xfer_size;
 
+		if (dfu_cancelled(dif->cancel))
+			return dfu_cancel_abort(dif);
 		segment = find_segment(mem_layout, address);
 		if (!dfuse_force &&
 		    (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
-			errx(EX_IOERR, "Page at 0x%08x is not writeable",
-				address);
+			warnx("Page at 0x%08x is not writeable", address);
+			return -EINVAL;
 		}
 		/* If the location is not in the memory map we skip erasing */
 		/* since we wouldn't know the correct page size for flash erase */
@@ -466,21 +559,26 @@ static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 			/* erase all involved pages */
 			for (erase_address = address;
 			     erase_address < address + chunk_size;
-			     erase_address += page_size)
-				if ((erase_address & ~(page_size - 1)) !=
+			     erase_address += page_size) {
+				if ((erase_address & ~(page_size - 1)) ==
 				    last_erased_page)
-					dfuse_special_command(dif,
-							      erase_address,
-							      ERASE_PAGE);
+					continue;
+				ret = dfuse_special_command(dif, erase_address,
+							    ERASE_PAGE);
+				if (ret < 0)
+					return ret;
+			}
 
 			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
 			    last_erased_page) {
 				if (verbose > 1)
 					fprintf(stderr, " Chunk extends into next page,"
 					       " erase it as well\n");
-				dfuse_special_command(dif,
-						      address + chunk_size - 1,
-						      ERASE_PAGE);
+				ret = dfuse_special_command(dif,
+							    address + chunk_size - 1,
+							    ERASE_PAGE);
+				if (ret < 0)
+					return ret;
 			}
 			if (!verbose)
 				dfu_progress_bar("Erase   ", p, dwElementSize);
@@ -496,6 +594,8 @@ static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 		unsigned int address = dwElementAddress + p;
 		int chunk_size = xfer_size;
 
+		if (dfu_cancelled(dif->cancel))
+			return dfu_cancel_abort(dif);
 		/* check if this is the last chunk */
 		if (p + chunk_size > (int)dwElementSize)
 			chunk_size = dwElementSize - p;
@@ -509,14 +609,18 @@ static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 			dfu_progress_bar("Download", p, dwElementSize);
 		}
 		
-		dfuse_special_command(dif, address, SET_ADDRESS);
+		ret = dfuse_special_command(dif, address, SET_ADDRESS);
+		if (ret < 0)
+			return ret;
 
 		/* transaction = 2 for no address offset */
 		ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
+		if (ret == -ECANCELED)
+			return dfu_cancel_abort(dif);
 		if (ret != chunk_size) {
-			errx(EX_IOERR, "Failed to write whole chunk: "
-				"%i of %i bytes", ret, chunk_size);
-			return -EINVAL;
+			warnx("Failed to write whole chunk: "
+			      "%i of %i bytes", ret, chunk_size);
+			return ret < 0 ? ret : -EIO;
 		}
 	}
 	if (!verbose)
@@ -524,17 +628,19 @@ static int dfuse_dnload_element(dfu_if *dif, unsigned int dwElementAddress,
 	return 0;
 }
 
-static void
+static int
 dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem, int size)
 {
 	if (size > *rem) {
-		errx(EX_IOERR, "Corrupt DfuSe file: "
-		    "Cannot read %d bytes from %d bytes", size, *rem);
+		warnx("Corrupt DfuSe file: "
+		      "Cannot read %d bytes from %d bytes", size, *rem);
+		return -EINVAL;
 	}
 	if (dst != NULL)
 		memcpy(dst, *src, size);
 	(*src) += size;
 	(*rem) -= size;
+	return 0;
 }
 
 /* Download raw binary file to DfuSe device */
@@ -592,18 +698,18 @@ static int dfuse_do_dfuse_dnload(dfu_if *dif, int xfer_size,
         /* Must be larger than a minimal DfuSe header and suffix */
 	if (rem < (int)(sizeof(dfuprefix) +
 	    sizeof(targetprefix) + sizeof(elementheader))) {
-		errx(EX_SOFTWARE, "File too small for a DfuSe file");
+		warnx("File too small for a DfuSe file");
+		return -EINVAL;
         }
 
 	dfuse_memcpy(dfuprefix, &data, &rem, sizeof(dfuprefix));
 
 	if (strncmp((char *)dfuprefix, "DfuSe", 5)) {
-		errx(EX_IOERR, "No valid DfuSe signature");
+		warnx("No valid DfuSe signature");
 		return -EINVAL;
 	}
 	if (dfuprefix[5] != 0x01) {
-		errx(EX_IOERR, "DFU format revision %i not supported",
-			dfuprefix[5]);
+		warnx("DFU format revision %i not supported", dfuprefix[5]);
 		return -EINVAL;
 	}
 	bTargets = dfuprefix[10];
@@ -614,9 +720,10 @@ static int dfuse_do_dfuse_dnload(dfu_if *dif, int xfer_size,
 
 	for (image = 1; image <= bTargets; image++) {
 		printf("parsing DFU image %i\n", image);
-		dfuse_memcpy(targetprefix, &data, &rem, sizeof(targetprefix));
+		if (dfuse_memcpy(targetprefix, &data, &rem, sizeof(targetprefix)))
+			return -EINVAL;
 		if (strncmp((char *)targetprefix, "Target", 6)) {
-			errx(EX_IOERR, "No valid target signature");
+			warnx("No valid target signature");
 			return -EINVAL;
 		}
 		bAlternateSetting = targetprefix[6];
@@ -636,7 +743,9 @@ static int dfuse_do_dfuse_dnload(dfu_if *dif, int xfer_size,
 			       " to download this image!\n");
 		for (element = 1; element <= dwNbElements; element++) {
 			printf("parsing element %i, ", element);
-			dfuse_memcpy(elementheader, &data, &rem, sizeof(elementheader));
+			if (dfuse_memcpy(elementheader, &data, &rem,
+					 sizeof(elementheader)))
+				return -EINVAL;
 			dwElementAddress =
 			    quad2uint((unsigned char *)elementheader);
 			dwElementSize =
@@ -649,8 +758,10 @@ static int dfuse_do_dfuse_dnload(dfu_if *dif, int xfer_size,
 				dfuse_address = dwElementAddress;
 			}
 			/* sanity check */
-			if ((int)dwElementSize > rem)
-				errx(EX_SOFTWARE, "File too small for element size");
+			if ((int)dwElementSize > rem) {
+				warnx("File too small for element size");
+				return -EINVAL;
+			}
 
 			if (bAlternateSetting == dif->altsetting) {
 				ret = dfuse_dnload_element(dif, dwElementAddress,
@@ -675,58 +786,506 @@ static int dfuse_do_dfuse_dnload(dfu_if *dif, int xfer_size,
 	return 0;
 }
 
+/* Erase all of flash and leave the device in dfuIDLE */
+int dfuse_do_mass_erase(dfu_if *dif)
+{
+	int ret;
+
+	printf("Performing mass erase, this can take a moment\n");
+	ret = dfuse_special_command(dif, 0, MASS_ERASE);
+	if (ret < 0)
+		return ret;
+	return dfu_abort_to_idle(dif);
+}
+
+/* Start the application; the device drops off the bus */
+int dfuse_do_leave(dfu_if *dif)
+{
+	return dfuse_dnload_chunk(dif, NULL, 0, 2); /* Zero-size */
+}
+
+/*
+ * Run a plan made with dfu_plan_dfuse(). Every erase and write goes to
+ * the address the plan gives, so neither the options nor the layout
+ * kept here for dfuse_do_dnload() play a part, and sessions on other
+ * threads can run plans at the same time. percent follows the payload
+ * sent, progress (if not NULL) the ops done. Returns 0 or a negative
+ * value, -ECANCELED with the device aborted once cancelled.
+ */
+int dfuse_do_plan(dfu_if *dif, const dfu_plan *plan, int *percent,
+		  struct dfu_progress *progress)
+{
+	size_t bytes = 0;
+	int ret = 0;
+	int i;
+
+	if (percent != NULL)
+		*percent = 0;
+	for (i = 0; i < plan->count; i++) {
+		const dfu_plan_op *op = &plan->ops[i];
+
+		if (dfu_cancelled(dif->cancel))
+			return dfu_cancel_abort(dif);
+		switch (op->type) {
+		case DFU_PLAN_ERASE:
+			ret = dfuse_send_command(dif, op->address, ERASE_PAGE);
+			break;
+		case DFU_PLAN_SET_ADDRESS:
+			ret = dfuse_send_command(dif, op->address, SET_ADDRESS);
+			break;
+		case DFU_PLAN_DNLOAD:
+		case DFU_PLAN_MANIFEST:
+			ret = dfuse_dnload_chunk(dif, (unsigned char *) op->data,
+						 op->size, op->transaction);
+			if (ret == -ECANCELED)
+				return dfu_cancel_abort(dif);
+			if (ret >= 0 && ret != op->size) {
+				warnx("Failed to write whole chunk: "
+				      "%i of %i bytes", ret, op->size);
+				ret = -EIO;
+			}
+			break;
+		case DFU_PLAN_ABORT:
+			ret = dfu_abort_to_idle(dif);
+			break;
+		}
+		if (ret < 0)
+			return ret;
+		if (op->type == DFU_PLAN_DNLOAD) {
+			bytes += op->size;
+			if (percent != NULL && plan->bytes)
+				*percent = bytes * 100 / plan->bytes;
+		}
+		if (progress != NULL)
+			dfu_progress_update(progress, i + 1);
+	}
+	return 0;
+}
+
+#define DUMP_MAX_ALTS 32
+#define DFUSE_PREFIX_LENGTH 11
+#define DFUSE_TARGET_LENGTH 274
+#define DFUSE_ELEMENT_LENGTH 8
+
+/* A run of contiguous readable segments */
+struct dump_region {
+	unsigned int start;
+	unsigned int length;
+};
+
+struct dump_alt {
+	dfu_if *dif;
+	struct dump_region *regions;
+	int nregions;
+};
+
+static void put_le32(uint8_t *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+/*
+ * The alternate settings probed on the same interface as dif, dif
+ * itself if it was not probed (e.g. built from a handle)
+ */
+static int dump_find_alts(dfu_if *dif, struct dump_alt *alts)
+{
+	dfu_if *pdfu;
+	int count = 0;
+
+	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
+		if (pdfu->dev != dif->dev || pdfu->intf != dif->intf)
+			continue;
+		if (count == DUMP_MAX_ALTS)
+			break;
+		alts[count++].dif = pdfu;
+	}
+	if (count == 0)
+		alts[count++].dif = dif;
+	return count;
+}
+
+/* Merge the readable segments of the alt's layout into regions */
+static void dump_layout(struct dump_alt *alt)
+{
+	struct memsegment *layout;
+	struct memsegment *segment;
+
+	alt->regions = NULL;
+	alt->nregions = 0;
+	layout = parse_memory_layout((char *) alt->dif->alt_name);
+	if (!layout) {
+		warnx("Skipping alt %d, no memory layout", alt->dif->altsetting);
+		return;
+	}
+	if (alt->dif->quirks & QUIRK_DFUSE_LAYOUT)
+		fixup_dfuse_layout(alt->dif, &layout);
+
+	for (segment = layout; segment != NULL; segment = segment->next) {
+		struct dump_region *last;
+
+		if (!(segment->memtype & DFUSE_READABLE))
+			continue;
+		last = alt->nregions ? &alt->regions[alt->nregions - 1] : NULL;
+		if (last != NULL && last->start + last->length == segment->start) {
+			last->length += segment->end - segment->start + 1;
+			continue;
+		}
+		alt->regions = realloc(alt->regions,
+		    sizeof(*alt->regions) * (alt->nregions + 1));
+		if (alt->regions == NULL)
+			errx(EX_SOFTWARE, "Out of memory");
+		alt->regions[alt->nregions].start = segment->start;
+		alt->regions[alt->nregions].length = segment->end - segment->start + 1;
+		alt->nregions++;
+	}
+	free_segment_list(layout);
+}
+
+/*
+ * Read one region with a single SET_ADDRESS, the device advancing the
+ * address by the transfer size with each block number
+ */
+static int dump_region(dfu_if *dif, int xfer_size, const struct dump_region *region,
+		       dfu_sink *sink, unsigned int *done, unsigned int total,
+		       const char *label)
+{
+	unsigned int offset = 0;
+	unsigned int transaction = 2;
+	int ret;
+
+	ret = dfuse_special_command(dif, region->start, SET_ADDRESS);
+	if (ret < 0)
+		return ret;
+	ret = dfu_abort_to_idle(dif);
+	if (ret < 0)
+		return ret;
+
+	while (offset < region->length) {
+		int chunk = xfer_size;
+		unsigned char *buf;
+		int rc;
+
+		if (dfu_cancelled(dif->cancel))
+			return dfu_cancel_abort(dif);
+		if (region->length - offset < (unsigned int) chunk)
+			chunk = region->length - offset;
+		if (transaction > 0xffff) {
+			/* block number would wrap, move the pointer instead */
+			ret = dfuse_special_command(dif, region->start + offset,
+						    SET_ADDRESS);
+			if (ret < 0)
+				return ret;
+			ret = dfu_abort_to_idle(dif);
+			if (ret < 0)
+				return ret;
+			transaction = 2;
+		}
+		buf = dfu_sink_next(sink, chunk);
+		rc = dfuse_upload(dif, chunk, buf, transaction++);
+		if (rc < 0)
+			return -EIO;
+		dfu_sink_commit(sink, rc);
+		offset += rc;
+		*done += rc;
+		dfu_progress_bar(label, *done, total);
+		if (rc < chunk) {
+			warnx("Short read at 0x%08x", region->start + offset);
+			break;
+		}
+	}
+	ret = dfu_abort_to_idle(dif);
+	if (ret < 0)
+		return ret;
+	return offset;
+}
+
+/*
+ * Read length bytes from address on into sink, setting the address
+ * pointer first. Returns the number of bytes read or a negative value.
+ */
+int dfuse_do_read(dfu_if *dif, int xfer_size, unsigned int address,
+		  unsigned int length, dfu_sink *sink)
+{
+	struct dump_region region;
+	unsigned int done = 0;
+
+	if (xfer_size <= 0 || xfer_size > 0xffff)
+		return -EINVAL;
+	region.start = address;
+	region.length = length;
+	return dump_region(dif, xfer_size, &region, sink, &done, length,
+			   "Upload");
+}
+
+/* Returns 0 or a negative errno, e.g. -ENOSPC */
+static int write_all(int fd, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (size > 0) {
+		n = write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int dump_sparse(dfu_if *dif, int xfer_size, int fd,
+		       struct dump_alt *alts, int nalts, unsigned int total)
+{
+	unsigned int base = 0xffffffff;
+	unsigned int done = 0;
+	int ret = 0;
+	int a;
+	int r;
+
+	for (a = 0; a < nalts; a++)
+		for (r = 0; r < alts[a].nregions; r++)
+			if (alts[a].regions[r].start < base)
+				base = alts[a].regions[r].start;
+
+	for (a = 0; a < nalts && ret >= 0; a++) {
+		dfu_if alt = *alts[a].dif;
+
+		alt.dev_handle = dif->dev_handle;
+		alt.cancel = dif->cancel;
+		if (libusb_set_interface_alt_setting(alt.dev_handle, alt.intf,
+						     alt.altsetting) < 0)
+			return -EIO;
+		for (r = 0; r < alts[a].nregions && ret >= 0; r++) {
+			const struct dump_region *region = &alts[a].regions[r];
+			dfu_sink sink;
+			int err;
+
+			if (lseek(fd, (off_t) region->start - base, SEEK_SET) < 0)
+				return -errno;
+			dfu_sink_fd(&sink, fd);
+			sink.writer = dfu_writer_create(fd, xfer_size);
+			ret = dump_region(&alt, xfer_size, region, &sink, &done, total,
+					  "Dump");
+			err = dfu_sink_close(&sink);
+			if (err && ret >= 0)
+				ret = -err;
+		}
+	}
+	return ret < 0 ? ret : (int) done;
+}
+
+static int dump_dfuse(dfu_if *dif, int xfer_size, int fd,
+		      struct dump_alt *alts, int nalts, unsigned int total)
+{
+	size_t capacity = DFUSE_PREFIX_LENGTH;
+	unsigned int done = 0;
+	uint8_t suffix[16];
+	uint8_t *out;
+	size_t pos;
+	uint32_t crc;
+	int ret = 0;
+	int a;
+	int r;
+
+	for (a = 0; a < nalts; a++)
+		capacity += DFUSE_TARGET_LENGTH +
+		    (size_t) alts[a].nregions * DFUSE_ELEMENT_LENGTH;
+	capacity += total;
+	out = dfu_malloc(capacity);
+	memset(out, 0, capacity);
+
+	memcpy(out, "DfuSe", 5);
+	out[5] = 0x01;
+	out[10] = nalts;
+	pos = DFUSE_PREFIX_LENGTH;
+
+	for (a = 0; a < nalts && ret >= 0; a++) {
+		dfu_if alt = *alts[a].dif;
+		uint8_t *target = out + pos;
+		size_t target_start;
+
+		alt.dev_handle = dif->dev_handle;
+		alt.cancel = dif->cancel;
+		if (libusb_set_interface_alt_setting(alt.dev_handle, alt.intf,
+						     alt.altsetting) < 0) {
+			ret = -EIO;
+			break;
+		}
+		memcpy(target, "Target", 6);
+		target[6] = alt.altsetting;
+		if (alt.alt_name) {
+			put_le32(target + 7, 1);
+			strncpy((char *) target + 11, alt.alt_name, 254);
+		}
+		put_le32(target + 270, alts[a].nregions);
+		pos += DFUSE_TARGET_LENGTH;
+		target_start = pos;
+
+		for (r = 0; r < alts[a].nregions && ret >= 0; r++) {
+			const struct dump_region *region = &alts[a].regions[r];
+			dfu_sink sink;
+
+			dfu_sink_buffer(&sink, out + pos + DFUSE_ELEMENT_LENGTH,
+					region->length);
+			ret = dump_region(&alt, xfer_size, region, &sink, &done, total,
+					  "Dump");
+			dfu_sink_close(&sink);
+			put_le32(out + pos, region->start);
+			put_le32(out + pos + 4, sink.size);
+			pos += DFUSE_ELEMENT_LENGTH + sink.size;
+		}
+		put_le32(target + 266, pos - target_start);
+	}
+	if (ret < 0) {
+		free(out);
+		return ret;
+	}
+	put_le32(out + 6, pos);
+
+	suffix[0] = dif->bcdDevice & 0xff;
+	suffix[1] = dif->bcdDevice >> 8;
+	suffix[2] = dif->product & 0xff;
+	suffix[3] = dif->product >> 8;
+	suffix[4] = dif->vendor & 0xff;
+	suffix[5] = dif->vendor >> 8;
+	suffix[6] = 0x1a;
+	suffix[7] = 0x01;
+	suffix[8] = 'U';
+	suffix[9] = 'F';
+	suffix[10] = 'D';
+	suffix[11] = 16;
+	crc = dfu_crc32(0xffffffff, out, pos);
+	crc = dfu_crc32(crc, suffix, 12);
+	put_le32(suffix + 12, crc);
+	ret = write_all(fd, out, pos);
+	if (ret == 0)
+		ret = write_all(fd, suffix, sizeof(suffix));
+	free(out);
+	return ret < 0 ? ret : (int) done;
+}
+
+/*
+ * Read every readable segment of every alternate setting on the
+ * interface (flash, OTP, option bytes, ...) in one go. A sparse image
+ * puts each byte at its address minus the lowest address dumped,
+ * leaving holes for the gaps; fd must be seekable. A DfuSe file gets
+ * one target per alternate setting and one element per region.
+ * Returns the number of bytes read or a negative errno.
+ */
+int dfuse_do_dump(dfu_if *dif, int xfer_size, int fd,
+		  enum dfuse_dump_format format)
+{
+	struct dump_alt alts[DUMP_MAX_ALTS];
+	unsigned int total = 0;
+	int nalts;
+	int ret;
+	int a;
+	int r;
+
+	if (xfer_size <= 0 || xfer_size > 0xffff)
+		return -EINVAL;
+	nalts = dump_find_alts(dif, alts);
+	for (a = 0; a < nalts; a++) {
+		dump_layout(&alts[a]);
+		for (r = 0; r < alts[a].nregions; r++)
+			total += alts[a].regions[r].length;
+	}
+	if (verbose)
+		printf("Dumping %u bytes from %d alternate settings\n", total, nalts);
+
+	dfu_progress_bar("Dump", 0, total ? total : 1);
+	if (format == DFUSE_DUMP_SPARSE)
+		ret = dump_sparse(dif, xfer_size, fd, alts, nalts, total);
+	else
+		ret = dump_dfuse(dif, xfer_size, fd, alts, nalts, total);
+
+	for (a = 0; a < nalts; a++)
+		free(alts[a].regions);
+	libusb_set_interface_alt_setting(dif->dev_handle, dif->intf, dif->altsetting);
+	return ret;
+}
+
 int dfuse_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file,
 		    const char *dfuse_options)
 {
 	int ret;
 
-	if (dfuse_options)
-		dfuse_parse_options(dfuse_options);
+	if (dfuse_options && dfuse_parse_options(dfuse_options))
+		return -EINVAL;
 	mem_layout = parse_memory_layout((char *)dif->alt_name);
-	if (!mem_layout)
-		errx(EX_IOERR, "Failed to parse memory layout");
+	if (!mem_layout) {
+		warnx("Failed to parse memory layout");
+		return -EINVAL;
+	}
 	if (dif->quirks & QUIRK_DFUSE_LAYOUT)
 		fixup_dfuse_layout(dif, &mem_layout);
 
 	if (dfuse_unprotect) {
+		free_segment_list(mem_layout);
 		if (!dfuse_force) {
-			errx(EX_IOERR, "The read unprotect command "
-				"will erase the flash memory"
-				"and can only be used with force\n");
+			warnx("The read unprotect command "
+			      "will erase the flash memory "
+			      "and can only be used with force");
+			return -EINVAL;
 		}
-		dfuse_special_command(dif, 0, READ_UNPROTECT);
+		ret = dfuse_special_command(dif, 0, READ_UNPROTECT);
+		if (ret < 0)
+			return ret;
 		printf("Device disconnects, erases flash and resets now\n");
-		exit(0);
+		return 0;
 	}
 	if (dfuse_mass_erase) {
 		if (!dfuse_force) {
-			errx(EX_IOERR, "The mass erase command "
-				"can only be used with force");
+			warnx("The mass erase command "
+			      "can only be used with force");
+			free_segment_list(mem_layout);
+			return -EINVAL;
 		}
 		printf("Performing mass erase, this can take a moment\n");
-		dfuse_special_command(dif, 0, MASS_ERASE);
+		ret = dfuse_special_command(dif, 0, MASS_ERASE);
+		if (ret < 0) {
+			free_segment_list(mem_layout);
+			return ret;
+		}
 	}
 	if (!file->name) {
 		printf("DfuSe command mode\n");
 		ret = 0;
 	} else if (dfuse_address_present) {
 		if (file->bcdDFU == 0x11a) {
-			errx(EX_IOERR, "This is a DfuSe file, not "
-				"meant for raw download");
+			warnx("This is a DfuSe file, not "
+			      "meant for raw download");
+			ret = -EINVAL;
+		} else {
+			ret = dfuse_do_bin_dnload(dif, xfer_size, file,
+						  dfuse_address);
 		}
-		ret = dfuse_do_bin_dnload(dif, xfer_size, file, dfuse_address);
 	} else {
 		if (file->bcdDFU != 0x11a) {
 			warnx("Only DfuSe file version 1.1a is supported");
-			errx(EX_IOERR, "(for raw binary download, use the "
-			     "--dfuse-address option)");
+			warnx("(for raw binary download, use the "
+			      "--dfuse-address option)");
+			ret = -EINVAL;
+		} else {
+			ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
 		}
-		ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
 	}
 	free_segment_list(mem_layout);
+	if (ret < 0)
+		return ret;
 
 	if (!dfuse_will_reset) {
-		dfu_abort_to_idle(dif);
+		int err = dfu_abort_to_idle(dif);
+		if (err < 0)
+			return err;
 	}
 
 	if (dfuse_leave) {
@@ -23,11 +23,27 @@
 
 #include "dfu.h"
 
+struct dfu_plan;
+struct dfu_progress;
+
 enum dfuse_command { SET_ADDRESS, ERASE_PAGE, MASS_ERASE, READ_UNPROTECT };
 
-int dfuse_do_upload(dfu_if *dif, int xfer_size, int fd,
+enum dfuse_dump_format {
+	DFUSE_DUMP_SPARSE,	/* raw image, offset = address - lowest address */
+	DFUSE_DUMP_DFUSE	/* DfuSe file, one target per alternate setting */
+};
+
+int dfuse_do_upload(dfu_if *dif, int xfer_size, dfu_sink *sink,
 		    const char *dfuse_options);
 int dfuse_do_dnload(dfu_if *dif, int xfer_size, dfu_file *file,
 		    const char *dfuse_options);
+int dfuse_do_plan(dfu_if *dif, const struct dfu_plan *plan, int *percent,
+		  struct dfu_progress *progress);
+int dfuse_do_read(dfu_if *dif, int xfer_size, unsigned int address,
+		  unsigned int length, dfu_sink *sink);
+int dfuse_do_mass_erase(dfu_if *dif);
+int dfuse_do_leave(dfu_if *dif);
+int dfuse_do_dump(dfu_if *dif, int xfer_size, int fd,
+		  enum dfuse_dump_format format);
 
 #endif /* DFUSE_H */
@@ -100,7 +100,8 @@ struct memsegment *parse_memory_layout(char *intf_desc)
 		warnx("Could not read name, sscanf returned %d", ret);
 		return NULL;
 	}
-	printf("DfuSe interface name: \"%s\"\n", name);
+	if (verbose)
+		printf("DfuSe interface name: \"%s\"\n", name);
 
 	intf_desc += scanned;
 	typestring = dfu_malloc(strlen(intf_desc));
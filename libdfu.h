@@ -18,8 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#ifndef DFU_H
-#define DFU_H
+#ifndef LIBDFU_H
+#define LIBDFU_H
 
 #ifdef  __cplusplus
 extern "C" {
@@ -43,7 +43,33 @@ extern "C" {
 DLL_EXPORT int dfu_flash(int fd, int *progress, int *finished);
 DLL_EXPORT int dfu_flash_filename(const char* filename, int *progress, int *finished);
 
+/* Same as dfu_flash() for an image already in memory */
+DLL_EXPORT int dfu_flash_buffer(const void *data, size_t size, int *progress, int *finished);
+
+/* Read at most size bytes of device memory into data. *received is
+ * what the device actually returned. */
+DLL_EXPORT int dfu_upload_to_buffer(void *data, size_t size, size_t *received,
+                                    int *progress, int *finished);
+
+/* Flash through a libusb handle the application opened itself. The
+ * interface must already be in DFU mode, else EINVAL; the handle is
+ * left open. A device that asks for a reset after the download is
+ * reset through the handle and usually comes back at a new address. */
+struct libusb_device_handle;
+DLL_EXPORT int dfu_flash_handle(struct libusb_device_handle *handle, int interface,
+                                int altsetting, int fd, int *progress, int *finished);
+
+/* Stop the flash or upload call running in another thread. It returns
+ * ECANCELED soon after, with the device sent back to dfuIDLE. A cancel
+ * before a call starts has no effect on it. */
+DLL_EXPORT void dfu_flash_cancel(void);
+
+/* Share devices with other flashing processes through lock files in dir.
+ * With more than one device connected, each call then takes the first
+ * device not held by anyone else. NULL turns locking off. */
+DLL_EXPORT void dfu_set_lock_dir(const char *dir);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
-#endif /* DFU_H */
+#endif /* LIBDFU_H */
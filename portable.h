@@ -70,4 +70,8 @@
 # define O_BINARY   0
 #endif
 
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+
 #endif /* PORTABLE_H */